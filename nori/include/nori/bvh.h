@@ -20,6 +20,9 @@
 #define __NORI_BVH_H
 
 #include <nori/shape.h>
+#include <tbb/cache_aligned_allocator.h>
+#include <atomic>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
@@ -42,10 +45,83 @@ NORI_NAMESPACE_BEGIN
  */
 class BVH {
     friend class BVHBuildTask;
+    friend class SBVHBuilder;
+    friend class LBVHBuilder;
+    friend class TreeletOptimizer;
 public:
     /// Create a new and empty BVH
     BVH() { m_shapeOffset.push_back(0u); }
 
+    /**
+     * \brief Create a new and empty BVH using parameters
+     * from the scene description
+     *
+     * The following parameters are supported:
+     *
+     * \c bvhWidth (2, 4 or 8): when larger than 2, the binary SAH
+     * tree is collapsed into a wide BVH after construction. Its nodes
+     * store the bounding boxes of all children in structure-of-arrays
+     * form, which lets traversal cull all children using a single
+     * sequence of SIMD operations.
+     *
+     * \c bvhQuantization (0, 8 or 16): when nonzero, the wide nodes
+     * store their child bounding boxes using integers with this number of
+     * bits relative to the bounds of the node itself. The quantized boxes
+     * are rounded outwards, hence traversal is exact and may only visit a
+     * few more nodes. 8-bit nodes are half as large as regular ones,
+     * which improves cache utilization on large scenes. This requires a
+     * width of 4 or 8.
+     *
+     * \c bvhCache (filename): when specified, the tree is stored in
+     * this file after construction, along with a hash of the vertex and
+     * index buffers of all shapes. Later runs whose geometry has the
+     * same hash memory-map the file instead of building the tree again.
+     * Relative paths refer to the directory of the scene file.
+     *
+     * \c bvhBuilder (\c sah, \c sbvh, \c lbvh or \c hlbvh): selects the
+     * construction algorithm. \c sbvh builds a spatial split BVH, which
+     * also considers splitting nodes with a plane and referencing the
+     * primitives that straddle it from both children. This takes longer,
+     * but reduces the overlap of sibling nodes for long and thin triangles.
+     * A regular tree is built as well, and kept if the spatial splits
+     * do not lower the SAH cost.
+     * \c lbvh sorts the primitives along a Morton curve and builds the
+     * tree in linear time, which is meant for previews of large scenes.
+     * \c hlbvh additionally builds the top levels using the SAH.
+     *
+     * \c bvhRestructure (boolean, default \c false): after construction,
+     * replace small treelets of the tree by the topology with the lowest
+     * SAH cost over the same subtrees (see \ref TreeletOptimizer). This
+     * improves the greedy top-down builders at a small cost.
+     *
+     * \c bvhLayout (\c depth-first or \c clustered): order of the nodes
+     * used for traversal. The tree is built in depth-first order, where
+     * the left child of a node directly follows it, but the right one is
+     * usually far away. \c clustered stores the two children of a binary
+     * node next to each other in one cache line, and groups the nodes
+     * into blocks of \c bvhBlockSize bytes (default 4096) that contain
+     * the top levels of a subtree in breadth-first order. Wide nodes are
+     * grouped in the same way. Hence, a descent only touches a few
+     * blocks. The binary tree needs a second copy of the nodes for this.
+     *
+     * \c bvhSplitBudget (float, default 0.3): the number of additional
+     * primitive references that spatial splits may create, relative to
+     * the number of primitives.
+     *
+     * \c bvhRefitThreshold (float, default 1.3): \ref refit() rebuilds
+     * the parts of the tree whose SAH cost grew by more than this factor.
+     *
+     * \c bvhLazy (boolean, default \c false): only build the top levels
+     * of the tree in \ref build(). Subtrees with at most \c bvhLazySize
+     * primitives (default 4096) are left as placeholders, which the first
+     * ray that reaches them builds (see \ref LazySubtree). Rendering then
+     * starts much earlier, and parts of the scene that no ray reaches are
+     * never built. This requires the \c sah builder and a width of 2, and
+     * cannot be combined with restructuring or a cache. The statistics of
+     * the tree only cover its top levels.
+     */
+    BVH(const PropertyList &propList);
+
     /// Release all resources
     virtual ~BVH() { clear(); };
 
@@ -59,9 +135,36 @@ public:
      */
     void addShape(Shape *shape);
 
-    /// Build the BVH
+    /**
+     * \brief Build the BVH
+     *
+     * This can be called again after the vertex positions of the meshes
+     * have changed, which constructs a new tree from scratch (unlike
+     * \ref refit()).
+     */
     void build();
 
+    /**
+     * \brief Update the BVH after the vertex positions of its meshes
+     * have changed (see \ref Mesh::setVertexPositions())
+     *
+     * The bounding boxes of all nodes are recomputed bottom-up, while the
+     * topology of the tree stays the same. This is much cheaper than
+     * \ref build(), but the tree degrades when primitives move relative to
+     * each other. Hence, the SAH cost of every subtree is compared to its
+     * cost after construction: subtrees that became more expensive by
+     * more than the \c bvhRefitThreshold factor are rebuilt, and the
+     * entire tree is rebuilt if this affects more than half of the
+     * primitives.
+     */
+    void refit();
+
+    /// Kind of ray intersection query
+    enum class Query {
+        ClosestHit, ///< Find the closest intersection and fill in an \ref Intersection
+        AnyHit      ///< Only determine whether there is any intersection at all
+    };
+
     /**
      * \brief Intersect a ray against all shapes registered
      * with the BVH
@@ -80,6 +183,128 @@ public:
     bool rayIntersect(const Ray3f &ray, Intersection &its, 
         bool shadowRay = false) const;
 
+    /**
+     * \brief Intersect a ray against all shapes registered
+     * with the BVH using a traversal specialized for the query type
+     *
+     * For <tt>Query::AnyHit</tt>, traversal stops at the first
+     * intersection that is found, children are not sorted by distance,
+     * and \c its is not touched.
+     *
+     * \return \c true If an intersection was found
+     */
+    template <Query Q> bool rayIntersect(const Ray3f &ray, Intersection &its) const;
+
+    /// Check whether a ray segment is occluded (any-hit query)
+    bool occluded(const Ray3f &ray) const;
+
+    /**
+     * \brief Find the closest intersection without computing the
+     * detailed hit information
+     *
+     * Only the \c t, \c uv and \c mesh fields of \c its are filled in,
+     * and \c prim receives the index of the intersected primitive within
+     * that shape. Passing both to \ref Shape::setHitInformation()
+     * completes the record. This is meant for nested trees (see the
+     * \c instance shape), which are queried for many candidate hits of
+     * which only the closest one matters.
+     */
+    bool rayIntersectPrimitive(const Ray3f &ray, Intersection &its, uint32_t &prim) const;
+
+    /// Node and primitive counts gathered during ray traversal
+    struct TraversalStats {
+        uint64_t nodes = 0;      ///< Number of visited nodes (including leaves)
+        uint64_t primitives = 0; ///< Number of primitives in visited leaves
+
+        void node() { ++nodes; }
+        void leaf(uint32_t size) { primitives += size; }
+    };
+
+    /**
+     * \brief Variant of \ref rayIntersect() that accumulates traversal
+     * statistics
+     *
+     * This is slower than the regular query and meant for benchmarks.
+     * When \c ordered is \c false, the tree is traversed in storage
+     * order rather than front to back.
+     */
+    bool rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay,
+        TraversalStats &stats, bool ordered = true) const;
+
+    /**
+     * \brief Quality metrics of the tree (see \ref computeStatistics())
+     *
+     * The expected counts are the ones assumed by the SAH, i.e. for rays
+     * that are uniformly distributed among those hitting the bounding box
+     * of the scene. They refer to the same events as \ref TraversalStats,
+     * which makes it possible to compare the model with actual rays.
+     */
+    struct TreeStatistics {
+        uint32_t innerNodes = 0;       ///< Number of inner nodes of the binary tree
+        uint32_t leaves = 0;           ///< Number of leaves of the binary tree
+        uint64_t references = 0;       ///< Number of primitive references in all leaves
+        float sahCost = 0;             ///< SAH cost of the binary tree
+        float expectedNodes = 0;       ///< Expected number of visited traversal nodes per ray
+        float expectedPrimitives = 0;  ///< Expected number of tested primitives per ray
+        float overlap = 0;             ///< Mean surface area of the intersection of siblings relative to their parent
+        float overlapVisits = 0;       ///< Expected number of inner nodes per ray that pass through the intersection of their children
+        float epo = 0;                 ///< Effective parent overlap (0 if it was not computed)
+        std::vector<uint32_t> leafDepths;  ///< Number of leaves at every depth of the binary tree
+        std::vector<uint32_t> leafSizes;   ///< Number of leaves with every primitive count
+        std::vector<uint32_t> levelNodes;  ///< Number of traversal nodes (binary or wide) on every level
+        std::vector<size_t> levelMemory;   ///< Memory used by the traversal nodes on every level
+        size_t primitiveMemory = 0;    ///< Memory used by the leaf-ordered primitive blocks
+    };
+
+    /**
+     * \brief Compute quality metrics of the tree
+     *
+     * The effective parent overlap (EPO) was proposed in the paper
+     *
+     * "On Quality Metrics of Bounding Volume Hierarchies"
+     * by Timo Aila, Tero Karras and Samuli Laine (HPG 2013).
+     *
+     * It is the surface area of all geometry that lies inside the box of
+     * a node without being referenced by its subtree, weighted by the
+     * cost of the node and relative to the weighted surface area of all
+     * nodes. Traversal cannot avoid visiting such nodes, hence it
+     * correlates with ray tracing performance much better than the SAH
+     * cost when siblings overlap. It requires a query per node and is
+     * expensive on large scenes, hence \c epo can be set to \c false.
+     */
+    TreeStatistics computeStatistics(bool epo = true) const;
+
+    /**
+     * \brief Intersect a packet of up to 8 rays against all shapes
+     * registered with the BVH
+     *
+     * The rays are traversed together using a shared stack, and each
+     * node is tested against all rays of the packet using SIMD
+     * operations. This pays off when the rays are
+     * coherent, e.g. for camera rays of neighboring pixels or for shadow
+     * rays towards the same light source.
+     *
+     * \param rays
+     *    Array of \c count rays
+     * \param its
+     *    Array of \c count intersection records. These are filled just
+     *    like in \ref rayIntersect(). Any-hit queries don't use them,
+     *    and \c nullptr may be passed instead.
+     * \param count
+     *    Number of rays in the packet (at most 8)
+     * \return A bit mask, whose i-th bit is set if the i-th ray found
+     *    an intersection
+     */
+    template <Query Q> uint32_t rayIntersect8(const Ray3f *rays, Intersection *its,
+        uint32_t count) const;
+
+    /// Variant of \ref rayIntersect8() that selects the query type at runtime
+    uint32_t rayIntersect8(const Ray3f *rays, Intersection *its, uint32_t count,
+        bool shadowRay = false) const;
+
+    /// Return the branching factor used for traversal (2, 4 or 8)
+    uint32_t getWidth() const { return m_width; }
+
     /// Return the total number of shapes registered with the BVH
     uint32_t getShapeCount() const { return (uint32_t) m_shapes.size(); }
 
@@ -97,6 +322,12 @@ public:
         return m_bbox;
     }
 
+    /**
+     * \brief Return the peak memory used by the last construction of the
+     * hierarchy, including the tree itself (0 if it was loaded from a cache)
+     */
+    size_t getPeakBuildMemory() const { return m_peakBuildMemory; }
+
 protected:
     /**
      * \brief Compute the shape and primitive indices corresponding to
@@ -123,6 +354,107 @@ protected:
     /// Compute internal tree statistics
     std::pair<float, uint32_t> statistics(uint32_t index = 0) const;
 
+    /**
+     * \brief Construct \ref m_nodes for the primitives listed in
+     * \ref m_indices, which are reordered (called by \ref build())
+     *
+     * \param bbox Bounding box of the primitives
+     */
+    void construct(const BoundingBox3f &bbox);
+
+    /// Construct \ref m_nodes and \ref m_indices over all primitives using the selected builder
+    void constructTree();
+
+    /// Compute \ref m_primitives and the wide nodes from the binary tree
+    void prepareTraversal();
+
+    /// Return the depth of the deepest leaf of the binary tree (the root has depth 0)
+    uint32_t getMaxDepth() const;
+
+    /**
+     * \brief Compute the SAH cost of all nodes of a subtree and
+     * optionally update their bounding boxes first (called by \ref refit())
+     */
+    void refitNode(uint32_t node_idx, std::vector<float> &costs, bool updateBounds,
+        uint32_t depth = 0);
+
+    /**
+     * \brief Find the subtrees below a degraded node that are responsible
+     * for the increase of its SAH cost
+     */
+    void findDegradedSubtrees(uint32_t node_idx, const std::vector<float> &costs,
+        std::vector<uint32_t> &result) const;
+
+    /// Return the range of nodes and indices occupied by a subtree
+    void getSubtreeRange(uint32_t node_idx, uint32_t &node_end, uint32_t &index_start,
+        uint32_t &index_end) const;
+
+    /// Replace a subtree by a newly constructed one (called by \ref refit())
+    void rebuildSubtree(uint32_t node_idx);
+
+    /// Compute a hash of the geometry of all registered shapes
+    uint64_t computeGeometryHash() const;
+
+    /// Try to load the tree from the cache file (returns \c false if it is missing or stale)
+    bool loadCache(uint64_t hash);
+
+    /// Write the tree to the cache file
+    void saveCache(uint64_t hash) const;
+
+    /**
+     * Maximum depth of a leaf, which determines the size of the traversal
+     * stacks. Deeper trees are rejected by \ref prepareTraversal().
+     */
+    enum : uint32_t { MAX_DEPTH = 64 };
+
+    /// Construction algorithm (see the \c bvhBuilder parameter)
+    enum class Builder : uint8_t {
+        SAH,   ///< Binned SAH (\ref BVHBuildTask)
+        SBVH,  ///< Spatial split BVH (\ref SBVHBuilder)
+        LBVH,  ///< Linear BVH (\ref LBVHBuilder)
+        HLBVH  ///< Linear BVH with SAH top levels (\ref LBVHBuilder)
+    };
+
+    /// Statistics policy of regular queries, which discards all counts
+    struct NoStats {
+        void node() { }
+        void leaf(uint32_t) { }
+    };
+
+    /**
+     * \brief Traverse the BVH (called by \ref rayIntersect())
+     *
+     * Inner nodes of the binary tree store their split axis. When
+     * \c Ordered is \c true, the child on the near side of the split
+     * plane (according to the sign of the ray direction) is visited
+     * first, which shrinks the ray segment early on.
+     *
+     * When \c prim is specified, the index of the intersected primitive
+     * is stored there instead of calling \ref Shape::setHitInformation().
+     */
+    template <Query Q, bool Ordered, typename Stats> bool traverse(const Ray3f &ray,
+        Intersection *its, Stats &stats, uint32_t *prim = nullptr) const;
+
+    /**
+     * \brief Intersect a ray against the primitives referenced by a leaf node
+     *
+     * Triangles are tested a block at a time using the watertight
+     * algorithm of the paper
+     *
+     * "Watertight Ray/Triangle Intersection" by Sven Woop, Carsten Benthin
+     * and Ingo Wald (Journal of Computer Graphics Techniques, 2013),
+     *
+     * which does not miss rays that pass through the shared edges or
+     * vertices of adjacent triangles. Spheres are tested a block at a
+     * time as well, and only other shapes are intersected through
+     * \ref Shape::rayIntersectNested() or \ref Shape::rayOccluded().
+     */
+    template <Query Q> bool intersectLeaf(uint32_t start, uint32_t end, Ray3f &ray,
+        Intersection *its, uint32_t &f) const;
+
+    /// Node array whose storage is aligned to cache lines
+    template <typename T> using NodeVector = std::vector<T, tbb::cache_aligned_allocator<T>>;
+
     /* BVH node in 32 bytes */
     struct BVHNode {
         union {
@@ -162,11 +494,305 @@ protected:
             return leaf.start + leaf.size;
         }
     };
+
+    /**
+     * \brief Precomputed primitives of a leaf in structure-of-arrays form
+     *
+     * The primitives of every leaf are grouped by their type and packed
+     * into blocks of \c Width lanes, so that \ref intersectLeaf() can test
+     * a ray against all primitives of a block at once with a kernel that
+     * is selected by a single switch per block. Triangles of a \ref Mesh
+     * and \ref Sphere instances store their geometry directly; any other
+     * primitive is of type \c EGeneric and intersected through
+     * \ref intersectGeneric(). The geometry of unused lanes is NaN,
+     * which never produces an intersection.
+     */
+    struct PrimitiveBlock {
+        enum : uint32_t { Width = 4 };
+
+        /// Types of primitives, in the order in which they are stored in a leaf
+        enum EType : uint32_t { ETriangles = 0, ESpheres, EGeneric, ETypeCount };
+
+        union {
+            struct {
+                float p0[3][Width];     ///< First vertex of every triangle
+                float p1[3][Width];     ///< Second vertex of every triangle
+                float p2[3][Width];     ///< Third vertex of every triangle
+            } triangles;
+
+            struct {
+                float center[3][Width]; ///< Center of every sphere
+                float radius[Width];    ///< Radius of every sphere
+            } spheres;
+        };
+        uint32_t shapeIdx[Width];   ///< Index of the shape
+        uint32_t primIdx[Width];    ///< Index of the primitive within the shape
+        uint32_t type;              ///< Type of all primitives of the block (\ref EType)
+        uint32_t count;             ///< Number of used lanes
+    };
+
+    /// Ray transformed into the space of the watertight triangle test
+    struct ShearedRay {
+        int kx, ky, kz;       ///< Permutation of the axes (the direction is largest along \c kz)
+        float sx, sy, sz;     ///< Shear that maps the direction onto the z axis
+
+        ShearedRay(const Ray3f &ray);
+    };
+
+    /**
+     * The following kernels intersect a ray against all lanes of a block
+     * with the corresponding \ref PrimitiveBlock::EType. They return the
+     * lane of the closest intersection (or of any intersection, for
+     * \c AnyHit queries) and store its distance and UV coordinates, or
+     * return -1 if there is none.
+     */
+    template <Query Q> static int intersectTriangles(const PrimitiveBlock &block,
+        const ShearedRay &sheared, const Ray3f &ray, float &t, Point2f &uv);
+
+    /// Sphere kernel (see \ref intersectTriangles())
+    template <Query Q> static int intersectSpheres(const PrimitiveBlock &block,
+        const Ray3f &ray, float &t, Point2f &uv);
+
+    /**
+     * \brief Kernel for other shapes, which calls \ref Shape::rayOccluded()
+     * or \ref Shape::rayIntersectNested() (see \ref intersectTriangles())
+     *
+     * \c nestedPrim receives the nested primitive of the closest hit.
+     */
+    template <Query Q> int intersectGeneric(const PrimitiveBlock &block,
+        const Ray3f &ray, float &t, Point2f &uv, uint32_t &nestedPrim) const;
+
+    /// Remove the unused entries of a conservatively allocated node array (in place)
+    static void compactNodes(std::vector<BVHNode> &nodes);
+
+    /**
+     * \brief Copy the tree whose root is the first node of \c input to
+     * \c output in depth-first order, and return the number of nodes
+     *
+     * \c leftChild maps the index of an inner node of \c input to that
+     * of its left child. \c input and \c output may be the same array if
+     * its nodes are in depth-first order already.
+     */
+    template <typename Input, typename LeftChild> static uint32_t storeDepthFirst(
+        const Input &input, std::vector<BVHNode> &output, LeftChild leftChild);
+
+    /// Account for \c bytes of memory being in use by the current build
+    void updatePeakBuildMemory(size_t bytes);
+
+    /// Compute \ref m_primitives and \ref m_leafBlocks from the shapes and \ref m_indices
+    void buildPrimitiveBlocks();
+
+    /**
+     * \brief Compute the primitive blocks of the leaves of \c nodes, which
+     * reference the index references in <tt>[start, end)</tt>
+     *
+     * \c leafBlocks receives the first block of the leaf that starts at
+     * each of these references (relative to \c start), and the end of the
+     * last one. Nested parallelism is avoided unless \c parallel is set.
+     */
+    void buildPrimitiveBlocks(const std::vector<BVHNode> &nodes, uint32_t start, uint32_t end,
+        NodeVector<PrimitiveBlock> &primitives, std::vector<uint32_t> &leafBlocks,
+        bool parallel) const;
+
+    /**
+     * \brief Nodes of a binary tree along with the primitive blocks of
+     * its leaves, which is either the top of the BVH or a \ref LazySubtree
+     */
+    struct BinaryTree {
+        const BVHNode *nodes;              ///< Nodes in depth-first or clustered order
+        bool clustered;                    ///< Are the nodes in clustered order?
+        const PrimitiveBlock *primitives;  ///< Primitive blocks of the leaves
+        const uint32_t *leafBlocks;        ///< First block of the leaf that starts at each index reference
+        uint32_t offset;                   ///< Index reference that corresponds to the first entry of \c leafBlocks
+
+        /// Return the first block of the leaf that starts at the given index reference
+        const PrimitiveBlock *getBlock(uint32_t ref) const {
+            return primitives + leafBlocks[ref - offset];
+        }
+    };
+
+    /**
+     * \brief Subtree that is built when a ray first reaches it (see the
+     * \c bvhLazy parameter)
+     *
+     * The top levels of the tree reference it through a placeholder, i.e.
+     * a leaf without primitives whose \c start field holds the index of
+     * the subtree. The first thread that reaches the placeholder claims
+     * the subtree by an atomic transition of its state, builds it
+     * serially (nested parallelism could make the thread wait for a task
+     * that waits for the subtree itself) and publishes it. Other threads
+     * that reach it in the meantime yield until it is ready, and later
+     * ones only pay for a single load of the state. The subtree owns its
+     * nodes and primitive blocks, while its leaves refer to the range of
+     * \ref m_indices that was reserved for it.
+     */
+    struct LazySubtree {
+        enum EState : uint32_t { EPending = 0, EBuilding, EReady };
+
+        std::atomic<uint32_t> state { EPending };   ///< Current \ref EState
+        uint32_t start = 0, end = 0;                ///< Range of index references of the subtree
+        std::vector<BVHNode> nodes;                 ///< Nodes in depth-first order
+        NodeVector<PrimitiveBlock> primitives;      ///< Primitive blocks of the leaves
+        std::vector<uint32_t> leafBlocks;           ///< First block of the leaf that starts at each reference (relative to \c start)
+    };
+
+    /// Return the binary tree in the node order used for traversal
+    BinaryTree getTopTree() const {
+        return BinaryTree { m_clustered ? m_clusteredNodes.data() : m_nodes.data(), m_clustered,
+                            m_primitives.data(), m_leafBlocks.data(), 0u };
+    }
+
+    /// Create the \ref LazySubtree instances of the placeholders of \ref m_nodes
+    void createLazySubtrees();
+
+    /// Return a lazily built subtree, and build it first if necessary
+    BinaryTree getLazySubtree(uint32_t index) const;
+
+    /// Build a subtree or wait for another thread to do so (called by \ref getLazySubtree())
+    void buildLazySubtree(LazySubtree &subtree) const;
+
+    /// Intersect a ray against a range of primitive blocks (see \ref intersectLeaf())
+    template <Query Q> bool intersectBlocks(const PrimitiveBlock *begin, const PrimitiveBlock *end,
+        Ray3f &ray, Intersection *its, uint32_t &f) const;
+
+    /// Traverse a binary tree, and the lazily built subtrees it references (called by \ref traverse())
+    template <Query Q, bool Ordered, typename Stats> bool traverseBinary(const BinaryTree &tree,
+        Ray3f &ray, Intersection *its, uint32_t &f, Stats &stats) const;
+
+    /**
+     * \brief Compute \ref m_clusteredNodes from the binary tree
+     *
+     * The children of every inner node are stored as an adjacent pair,
+     * whose right node is referenced by the \c rightChild field. The
+     * first pair only contains the root.
+     */
+    void clusterNodes();
+
+    /**
+     * \brief Wide BVH node with up to \c Width children
+     *
+     * The child bounding boxes are stored in structure-of-arrays form.
+     * Leaves are referenced directly by their parent, and unused child
+     * slots have an invalid bounding box that no ray can intersect.
+     */
+    template <int Width> struct WideNode {
+        enum { ChildCount = Width };
+        typedef float Bounds[6][Width];
+
+        Bounds bounds;          ///< min.x, min.y, min.z, max.x, max.y, max.z of each child
+        uint32_t child[Width];  ///< Index of a wide node, or first primitive of a leaf
+        uint32_t size[Width];   ///< Number of primitives of a leaf (0 for inner nodes)
+
+        /// Return the child bounding boxes (the buffer is not needed)
+        const Bounds &getBounds(Bounds &) const { return bounds; }
+    };
+
+    /**
+     * \brief Wide BVH node with quantized child bounding boxes
+     *
+     * Every axis of the node's bounding box is divided into steps of a
+     * power-of-two size, so that decoding is exact. The child bounds are
+     * stored as integer multiples of this step (\c T is \c uint8_t or
+     * \c uint16_t) and rounded outwards. Unused child slots have a lower
+     * bound that exceeds the upper one, but traversal must still skip
+     * them explicitly, since this does not rule out rounding to an
+     * intersection.
+     */
+    template <int Width, typename T> struct QuantizedWideNode {
+        enum { ChildCount = Width };
+        typedef float Bounds[6][Width];
+
+        float origin[3];        ///< Minimum corner of the node's bounding box
+        int8_t exponent[3];     ///< Base-2 logarithm of the step size along each axis
+        T lower[3][Width];      ///< Quantized minimum of each child
+        T upper[3][Width];      ///< Quantized maximum of each child
+        uint32_t child[Width];  ///< Index of a wide node, or first primitive of a leaf
+        uint32_t size[Width];   ///< Number of primitives of a leaf (0 for inner nodes)
+
+        /// Decode the child bounding boxes into \c buffer and return it
+        const Bounds &getBounds(Bounds &buffer) const;
+    };
+
+    /// Collapse a subtree of the binary BVH into wide nodes
+    template <int Width> uint32_t collapse(uint32_t node_idx,
+        NodeVector<WideNode<Width>> &nodes) const;
+
+    /// Convert wide nodes into ones with quantized bounding boxes
+    template <int Width, typename T> static void quantize(
+        const NodeVector<WideNode<Width>> &nodes,
+        NodeVector<QuantizedWideNode<Width, T>> &result);
+
+    /// Collapse the binary tree and optionally quantize it (called by \ref prepareTraversal())
+    template <int Width> void prepareWideNodes(NodeVector<WideNode<Width>> &nodes,
+        NodeVector<QuantizedWideNode<Width, uint8_t>> &nodes8Bit,
+        NodeVector<QuantizedWideNode<Width, uint16_t>> &nodes16Bit);
+
+    /// Reorder wide nodes into blocks of \ref m_blockSize bytes (see \ref clusterNodes())
+    template <typename Node> void clusterWideNodes(NodeVector<Node> &nodes) const;
+
+    /// Return the wide node array of the given type
+    template <typename Node> const NodeVector<Node> &getWideNodes() const;
+
+    /// Return the memory used by the wide nodes, and the size they would have without quantization
+    std::pair<size_t, size_t> getWideNodeMemory() const;
+
+    /**
+     * \brief Traverse the wide BVH (called by \ref rayIntersect())
+     *
+     * When \c Ordered is \c true, closest-hit queries visit the children
+     * of a node in order of increasing distance, otherwise in storage order.
+     */
+    template <Query Q, bool Ordered, typename Node, typename Stats> bool rayIntersectWide(Ray3f &ray,
+        Intersection *its, uint32_t &f, Stats &stats) const;
+
+    /// Traverse the wide BVH using the node format selected by the scene
+    template <Query Q, bool Ordered, typename Stats> bool rayIntersectWide(Ray3f &ray,
+        Intersection *its, uint32_t &f, Stats &stats) const;
+
+    /// Ray packet traversed by \ref rayIntersect8()
+    struct RayPacket8;
+
+    /// Intersect the selected rays of a packet against a range of primitive blocks
+    template <Query Q> void intersectLeafPacket(const PrimitiveBlock *begin,
+        const PrimitiveBlock *end, uint32_t mask, RayPacket8 &packet, Intersection *its) const;
+
+    /// Traverse a binary tree with a ray packet (called by \ref rayIntersect8())
+    template <Query Q> void rayIntersectPacket(const BinaryTree &tree, RayPacket8 &packet,
+        Intersection *its) const;
+
+    /// Traverse the wide BVH with a ray packet (called by \ref rayIntersect8())
+    template <Query Q, typename Node> void rayIntersectPacketWide(RayPacket8 &packet,
+        Intersection *its) const;
 private:
     std::vector<Shape *> m_shapes;       ///< List of meshes registered with the BVH
     std::vector<uint32_t> m_shapeOffset; ///< Index of the first triangle for each shape
     std::vector<BVHNode> m_nodes;       ///< BVH nodes
     std::vector<uint32_t> m_indices;    ///< Index references by BVH nodes
+    NodeVector<PrimitiveBlock> m_primitives; ///< Leaf-ordered primitive blocks
+    std::vector<uint32_t> m_leafBlocks; ///< First block of the leaf that starts at each index reference (and the end of the last one)
+    NodeVector<BVHNode> m_clusteredNodes; ///< Binary nodes in clustered order (if enabled)
+    NodeVector<WideNode<4>> m_nodes4;  ///< 4-wide BVH nodes (if enabled)
+    NodeVector<WideNode<8>> m_nodes8;  ///< 8-wide BVH nodes (if enabled)
+    NodeVector<QuantizedWideNode<4, uint8_t>> m_nodes4q8;   ///< 4-wide nodes with 8-bit bounds (if enabled)
+    NodeVector<QuantizedWideNode<8, uint8_t>> m_nodes8q8;   ///< 8-wide nodes with 8-bit bounds (if enabled)
+    NodeVector<QuantizedWideNode<4, uint16_t>> m_nodes4q16; ///< 4-wide nodes with 16-bit bounds (if enabled)
+    NodeVector<QuantizedWideNode<8, uint16_t>> m_nodes8q16; ///< 8-wide nodes with 16-bit bounds (if enabled)
+    uint32_t m_width = 2;               ///< Branching factor used for traversal
+    uint32_t m_quantization = 0;        ///< Number of bits of quantized wide node bounds (0: disabled)
+    Builder m_builder = Builder::SAH;   ///< Construction algorithm
+    bool m_restructure = false;         ///< Optimize the tree by treelet restructuring?
+    bool m_clustered = false;           ///< Traverse nodes in clustered order?
+    uint32_t m_blockSize = 4096;        ///< Size of the node blocks of the clustered order (in bytes)
+    float m_splitBudget = 0.3f;         ///< Relative number of additional references for spatial splits
+    float m_refitThreshold = 1.3f;      ///< Relative SAH cost increase that triggers a rebuild
+    uint32_t m_lazySize = 0;            ///< Maximum primitive count of lazily built subtrees (0: disabled)
+    std::vector<std::unique_ptr<LazySubtree>> m_lazySubtrees; ///< Subtrees referenced by placeholders (if enabled)
+    std::atomic<uint32_t> m_pendingSubtrees { 0 }; ///< Number of lazy subtrees that are not built yet
+    std::vector<float> m_buildCosts;    ///< SAH cost of every subtree after construction (computed by refit())
+    std::vector<BoundingBox3f> m_buildBounds; ///< Primitive bounding boxes (during construct(), and until all lazy subtrees are built)
+    std::vector<Point3f> m_buildCentroids;    ///< Primitive centroids (during construct(), and until all lazy subtrees are built)
+    size_t m_peakBuildMemory = 0;       ///< Peak memory of the last construction (see \ref getPeakBuildMemory())
+    std::string m_cacheFilename;        ///< BVH cache file (if enabled)
     BoundingBox3f m_bbox;               ///< Bounding box of the entire BVH
 };
 
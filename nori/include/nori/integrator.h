@@ -23,6 +23,8 @@
 
 NORI_NAMESPACE_BEGIN
 
+struct Intersection;
+
 /**
  * \brief Abstract integrator (i.e. a rendering technique)
  *
@@ -54,6 +56,31 @@ public:
      */
     virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const = 0;
 
+    /**
+     * \brief Sample the incident radiance along a camera ray whose
+     * first intersection has already been computed
+     *
+     * The renderer traces camera rays of neighboring pixels together
+     * as ray packets and hands the result to this function. The default
+     * implementation ignores \c its and calls \ref Li().
+     *
+     * \param scene
+     *    A pointer to the underlying scene
+     * \param sampler
+     *    A pointer to a sample generator
+     * \param ray
+     *    The ray in question
+     * \param its
+     *    The first intersection along \c ray, or \c nullptr if the
+     *    ray does not intersect the scene
+     * \return
+     *    A (usually) unbiased estimate of the radiance in this direction
+     */
+    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+                       const Intersection *its) const {
+        return Li(scene, sampler, ray);
+    }
+
     /**
      * \brief Return the type of object (i.e. Mesh/BSDF/etc.) 
      * provided by this instance
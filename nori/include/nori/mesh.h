@@ -21,9 +21,17 @@
 
 #include <nori/shape.h>
 #include <nori/dpdf.h>
+#include <Eigen/Geometry>
+#include <memory>
 
 NORI_NAMESPACE_BEGIN
 
+/// Read-only view of a matrix whose storage is owned elsewhere (see \ref Mesh)
+typedef Eigen::Map<const MatrixXf> MatrixXfView;
+
+/// Read-only view of an index matrix whose storage is owned elsewhere (see \ref Mesh)
+typedef Eigen::Map<const MatrixXu> MatrixXuView;
+
 /**
  * \brief Triangle mesh
  *
@@ -31,6 +39,31 @@ NORI_NAMESPACE_BEGIN
  * for querying the individual triangles. Subclasses of \c Mesh implement
  * the specifics of how to create its contents (e.g. by loading from an
  * external file)
+ *
+ * The vertex and index data are accessed through read-only views. They
+ * either point into matrices owned by the mesh, or into memory that is
+ * owned elsewhere, e.g. a memory-mapped file (see \ref setData()), which
+ * avoids copying the data when loading the mesh.
+ *
+ * To reduce the memory footprint of large meshes, the mesh plugins accept
+ * the following parameters:
+ *
+ * \c quantizeAttributes (boolean, default \c false): store the normals in
+ * an octahedral encoding with 2x16 bits, and the texture coordinates at
+ * half precision (4 instead of 12 and 8 bytes per vertex)
+ *
+ * \c quantizePositions (boolean, default \c false): store the positions
+ * with 21 bits per axis relative to the bounding box of the mesh (8 instead
+ * of 12 bytes per vertex)
+ *
+ * The views of quantized data are empty; \ref getVertexPosition(),
+ * \ref getVertexNormal() and \ref getVertexTexCoord() decode individual
+ * vertices on the fly, whether or not they are quantized.
+ *
+ * Since the data is never modified in place, meshes that load the same
+ * file with the same transform and quantization parameters share it
+ * (see \ref shareData()): the file is only parsed once, while every mesh
+ * keeps its own BSDF and emitter.
  */
 class Mesh : public Shape {
 public:
@@ -73,11 +106,53 @@ public:
      */
     virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override;
 
+    /**
+     * \brief Ray-triangle intersection test for a triangle given by
+     * one of its vertices and the two edges adjacent to it
+     *
+     * This is the kernel used by \ref rayIntersect(). It is exposed
+     * so that acceleration data structures can intersect precomputed
+     * triangle data without going through the mesh.
+     */
+    static bool rayIntersectTriangle(const Point3f &p0, const Vector3f &edge1, const Vector3f &edge2,
+                                     const Ray3f &ray, float &u, float &v, float &t) {
+        /* Begin calculating determinant - also used to calculate U parameter */
+        Vector3f pvec = ray.d.cross(edge2);
+
+        /* If determinant is near zero, ray lies in plane of triangle */
+        float det = edge1.dot(pvec);
+
+        if (det > -1e-8f && det < 1e-8f)
+            return false;
+        float inv_det = 1.0f / det;
+
+        /* Calculate distance from v[0] to ray origin */
+        Vector3f tvec = ray.o - p0;
+
+        /* Calculate U parameter and test bounds */
+        u = tvec.dot(pvec) * inv_det;
+        if (u < 0.0 || u > 1.0)
+            return false;
+
+        /* Prepare to test V parameter */
+        Vector3f qvec = tvec.cross(edge1);
+
+        /* Calculate V parameter and test bounds */
+        v = ray.d.dot(qvec) * inv_det;
+        if (v < 0.0 || u + v > 1.0)
+            return false;
+
+        /* Ray intersects triangle -> compute t */
+        t = edge2.dot(qvec) * inv_det;
+
+        return t >= ray.mint && t <= ray.maxt;
+    }
+
     /// Set intersection information: hit point, shading frame, UVs
     virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const override;
 
     /// Return the total number of vertices in this shape
-    uint32_t getVertexCount() const { return (uint32_t) m_V.cols(); }
+    uint32_t getVertexCount() const { return m_vertexCount; }
 
     /**
      * \brief Uniformly sample a position on the mesh with
@@ -92,35 +167,140 @@ public:
     Point3f getInterpolatedVertex(uint32_t index, const Vector3f & bc) const;
     Normal3f getInterpolatedNormal(uint32_t index, const Vector3f & bc) const;
 
-    /// Return a pointer to the vertex positions
-    const MatrixXf &getVertexPositions() const { return m_V; }
+    /// Return a pointer to the vertex positions (empty if they are quantized)
+    const MatrixXfView &getVertexPositions() const { return m_V; }
+
+    /// Return a pointer to the vertex normals (empty if there are none, or if they are quantized)
+    const MatrixXfView &getVertexNormals() const { return m_N; }
+
+    /// Return a pointer to the texture coordinates (empty if there are none, or if they are quantized)
+    const MatrixXfView &getVertexTexCoords() const { return m_UV; }
+
+    /// Return the position of a vertex
+    Point3f getVertexPosition(uint32_t index) const {
+        if (!m_quantizedV)
+            return m_V.col(index);
+        uint64_t q = m_quantizedV[index];
+        return Point3f(m_positionOffset + m_positionScale.cwiseProduct(Vector3f(
+            (float) (q & QUANTIZED_POSITION_MASK),
+            (float) ((q >> QUANTIZED_POSITION_BITS) & QUANTIZED_POSITION_MASK),
+            (float) (q >> (2 * QUANTIZED_POSITION_BITS)))));
+    }
+
+    /// Return the normal of a vertex (only valid if \ref hasVertexNormals())
+    Normal3f getVertexNormal(uint32_t index) const;
+
+    /// Return the texture coordinates of a vertex (only valid if \ref hasVertexTexCoords())
+    Point2f getVertexTexCoord(uint32_t index) const;
+
+    /// Does the mesh have per-vertex normals?
+    bool hasVertexNormals() const { return m_N.size() > 0 || m_quantizedN; }
 
-    /// Return a pointer to the vertex normals (or \c nullptr if there are none)
-    const MatrixXf &getVertexNormals() const { return m_N; }
+    /// Does the mesh have per-vertex texture coordinates?
+    bool hasVertexTexCoords() const { return m_UV.size() > 0 || m_quantizedUV; }
 
-    /// Return a pointer to the texture coordinates (or \c nullptr if there are none)
-    const MatrixXf &getVertexTexCoords() const { return m_UV; }
+    /// Return the memory used by the vertex and index data in bytes
+    size_t getDataSize() const;
 
     /// Return a pointer to the triangle vertex index list
-    const MatrixXu &getIndices() const { return m_F; }
+    const MatrixXuView &getIndices() const { return m_F; }
+
+    /**
+     * \brief Replace the vertex positions, e.g. for the next frame of
+     * an animation
+     *
+     * The topology stays the same, hence \c V must contain as many
+     * vertices as before. The normals are replaced as well when \c N is
+     * nonempty. \ref BVH::refit() must be called afterwards.
+     */
+    void setVertexPositions(const MatrixXf &V, const MatrixXf &N = MatrixXf());
 
 
     /// Return the name of this mesh
     const std::string &getName() const { return m_name; }
 
+    /**
+     * \brief Load a mesh using the plugin that matches the extension of
+     * its file (\c nmesh for \c .nmesh files, \c ply for \c .ply files,
+     * and \c obj otherwise)
+     *
+     * \c propList must contain the \c filename, and may specify other
+     * parameters of the plugin such as \c toWorld.
+     */
+    static Mesh *load(const PropertyList &propList);
+
     /// Return a human-readable summary of this instance
     virtual std::string toString() const override;
 
 protected:
+    /// Number of bits per axis of quantized vertex positions
+    static const int QUANTIZED_POSITION_BITS = 21;
+    static const uint64_t QUANTIZED_POSITION_MASK = (1ull << QUANTIZED_POSITION_BITS) - 1;
+
     /// Create an empty mesh
     Mesh();
 
+    /// Create an empty mesh, reading the quantization parameters from \c propList
+    Mesh(const PropertyList &propList);
+
+    /**
+     * \brief Take ownership of the vertex and index data (called by
+     * subclasses once they are loaded)
+     *
+     * \c N and \c UV may be empty. The bounding box is not updated, unless
+     * the positions are quantized.
+     */
+    void setData(MatrixXf V, MatrixXu F, MatrixXf N = MatrixXf(), MatrixXf UV = MatrixXf());
+
+    /**
+     * \brief Reference vertex and index data that is stored elsewhere,
+     * without copying it
+     *
+     * The arrays are in column-major order, i.e. 3 floats per position
+     * and normal, 2 per texture coordinate and 3 indices per triangle.
+     * \c N and \c UV may be \c nullptr. The mesh keeps a reference to
+     * \c storage, which must keep the arrays alive. The bounding box is
+     * not updated, unless the positions are quantized.
+     *
+     * If quantization is enabled, the data is encoded into arrays owned
+     * by the mesh, and \c storage is released.
+     */
+    void setData(std::shared_ptr<const void> storage, uint32_t vertexCount,
+                 uint32_t triangleCount, const float *V, const uint32_t *F,
+                 const float *N = nullptr, const float *UV = nullptr);
+
+    /// Replace the current vertex data by its quantized version (see \ref setData())
+    void quantize();
+
+    /**
+     * \brief Share the data of a mesh that was previously loaded from the
+     * same file with the same transform and quantization parameters
+     *
+     * Subclasses call this before loading \c filename. If such a mesh is
+     * still alive, its data and bounding box are referenced by this mesh,
+     * which is then ready to use, and \c true is returned.
+     */
+    bool shareData(const filesystem::path &filename, const Transform &trafo);
+
+    /// Make the data of this mesh available to later calls of \ref shareData()
+    void publishData(const filesystem::path &filename, const Transform &trafo) const;
+
 protected:
     std::string m_name;                  ///< Identifying name
-    MatrixXf      m_V;                   ///< Vertex positions
-    MatrixXf      m_N;                   ///< Vertex normals
-    MatrixXf      m_UV;                  ///< Vertex texture coordinates
-    MatrixXu      m_F;                   ///< Faces
+    MatrixXfView  m_V { nullptr, 3, 0 }; ///< Vertex positions
+    MatrixXfView  m_N { nullptr, 3, 0 }; ///< Vertex normals
+    MatrixXfView  m_UV { nullptr, 2, 0 }; ///< Vertex texture coordinates
+    MatrixXuView  m_F { nullptr, 3, 0 }; ///< Faces
+    std::shared_ptr<const void> m_storage; ///< Owner of the data referenced by the above views
+    uint32_t m_vertexCount = 0;          ///< Number of vertices
+
+    bool m_quantizeAttributes = false;   ///< Quantize normals and texture coordinates in \ref setData()?
+    bool m_quantizePositions = false;    ///< Quantize positions in \ref setData()?
+    const uint16_t *m_quantizedN = nullptr;  ///< Octahedral normals (2x16 bits), if quantized
+    const uint16_t *m_quantizedUV = nullptr; ///< Half precision texture coordinates, if quantized
+    const uint64_t *m_quantizedV = nullptr;  ///< Positions (3 x QUANTIZED_POSITION_BITS bits), if quantized
+    Vector3f m_positionOffset;           ///< Dequantized position = offset + scale * quantized value
+    Vector3f m_positionScale;
 
     DiscretePDF m_pdf;
 };
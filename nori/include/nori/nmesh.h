@@ -0,0 +1,76 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#if !defined(__NORI_NMESH_H)
+#define __NORI_NMESH_H
+
+#include <nori/mesh.h>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Triangle mesh stored in Nori's binary mesh format (\c .nmesh)
+ *
+ * A file starts with a \ref Header, which is followed by the vertex
+ * positions, normals, texture coordinates and triangle indices. Every
+ * array starts at a multiple of 64 bytes and is stored exactly like the
+ * corresponding matrix of a \ref Mesh (column-major, little-endian).
+ * The mesh maps the file into memory and points its views at these
+ * arrays, hence loading involves no parsing or copying: pages are read
+ * when they are first accessed, and render processes on the same machine
+ * share them through the page cache.
+ *
+ * The following parameters are supported:
+ *
+ * \c filename: the \c .nmesh file
+ *
+ * \c toWorld (transform): when specified, the positions and normals are
+ * transformed into arrays owned by the mesh, which gives up the above
+ * advantages. Normals are renormalized after the transform, so they can
+ * differ from those of the original mesh by a rounding error.
+ *
+ * Files are created by the \c nori-meshconv tool (see \ref write()).
+ */
+class NMesh : public Mesh {
+public:
+    /// Header of a \c .nmesh file
+    struct Header {
+        char magic[4];          ///< Always "NMSH"
+        uint32_t version;       ///< File format version
+        uint32_t vertexCount;   ///< Number of vertices
+        uint32_t triangleCount; ///< Number of triangles
+        float bbox[6];          ///< Bounding box of the vertex positions (minimum, then maximum)
+        uint64_t positions;     ///< Byte offset of the vertex positions
+        uint64_t normals;       ///< Byte offset of the vertex normals (0 if there are none)
+        uint64_t texcoords;     ///< Byte offset of the texture coordinates (0 if there are none)
+        uint64_t indices;       ///< Byte offset of the triangle indices
+    };
+
+    /// Current version of the file format
+    static const uint32_t VERSION = 1;
+
+    /// Load a mesh from a file
+    NMesh(const PropertyList &propList);
+
+    /// Store the vertex and index data of a mesh in a file (throws a \ref NoriException on failure)
+    static void write(const Mesh &mesh, const std::string &filename);
+};
+
+NORI_NAMESPACE_END
+
+#endif /* __NORI_NMESH_H */
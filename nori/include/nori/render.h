@@ -23,9 +23,32 @@
 #include <thread>
 #include <nori/block.h>
 #include <atomic>
+#include <functional>
 
 NORI_NAMESPACE_BEGIN
 
+/**
+ * \brief Render a scene into an image block using all available cores
+ *
+ * This is the block-parallel render loop shared by the interactive
+ * \ref RenderThread and the headless \c nori-cli batch renderer.
+ * The integrator must already have been preprocessed.
+ *
+ * \param scene
+ *    The scene to be rendered
+ * \param result
+ *    Image block that receives the rendered image. It must have been
+ *    initialized to the camera's output size and cleared beforehand
+ * \param sampleCount
+ *    Number of samples per pixel
+ * \param callback
+ *    Optional function that is invoked before every pass with the
+ *    current progress in [0, 1]. Returning \c false aborts rendering.
+ * \return \c false if rendering was aborted by the callback
+ */
+extern bool renderImage(const Scene *scene, ImageBlock &result, uint32_t sampleCount,
+                        const std::function<bool(float)> &callback = nullptr);
+
 class RenderThread {
 
 public:
@@ -42,6 +42,9 @@ public:
     /// Return a pointer to the scene's kd-tree
     const BVH *getBVH() const { return m_bvh; }
 
+    /// Return a pointer to the scene's kd-tree (e.g. to refit it after animating meshes)
+    BVH *getBVH() { return m_bvh; }
+
     /// Return a pointer to the scene's integrator
     const Integrator *getIntegrator() const { return m_integrator; }
 
@@ -106,8 +109,75 @@ public:
      * \return \c true if an intersection was found
      */
     bool rayIntersect(const Ray3f &ray) const {
-        Intersection its; /* Unused */
-        return m_bvh->rayIntersect(ray, its, true);
+        return m_bvh->occluded(ray);
+    }
+
+    /**
+     * \brief Determine whether a ray segment is occluded by any of
+     * the triangles stored in the scene
+     *
+     * This is the same query as \ref rayIntersect(const Ray3f &), but
+     * with a more descriptive name. The BVH traversal is specialized for
+     * any-hit queries and stops at the first intersection it finds.
+     *
+     * \param ray
+     *    A 3-dimensional ray data structure with minimum/maximum
+     *    extent information
+     *
+     * \return \c true if the ray segment is occluded
+     */
+    bool occluded(const Ray3f &ray) const {
+        return m_bvh->occluded(ray);
+    }
+
+    /**
+     * \brief Intersect a coherent packet of rays against all triangles
+     * stored in the scene and return detailed intersection information
+     *
+     * The rays are traced in groups of 8 using \ref BVH::rayIntersect8().
+     *
+     * \param rays
+     *    Array of \c count rays
+     *
+     * \param its
+     *    Array of \c count intersection records, which will be filled
+     *    by the intersection query
+     *
+     * \param hit
+     *    Array of \c count flags, which will be set to \c true for
+     *    the rays that found an intersection
+     */
+    void rayIntersectPacket(const Ray3f *rays, Intersection *its, bool *hit,
+                            size_t count) const {
+        for (size_t i = 0; i < count; i += 8) {
+            uint32_t size = (uint32_t) std::min(count - i, (size_t) 8);
+            uint32_t mask = m_bvh->rayIntersect8<BVH::Query::ClosestHit>(rays + i, its + i, size);
+            for (uint32_t j = 0; j < size; ++j)
+                hit[i + j] = (mask & (1u << j)) != 0;
+        }
+    }
+
+    /**
+     * \brief Determine which rays of a coherent packet intersect
+     * any of the triangles stored in the scene
+     *
+     * This is the packet variant of the shadow ray query above.
+     *
+     * \param rays
+     *    Array of \c count rays
+     *
+     * \param hit
+     *    Array of \c count flags, which will be set to \c true for
+     *    the rays that are occluded
+     */
+    void rayIntersectPacket(const Ray3f *rays, bool *hit, size_t count) const {
+        for (size_t i = 0; i < count; i += 8) {
+            uint32_t size = (uint32_t) std::min(count - i, (size_t) 8);
+            uint32_t mask = size == 1 ? (m_bvh->occluded(rays[i]) ? 1u : 0u)
+                                      : m_bvh->rayIntersect8<BVH::Query::AnyHit>(rays + i, nullptr, size);
+            for (uint32_t j = 0; j < size; ++j)
+                hit[i + j] = (mask & (1u << j)) != 0;
+        }
     }
 
     /**
@@ -47,6 +47,8 @@ struct Intersection {
     Frame geoFrame;
     /// Pointer to the associated shape
     const Shape *mesh;
+    /// Primitive that was hit within a nested shape (see \ref Shape::rayIntersectNested())
+    uint32_t nestedPrim;
 
     /// Create an uninitialized intersection record
     Intersection() : mesh(nullptr) { }
@@ -132,6 +134,33 @@ public:
     //// Ray-Shape intersection test
     virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const = 0;
 
+    /**
+     * \brief Ray-Shape intersection test for shapes that consist of
+     * nested primitives, such as instances
+     *
+     * Like \ref rayIntersect(), but \c nestedPrim additionally receives
+     * the nested primitive that was hit. It is stored in
+     * \ref Intersection::nestedPrim, so that \ref setHitInformation()
+     * doesn't need to search for it again. The default implementation
+     * calls \ref rayIntersect().
+     */
+    virtual bool rayIntersectNested(uint32_t index, const Ray3f &ray, float &u, float &v,
+                                    float &t, uint32_t &nestedPrim) const {
+        nestedPrim = 0;
+        return rayIntersect(index, ray, u, v, t);
+    }
+
+    /**
+     * \brief Check whether a ray segment hits the given primitive at all
+     * (any-hit query)
+     *
+     * The default implementation calls \ref rayIntersect().
+     */
+    virtual bool rayOccluded(uint32_t index, const Ray3f &ray) const {
+        float u, v, t;
+        return rayIntersect(index, ray, u, v, t);
+    }
+
     /// Set the intersection information: hit point, shading frame, UVs, etc.
     virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const = 0;
 
@@ -14,16 +14,22 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its)) {
+        bool hit = scene->rayIntersect(ray, its);
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+               const Intersection *its) const {
+        if (!its) {
             return Color3f(1.0f);
         } 
 
         
-        Vector3f v  = Warp::sampleUniformHemisphere(sampler, its.shFrame.n);  
-        Ray3f irray(its.p, v); 
+        Vector3f v  = Warp::sampleUniformHemisphere(sampler, its->shFrame.n);  
+        Ray3f irray(its->p, v); 
         irray.maxt = length;
 
-        if (!scene->rayIntersect(irray, its)) {
+        if (!scene->occluded(irray)) {
             return Color3f(1.0f);
         } 
         
@@ -17,10 +17,28 @@
 */
 
 #include <nori/bvh.h>
+#include <nori/mesh.h>
+#include <nori/sphere.h>
+#include <nori/mmap.h>
 #include <nori/timer.h>
+#include <filesystem/resolver.h>
 #include <tbb/tbb.h>
 #include <Eigen/Geometry>
 #include <atomic>
+#include <fstream>
+#include <cstdio>
+#include <functional>
+#include <thread>
+
+#if defined(PLATFORM_WINDOWS)
+#include <process.h>
+#else
+#include <unistd.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 /*
  * =======================================================================
@@ -33,12 +51,67 @@
 
 NORI_NAMESPACE_BEGIN
 
-/* Bin data structure for counting triangles and computing their bounding box */
+/**
+ * \brief Maps primitive centroids to bins along all three axes
+ *
+ * The bins evenly subdivide the bounding box of the centroids of a node.
+ * Axes along which all centroids coincide map everything to the first bin.
+ */
+struct BinMapping {
+    Point3f min;
+    Vector3f scale;
+
+    BinMapping(const BoundingBox3f &centroidBounds, int binCount) : min(centroidBounds.min) {
+        Vector3f extents = centroidBounds.getExtents();
+        for (int i = 0; i < 3; ++i)
+            scale[i] = extents[i] > 0 ? (binCount * (1 - 1e-6f)) / extents[i] : 0.f;
+    }
+
+    int index(const Point3f &centroid, int axis, int binCount) const {
+        return std::min(std::max((int) ((centroid[axis] - min[axis]) * scale[axis]), 0),
+                        binCount - 1);
+    }
+};
+
+/* Bin data structure for counting primitives and computing their bounding boxes along all axes */
 struct Bins {
     static const int BIN_COUNT = 16;
-    Bins() { memset(counts, 0, sizeof(uint32_t) * BIN_COUNT); }
-    uint32_t counts[BIN_COUNT];
-    BoundingBox3f bbox[BIN_COUNT];
+    Bins() { memset(counts, 0, sizeof(uint32_t) * 3 * BIN_COUNT); }
+    uint32_t counts[3][BIN_COUNT];
+    BoundingBox3f bbox[3][BIN_COUNT];       ///< Bounds of the primitives in each bin
+    BoundingBox3f centroids[3][BIN_COUNT];  ///< Bounds of their centroids
+
+    /// Add a primitive to one bin of every axis
+    void put(const BinMapping &mapping, const Point3f &centroid, const BoundingBox3f &bounds) {
+        for (int axis = 0; axis < 3; ++axis) {
+            int index = mapping.index(centroid, axis, BIN_COUNT);
+            counts[axis][index]++;
+            bbox[axis][index].expandBy(bounds);
+            centroids[axis][index].expandBy(centroid);
+        }
+    }
+
+    /// Combine two 'Bins' data structures
+    static Bins merge(const Bins &b1, const Bins &b2) {
+        Bins result;
+        for (int axis = 0; axis < 3; ++axis) {
+            for (int i = 0; i < BIN_COUNT; ++i) {
+                result.counts[axis][i] = b1.counts[axis][i] + b2.counts[axis][i];
+                result.bbox[axis][i] = BoundingBox3f::merge(b1.bbox[axis][i], b2.bbox[axis][i]);
+                result.centroids[axis][i] = BoundingBox3f::merge(b1.centroids[axis][i], b2.centroids[axis][i]);
+            }
+        }
+        return result;
+    }
+};
+
+/// Best split plane found by a sweep over the bins
+struct BinSplit {
+    int axis = -1;                ///< Split axis (-1 if splitting does not pay off)
+    int index = -1;               ///< Last bin of the left child
+    uint32_t leftCount = 0;       ///< Number of primitives in the left child
+    BoundingBox3f bbox[2];        ///< Bounds of the primitives of both children
+    BoundingBox3f centroids[2];   ///< Bounds of their centroids
 };
 
 /**
@@ -47,15 +120,37 @@ struct Bins {
  * This class uses the task scheduling system of Intel' Thread Building Blocks
  * to parallelize the divide and conquer BVH build at all levels.
  *
+ * Every node is split using a binned approximation of the SAH along all
+ * three axes. Primitive bounds and centroids are read from arrays that
+ * \ref BVH::construct() precomputes, so that no virtual function calls
+ * are needed during the build. The children of a node are allocated as
+ * a pair from a growing node pool, and the primitive references are
+ * partitioned in place, so that the build needs no memory proportional
+ * to an upper bound of the node count or to a copy of the references.
+ *
  * The used methodology is roughly that described in
  * "Fast and Parallel Construction of SAH-based Bounding Volume Hierarchies"
  * by Ingo Wald (Proc. IEEE/EG Symposium on Interactive Ray Tracing, 2007)
  */
 class BVHBuildTask : public tbb::task {
+public:
+    /**
+     * \brief Nodes in the order in which they were created
+     *
+     * The children of an inner node are adjacent, and its \c rightChild
+     * field references the second one. Unlike an \c std::vector, the
+     * pool can grow while other threads access its nodes. Its memory
+     * comes from the standard allocator, which returns it to the system
+     * once the tree has been stored (unlike TBB's caching allocator).
+     */
+    typedef tbb::concurrent_vector<BVH::BVHNode, std::allocator<BVH::BVHNode>> NodePool;
+
 private:
     BVH &bvh;
+    NodePool &nodes;
     uint32_t node_idx;
-    uint32_t *start, *end, *temp;
+    uint32_t *start, *end;
+    BoundingBox3f centroidBounds;
 
 public:
     /// Build-related parameters
@@ -80,6 +175,9 @@ public:
      * \param bvh
      *    Reference to the underlying BVH
      *
+     * \param nodes
+     *    Pool that receives the nodes of the tree
+     *
      * \param node_idx
      *    Index of the BVH node that should be built
      *
@@ -89,28 +187,33 @@ public:
      * \param end
      *    End pointer into a list of triangle indices to be processed
      *
-     *  \param temp
-     *    Pointer into a temporary memory region that can be used for
-     *    construction purposes. The usable length is <tt>end-start</tt>
-     *    unsigned integers.
+     * \param centroidBounds
+     *    Bounding box of the centroids of the triangles
      */
-    BVHBuildTask(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp)
-        : bvh(bvh), node_idx(node_idx), start(start), end(end), temp(temp) { }
+    BVHBuildTask(BVH &bvh, NodePool &nodes, uint32_t node_idx, uint32_t *start, uint32_t *end,
+                 const BoundingBox3f &centroidBounds)
+        : bvh(bvh), nodes(nodes), node_idx(node_idx), start(start), end(end),
+          centroidBounds(centroidBounds) { }
 
     task *execute() {
         uint32_t size = (uint32_t) (end-start);
-        BVH::BVHNode &node = bvh.m_nodes[node_idx];
+        BVH::BVHNode &node = nodes[node_idx];
+
+        /* Leave small subtrees to be built when a ray reaches them (if enabled) */
+        if (size <= bvh.m_lazySize) {
+            makePlaceholder(bvh, node, start);
+            return nullptr;
+        }
 
         /* Switch to a serial build when less than SERIAL_THRESHOLD triangles are left */
         if (size < SERIAL_THRESHOLD) {
-            execute_serially(bvh, node_idx, start, end, temp);
+            execute_serially(bvh, nodes, node_idx, start, end, centroidBounds);
             return nullptr;
         }
 
-        /* Always split along the largest axis */
-        int axis = node.bbox.getLargestAxis();
-        float min = node.bbox.min[axis], max = node.bbox.max[axis],
-              inv_bin_size = Bins::BIN_COUNT / (max-min);
+        BinMapping mapping(centroidBounds, Bins::BIN_COUNT);
+        const Point3f *centroids = bvh.m_buildCentroids.data();
+        const BoundingBox3f *bounds = bvh.m_buildBounds.data();
 
         /* Accumulate all triangles into bins */
         Bins bins = tbb::parallel_reduce(
@@ -120,99 +223,46 @@ public:
             [&](const tbb::blocked_range<uint32_t> &range, Bins result) {
                 for (uint32_t i = range.begin(); i != range.end(); ++i) {
                     uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-
-                    int index = std::min(std::max(
-                        (int) ((centroid - min) * inv_bin_size), 0),
-                        (Bins::BIN_COUNT - 1));
-
-                    result.counts[index]++;
-                    result.bbox[index].expandBy(bvh.getBoundingBox(f));
+                    result.put(mapping, centroids[f], bounds[f]);
                 }
                 return result;
             },
             /* REDUCE: Combine two 'Bins' data structures */
-            [](const Bins &b1, const Bins &b2) {
-                Bins result;
-                for (int i=0; i < Bins::BIN_COUNT; ++i) {
-                    result.counts[i] = b1.counts[i] + b2.counts[i];
-                    result.bbox[i] = BoundingBox3f::merge(b1.bbox[i], b2.bbox[i]);
-                }
-                return result;
-            }
+            &Bins::merge
         );
 
-        /* Choose the best split plane based on the binned data */
-        BoundingBox3f bbox_left[Bins::BIN_COUNT];
-        bbox_left[0] = bins.bbox[0];
-        for (int i=1; i<Bins::BIN_COUNT; ++i) {
-            bins.counts[i] += bins.counts[i-1];
-            bbox_left[i] = BoundingBox3f::merge(bbox_left[i-1], bins.bbox[i]);
-        }
-
-        BoundingBox3f bbox_right = bins.bbox[Bins::BIN_COUNT-1], best_bbox_right;
-        int64_t best_index = -1;
-        float best_cost = (float) INTERSECTION_COST * size;
-        float tri_factor = (float) INTERSECTION_COST / node.bbox.getSurfaceArea();
-
-        for (int i=Bins::BIN_COUNT - 2; i >= 0; --i) {
-            uint32_t prims_left = bins.counts[i], prims_right = (uint32_t) (end - start) - bins.counts[i];
-            float sah_cost = 2.0f * TRAVERSAL_COST +
-                tri_factor * (prims_left * bbox_left[i].getSurfaceArea() +
-                              prims_right * bbox_right.getSurfaceArea());
-            if (sah_cost < best_cost) {
-                best_cost = sah_cost;
-                best_index = i;
-                best_bbox_right = bbox_right;
-            }
-            bbox_right = BoundingBox3f::merge(bbox_right, bins.bbox[i]);
-        }
-
-        if (best_index == -1) {
-            /* Could not find a good split plane -- retry with
-               more careful serial code just to be sure.. */
-            execute_serially(bvh, node_idx, start, end, temp);
+        BinSplit split = findSplit(bins, size, node.bbox.getSurfaceArea());
+        if (split.axis == -1) {
+            /* Splitting does not reduce the cost, make a leaf */
+            makeLeaf(bvh, node, start, size);
             return nullptr;
         }
 
-        uint32_t left_count = bins.counts[best_index];
-        int node_idx_left = node_idx+1;
-        int node_idx_right = node_idx+2*left_count;
-
-        bvh.m_nodes[node_idx_left ].bbox = bbox_left[best_index];
-        bvh.m_nodes[node_idx_right].bbox = best_bbox_right;
-        node.inner.rightChild = node_idx_right;
-        node.inner.axis = axis;
-        node.inner.flag = 0;
-
-        std::atomic<uint32_t> offset_left(0),
-                              offset_right(bins.counts[best_index]);
-
-        tbb::parallel_for(
+        uint32_t left_count = split.leftCount;
+        uint32_t node_idx_left = allocateChildren(nodes, node, split);
+        uint32_t node_idx_right = node_idx_left + 1;
+
+        /* Partition blocks of references in parallel, and merge adjacent
+           blocks by rotating the right part of the first one past the left
+           part of the second one. This needs no temporary copy of the
+           references. */
+        struct Partition {
+            uint32_t *begin, *mid, *end;
+        };
+        Partition partition = tbb::parallel_reduce(
             tbb::blocked_range<uint32_t>(0u, size, GRAIN_SIZE),
-            [&](const tbb::blocked_range<uint32_t> &range) {
-                uint32_t count_left = 0, count_right = 0;
-                for (uint32_t i = range.begin(); i != range.end(); ++i) {
-                    uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-                    int index = (int) ((centroid - min) * inv_bin_size);
-                    (index <= best_index ? count_left : count_right)++;
-                }
-                uint32_t idx_l = offset_left.fetch_add(count_left);
-                uint32_t idx_r = offset_right.fetch_add(count_right);
-                for (uint32_t i = range.begin(); i != range.end(); ++i) {
-                    uint32_t f = start[i];
-                    float centroid = bvh.getCentroid(f)[axis];
-                    int index = (int) ((centroid - min) * inv_bin_size);
-                    if (index <= best_index)
-                        temp[idx_l++] = f;
-                    else
-                        temp[idx_r++] = f;
-                }
-            }
+            Partition { nullptr, nullptr, nullptr },
+            [&](const tbb::blocked_range<uint32_t> &range, const Partition &left) {
+                Partition right { start + range.begin(), nullptr, start + range.end() };
+                right.mid = std::partition(right.begin, right.end, [&](uint32_t f) {
+                    return mapping.index(centroids[f], split.axis, Bins::BIN_COUNT) <= split.index;
+                });
+                return mergePartitions(left, right);
+            },
+            &mergePartitions<Partition>
         );
-        memcpy(start, temp, size * sizeof(uint32_t));
-        assert(offset_left == left_count && offset_right == size);
+        assert(partition.mid == start + left_count);
+        (void) partition; /* Only checked in debug builds */
 
         /* Create an empty parent task */
         tbb::task& c = *new (allocate_continuation()) tbb::empty_task;
@@ -220,245 +270,3443 @@ public:
 
         /* Post right subtree to scheduler */
         BVHBuildTask &b = *new (c.allocate_child())
-            BVHBuildTask(bvh, node_idx_right, start + left_count,
-                         end, temp + left_count);
+            BVHBuildTask(bvh, nodes, node_idx_right, start + left_count,
+                         end, split.centroids[1]);
         spawn(b);
 
         /* Directly start working on left subtree */
         recycle_as_child_of(c);
         node_idx = node_idx_left;
         end = start + left_count;
+        centroidBounds = split.centroids[0];
 
         return this;
     }
 
     /// Single-threaded build function
-    static void execute_serially(BVH &bvh, uint32_t node_idx, uint32_t *start, uint32_t *end, uint32_t *temp) {
-        BVH::BVHNode &node = bvh.m_nodes[node_idx];
+    static void execute_serially(BVH &bvh, NodePool &nodes, uint32_t node_idx, uint32_t *start,
+                                 uint32_t *end, const BoundingBox3f &centroidBounds) {
+        BVH::BVHNode &node = nodes[node_idx];
         uint32_t size = (uint32_t) (end - start);
-        float best_cost = (float) INTERSECTION_COST * size;
-        int64_t best_index = -1, best_axis = -1;
-        float *left_areas = (float *) temp;
-
-        /* Try splitting along every axis */
-        for (int axis=0; axis<3; ++axis) {
-            /* Sort all triangles based on their centroid positions projected on the axis */
-            std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-                return bvh.getCentroid(f1)[axis] < bvh.getCentroid(f2)[axis];
-            });
 
-            BoundingBox3f bbox;
-            for (uint32_t i = 0; i<size; ++i) {
-                uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
-                left_areas[i] = (float) bbox.getSurfaceArea();
-            }
-            if (axis == 0)
-                node.bbox = bbox;
+        BinMapping mapping(centroidBounds, Bins::BIN_COUNT);
+        const Point3f *centroids = bvh.m_buildCentroids.data();
+        const BoundingBox3f *bounds = bvh.m_buildBounds.data();
 
-            bbox.reset();
+        Bins bins;
+        for (uint32_t *it = start; it != end; ++it)
+            bins.put(mapping, centroids[*it], bounds[*it]);
+
+        BinSplit split = findSplit(bins, size, node.bbox.getSurfaceArea());
+        if (split.axis == -1) {
+            /* Splitting does not reduce the cost, make a leaf */
+            makeLeaf(bvh, node, start, size);
+            return;
+        }
 
-            /* Choose the best split plane */
-            float tri_factor = INTERSECTION_COST / node.bbox.getSurfaceArea();
-            for (uint32_t i = size-1; i>=1; --i) {
-                uint32_t f = *(start + i);
-                bbox.expandBy(bvh.getBoundingBox(f));
+        std::partition(start, end, [&](uint32_t f) {
+            return mapping.index(centroids[f], split.axis, Bins::BIN_COUNT) <= split.index;
+        });
 
-                float left_area = left_areas[i-1];
-                float right_area = bbox.getSurfaceArea();
-                uint32_t prims_left = i;
-                uint32_t prims_right = size-i;
+        uint32_t left_count = split.leftCount;
+        uint32_t node_idx_left = allocateChildren(nodes, node, split);
+        execute_serially(bvh, nodes, node_idx_left, start, start + left_count, split.centroids[0]);
+        execute_serially(bvh, nodes, node_idx_left + 1, start + left_count, end, split.centroids[1]);
+    }
 
-                float sah_cost = 2.0f * TRAVERSAL_COST +
-                    tri_factor * (prims_left * left_area +
-                                  prims_right * right_area);
+    /// Turn a node into an inner node, and return the index of its (newly allocated) left child
+    static uint32_t allocateChildren(NodePool &nodes, BVH::BVHNode &node, const BinSplit &split) {
+        NodePool::iterator children = nodes.grow_by(2);
+        uint32_t node_idx_left = (uint32_t) (children - nodes.begin());
+        for (int i = 0; i < 2; ++i) {
+            children[i].data = 0;
+            children[i].bbox = split.bbox[i];
+        }
+        node.inner.rightChild = node_idx_left + 1;
+        node.inner.axis = split.axis;
+        node.inner.flag = 0;
+        return node_idx_left;
+    }
+
+    /// Merge two adjacent partitioned ranges (see \ref execute())
+    template <typename Partition> static Partition mergePartitions(const Partition &left,
+                                                                   const Partition &right) {
+        if (!left.begin)
+            return right;
+        if (!right.begin)
+            return left;
+        std::rotate(left.mid, right.begin, right.mid);
+        return Partition { left.begin, left.mid + (right.mid - right.begin), right.end };
+    }
+
+    /// Choose the best split plane based on the binned data of all three axes
+    static BinSplit findSplit(const Bins &bins, uint32_t size, float area) {
+        BinSplit best;
+        float best_cost = (float) INTERSECTION_COST * size;
+        float tri_factor = (float) INTERSECTION_COST / area;
+
+        for (int axis = 0; axis < 3; ++axis) {
+            const uint32_t *counts = bins.counts[axis];
+
+            /* Sweep from the right to compute the area of all right children */
+            float right_areas[Bins::BIN_COUNT];
+            BoundingBox3f bbox_right;
+            for (int i = Bins::BIN_COUNT - 1; i > 0; --i) {
+                bbox_right.expandBy(bins.bbox[axis][i]);
+                right_areas[i] = bbox_right.getSurfaceArea();
+            }
+
+            BoundingBox3f bbox_left;
+            uint32_t prims_left = 0;
+            for (int i = 0; i < Bins::BIN_COUNT - 1; ++i) {
+                bbox_left.expandBy(bins.bbox[axis][i]);
+                prims_left += counts[i];
+                uint32_t prims_right = size - prims_left;
+                if (prims_left == 0 || prims_right == 0)
+                    continue;
 
+                float sah_cost = 2.0f * TRAVERSAL_COST +
+                    tri_factor * (prims_left * bbox_left.getSurfaceArea() +
+                                  prims_right * right_areas[i + 1]);
                 if (sah_cost < best_cost) {
                     best_cost = sah_cost;
-                    best_index = i;
-                    best_axis = axis;
+                    best.axis = axis;
+                    best.index = i;
+                    best.leftCount = prims_left;
                 }
             }
         }
 
-        if (best_index == -1) {
-            /* Splitting does not reduce the cost, make a leaf */
-            node.leaf.flag = 1;
-            node.leaf.start = (uint32_t) (start - bvh.m_indices.data());
-            node.leaf.size  = size;
-            return;
+        if (best.axis != -1) {
+            for (int i = 0; i < Bins::BIN_COUNT; ++i) {
+                int side = i <= best.index ? 0 : 1;
+                best.bbox[side].expandBy(bins.bbox[best.axis][i]);
+                best.centroids[side].expandBy(bins.centroids[best.axis][i]);
+            }
         }
+        return best;
+    }
 
-        std::sort(start, end, [&](uint32_t f1, uint32_t f2) {
-            return bvh.getCentroid(f1)[best_axis] < bvh.getCentroid(f2)[best_axis];
-        });
-
-        uint32_t left_count = (uint32_t) best_index;
-        uint32_t node_idx_left = node_idx + 1;
-        uint32_t node_idx_right = node_idx + 2 * left_count;
-        node.inner.rightChild = node_idx_right;
-        node.inner.axis = best_axis;
-        node.inner.flag = 0;
+    /// Turn a node into a leaf referencing the given primitives
+    static void makeLeaf(BVH &bvh, BVH::BVHNode &node, uint32_t *start, uint32_t size) {
+        node.leaf.flag = 1;
+        node.leaf.start = (uint32_t) (start - bvh.m_indices.data());
+        node.leaf.size  = size;
+    }
 
-        execute_serially(bvh, node_idx_left, start, start + left_count, temp);
-        execute_serially(bvh, node_idx_right, start+left_count, end, temp + left_count);
+    /**
+     * \brief Turn a node into the placeholder of a lazily built subtree
+     * over the references that start at \c start (see \ref BVH::LazySubtree)
+     *
+     * Placeholders are leaves without primitives, whose \c start field is
+     * replaced by the index of the subtree in \ref BVH::createLazySubtrees().
+     */
+    static void makePlaceholder(BVH &bvh, BVH::BVHNode &node, uint32_t *start) {
+        makeLeaf(bvh, node, start, 0u);
     }
 };
 
-void BVH::addShape(Shape *shape) {
-    m_shapes.push_back(shape);
-    m_shapeOffset.push_back(m_shapeOffset.back() + shape->getPrimitiveCount());
-    m_bbox.expandBy(shape->getBoundingBox());
-}
+/**
+ * \brief Builder for spatial split BVHs (SBVH)
+ *
+ * In addition to the object partitions considered by \ref BVHBuildTask,
+ * this builder can split a node with an axis-aligned plane and place
+ * primitives that straddle the plane into both children. Each of these
+ * references is clipped against its side of the plane, which greatly
+ * reduces the overlap of sibling nodes in scenes with long and thin
+ * triangles. The number of additional references is limited by a
+ * memory budget.
+ *
+ * The method is described in the paper
+ * "Spatial Splits in Bounding Volume Hierarchies"
+ * by Martin Stich, Heiko Friedrich and Andreas Dietrich (Proc. HPG 2009)
+ */
+class SBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Number of bins used to evaluate spatial splits along each axis
+        SPATIAL_BINS = 32,
 
-void BVH::clear() {
-    for (auto shape : m_shapes)
-        delete shape;
-    m_shapes.clear();
-    m_shapeOffset.clear();
-    m_shapeOffset.push_back(0u);
-    m_nodes.clear();
-    m_indices.clear();
-    m_bbox.reset();
-    m_nodes.shrink_to_fit();
-    m_shapes.shrink_to_fit();
-    m_shapeOffset.shrink_to_fit();
-    m_indices.shrink_to_fit();
-}
+        /// Build the two subtrees of nodes with at least 4K references in parallel
+        PARALLEL_THRESHOLD = 4096,
 
-void BVH::build() {
-    uint32_t size  = getPrimitiveCount();
-    if (size == 0)
-        return;
-    cout << "Constructing a SAH BVH (" << m_shapes.size()
-        << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
-        << size << " primitives) .. ";
-    cout.flush();
-    Timer timer;
+        /// Stop considering spatial splits at this depth (guards against degenerate input)
+        MAX_SPATIAL_DEPTH = 48,
 
-    /* Conservative estimate for the total number of nodes */
-    m_nodes.resize(2*size);
-    memset(m_nodes.data(), 0, sizeof(BVHNode) * m_nodes.size());
-    m_nodes[0].bbox = m_bbox;
-    m_indices.resize(size);
+        /// Bin the centroids instead of sorting the references for object splits of nodes with at least 1K references
+        OBJECT_BINNING_THRESHOLD = 1024
+    };
 
-    if (sizeof(BVHNode) != 32)
-        throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+    /**
+     * Only consider spatial splits when the children of the best object
+     * split overlap by more than this fraction of the root surface area
+     */
+    static constexpr float OVERLAP_THRESHOLD = 1e-5f;
 
-    for (uint32_t i = 0; i < size; ++i)
-        m_indices[i] = i;
+    /**
+     * Create a new builder
+     *
+     * \param splitBudget
+     *    Number of additional primitive references that may be
+     *    created by spatial splits, relative to the primitive count
+     */
+    SBVHBuilder(const BVH &bvh, float splitBudget) : bvh(bvh), splitBudget(splitBudget) {
+        meshes.resize(bvh.m_shapes.size());
+        for (size_t i = 0; i < meshes.size(); ++i)
+            meshes[i] = dynamic_cast<const Mesh *>(bvh.m_shapes[i]);
+    }
 
-    uint32_t *indices = m_indices.data(), *temp = new uint32_t[size];
-    BVHBuildTask& task = *new(tbb::task::allocate_root())
-        BVHBuildTask(*this, 0u, indices, indices + size , temp);
-    tbb::task::spawn_root_and_wait(task);
-    delete[] temp;
-    std::pair<float, uint32_t> stats = statistics();
+    /// Build a tree over the given primitives and store it in depth-first order
+    void build(const std::vector<uint32_t> &prims, std::vector<BVH::BVHNode> &nodes,
+               std::vector<uint32_t> &indices) {
+        uint32_t size = (uint32_t) prims.size();
+        std::vector<Reference> refs(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    refs[i].bbox = bvh.getBoundingBox(prims[i]);
+                    refs[i].prim = prims[i];
+                }
+            }
+        );
+
+        rootArea = bvh.getBoundingBox().getSurfaceArea();
+        references = size;
+        maxReferences = size + (size_t) (std::max(splitBudget, 0.0f) * size);
+        indices.reserve(size);
+        buildNode(refs, 0, nodes, indices);
+        peakMemory = std::max(peakMemory, sizeof(BVH::BVHNode) * nodes.capacity() +
+                                          sizeof(uint32_t) * indices.capacity());
+    }
+
+    /**
+     * \brief Return the peak memory used by the last build
+     *
+     * This is the larger of the references during the split of the root
+     * (the largest temporary arrays of the build) and the output arrays.
+     */
+    size_t getPeakMemory() const { return peakMemory; }
+
+private:
+    /// Reference to a primitive, possibly clipped by spatial splits
+    struct Reference {
+        BoundingBox3f bbox;
+        uint32_t prim;
+    };
+
+    /// Candidate split of a node
+    struct Split {
+        float cost = std::numeric_limits<float>::infinity();
+        int axis = -1;
+        bool spatial = false;
+        uint32_t index = 0;  ///< References on the left (object split) or last bin on the left (spatial split)
+        float pos = 0.0f;    ///< Position of the split plane (spatial split)
+        uint32_t leftCount = 0, rightCount = 0;
+        BoundingBox3f leftBox, rightBox;
+        BoundingBox3f centroidBounds;  ///< Bins of a binned object split (invalid if the references were sorted)
+    };
 
-    /* The node array was allocated conservatively and now contains
-       many unused entries -- do a compactification pass. */
-    std::vector<BVHNode> compactified(stats.second);
-    std::vector<uint32_t> skipped_accum(m_nodes.size());
+    /// Per-bin data of the spatial split search
+    struct SpatialBin {
+        BoundingBox3f bbox;
+        uint32_t enter = 0, exit = 0;
+    };
+
+    void buildNode(std::vector<Reference> &refs, int depth,
+                   std::vector<BVH::BVHNode> &nodes, std::vector<uint32_t> &indices) {
+        uint32_t size = (uint32_t) refs.size();
+        BVH::BVHNode node;
+        node.data = 0;
+        for (const Reference &ref : refs)
+            node.bbox.expandBy(ref.bbox);
+
+        float leafCost = (float) BVHBuildTask::INTERSECTION_COST * size;
+        Split objectSplit, spatialSplit;
+        if (size >= OBJECT_BINNING_THRESHOLD)
+            objectSplit = findBinnedObjectSplit(refs, node.bbox);
+        if (size > 1 && objectSplit.axis < 0)
+            objectSplit = findObjectSplit(refs, node.bbox);
+
+        /* Spatial splits only pay off when the object split leaves the children overlapping */
+        if (objectSplit.axis >= 0 && depth < MAX_SPATIAL_DEPTH && references < maxReferences) {
+            BoundingBox3f overlap = objectSplit.leftBox;
+            overlap.clip(objectSplit.rightBox);
+            if (overlap.isValid() && overlap.getSurfaceArea() > OVERLAP_THRESHOLD * rootArea)
+                spatialSplit = findSpatialSplit(refs, node.bbox);
+        }
 
-    for (int64_t i = stats.second-1, j = m_nodes.size(), skipped = 0; i >= 0; --i) {
-        while (m_nodes[--j].isUnused())
-            skipped++;
-        BVHNode &new_node = compactified[i];
-        new_node = m_nodes[j];
-        skipped_accum[j] = (uint32_t) skipped;
+        std::vector<Reference> left, right;
+        if (spatialSplit.cost < std::min(objectSplit.cost, leafCost) &&
+            partitionSpatial(refs, node.bbox, spatialSplit, left, right)) {
+            node.inner.axis = (uint32_t) spatialSplit.axis;
+        } else if (objectSplit.cost < leafCost) {
+            partitionObject(refs, objectSplit, left, right);
+            node.inner.axis = (uint32_t) objectSplit.axis;
+        } else {
+            /* Splitting does not reduce the cost, make a leaf */
+            node.leaf.flag = 1;
+            node.leaf.start = (uint32_t) indices.size();
+            node.leaf.size = size;
+            nodes.push_back(node);
+            for (const Reference &ref : refs)
+                indices.push_back(ref.prim);
+            return;
+        }
 
-        if (new_node.isInner()) {
-            new_node.inner.rightChild = (uint32_t)
-                (i + new_node.inner.rightChild - j -
-                (skipped - skipped_accum[new_node.inner.rightChild]));
+        if (depth == 0)
+            peakMemory = sizeof(Reference) * (refs.capacity() + left.capacity() + right.capacity());
+
+        /* Release the references of this node before recursing */
+        std::vector<Reference>().swap(refs);
+
+        size_t node_idx = nodes.size();
+        nodes.push_back(node);
+
+        if (size >= PARALLEL_THRESHOLD) {
+            std::vector<BVH::BVHNode> nodes_left, nodes_right;
+            std::vector<uint32_t> indices_left, indices_right;
+            tbb::parallel_invoke(
+                [&] { buildNode(left, depth + 1, nodes_left, indices_left); },
+                [&] { buildNode(right, depth + 1, nodes_right, indices_right); }
+            );
+            append(nodes, indices, nodes_left, indices_left);
+            nodes[node_idx].inner.rightChild = (uint32_t) nodes.size();
+            append(nodes, indices, nodes_right, indices_right);
+        } else {
+            buildNode(left, depth + 1, nodes, indices);
+            nodes[node_idx].inner.rightChild = (uint32_t) nodes.size();
+            buildNode(right, depth + 1, nodes, indices);
         }
     }
-    cout << "done (took " << timer.elapsedString() << " and "
-        << memString(sizeof(BVHNode) * m_nodes.size() + sizeof(uint32_t)*m_indices.size())
-        << ", SAH cost = " << stats.first
-        << ")." << endl;
 
-    m_nodes = std::move(compactified);
-}
+    /// Find the best object split by sweeping over the sorted references along every axis
+    Split findObjectSplit(std::vector<Reference> &refs, const BoundingBox3f &bbox) const {
+        uint32_t size = (uint32_t) refs.size();
+        std::vector<BoundingBox3f> left_bboxes(size);
+        float tri_factor = BVHBuildTask::INTERSECTION_COST / bbox.getSurfaceArea();
+        Split best;
 
-std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
-    const BVHNode &node = m_nodes[node_idx];
-    if (node.isLeaf()) {
-        return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * node.leaf.size, 1u);
-    } else {
-        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
-        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
-        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
-        float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
-        float saCur = node.bbox.getSurfaceArea();
-        float sahCost =
-            2 * BVHBuildTask::TRAVERSAL_COST +
-            (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
-        return std::make_pair(
-            sahCost,
-            stats_left.second + stats_right.second + 1u
-        );
+        for (int axis = 0; axis < 3; ++axis) {
+            sortReferences(refs, axis);
+
+            BoundingBox3f bbox_left;
+            for (uint32_t i = 0; i < size; ++i) {
+                bbox_left.expandBy(refs[i].bbox);
+                left_bboxes[i] = bbox_left;
+            }
+
+            BoundingBox3f bbox_right;
+            for (uint32_t i = size - 1; i >= 1; --i) {
+                bbox_right.expandBy(refs[i].bbox);
+                float sah_cost = 2.0f * BVHBuildTask::TRAVERSAL_COST +
+                    tri_factor * (i * left_bboxes[i - 1].getSurfaceArea() +
+                                  (size - i) * bbox_right.getSurfaceArea());
+                if (sah_cost < best.cost) {
+                    best.cost = sah_cost;
+                    best.axis = axis;
+                    best.index = i;
+                    best.leftBox = left_bboxes[i - 1];
+                    best.rightBox = bbox_right;
+                }
+            }
+        }
+
+        return best;
     }
-}
 
-bool BVH::rayIntersect(const Ray3f &_ray, Intersection &its, bool shadowRay) const {
-    uint32_t node_idx = 0, stack_idx = 0, stack[64];
+    /**
+     * \brief Find the best object split based on binned centroids
+     *
+     * This is the approximation used by \ref BVHBuildTask, which avoids
+     * sorting the references of large nodes along every axis. Returns
+     * an invalid split if the centroids all fall into the same bin.
+     */
+    Split findBinnedObjectSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox) const {
+        uint32_t size = (uint32_t) refs.size();
+        BoundingBox3f centroidBounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    result.expandBy(refs[i].bbox.getCenter());
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
 
-    its.t = std::numeric_limits<float>::infinity();
+        BinMapping mapping(centroidBounds, Bins::BIN_COUNT);
+        Bins bins = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            Bins(),
+            [&](const tbb::blocked_range<uint32_t> &range, Bins result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    result.put(mapping, refs[i].bbox.getCenter(), refs[i].bbox);
+                return result;
+            },
+            &Bins::merge
+        );
 
-    /* Use an adaptive ray epsilon */
-    Ray3f ray(_ray);
-    if (ray.mint == Epsilon)
-        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+        BinSplit binSplit = BVHBuildTask::findSplit(bins, size, bbox.getSurfaceArea());
+        Split best;
+        if (binSplit.axis == -1)
+            return best;
+
+        best.axis = binSplit.axis;
+        best.index = (uint32_t) binSplit.index;
+        best.leftCount = binSplit.leftCount;
+        best.rightCount = size - binSplit.leftCount;
+        best.leftBox = binSplit.bbox[0];
+        best.rightBox = binSplit.bbox[1];
+        best.centroidBounds = centroidBounds;
+        best.cost = 2.0f * BVHBuildTask::TRAVERSAL_COST +
+            BVHBuildTask::INTERSECTION_COST / bbox.getSurfaceArea() *
+            (best.leftCount * best.leftBox.getSurfaceArea() +
+             best.rightCount * best.rightBox.getSurfaceArea());
+        return best;
+    }
 
-    if (m_nodes.empty() || ray.maxt < ray.mint)
-        return false;
+    /**
+     * \brief Find the best spatial split by chopping the references into bins along every axis
+     *
+     * The vertices of a triangle are fetched once, and its part in every
+     * bin that it overlaps is clipped directly against the bin's planes.
+     */
+    Split findSpatialSplit(const std::vector<Reference> &refs, const BoundingBox3f &bbox) const {
+        float tri_factor = BVHBuildTask::INTERSECTION_COST / bbox.getSurfaceArea();
+        const float inf = std::numeric_limits<float>::infinity();
+        Split best;
+
+        Vector3f bin_size = bbox.getExtents() / (float) SPATIAL_BINS;
+        SpatialBin bins[3][SPATIAL_BINS];
+        for (const Reference &ref : refs) {
+            Point3f p[3];
+            const Point3f *triangle = nullptr;
+            bool fetched = false;
+
+            for (int axis = 0; axis < 3; ++axis) {
+                if (!(bin_size[axis] > 0))
+                    continue;
+                float origin = bbox.min[axis], inv_bin_size = 1.0f / bin_size[axis];
+                int first = binIndex(ref.bbox.min[axis], origin, inv_bin_size),
+                    last  = binIndex(ref.bbox.max[axis], origin, inv_bin_size);
+
+                if (first == last) {
+                    bins[axis][first].bbox.expandBy(ref.bbox);
+                } else {
+                    if (!fetched) {
+                        triangle = getTriangle(ref.prim, p) ? p : nullptr;
+                        fetched = true;
+                    }
+                    for (int i = first; i <= last; ++i) {
+                        float lo = i == first ? -inf : origin + bin_size[axis] * i,
+                              hi = i == last  ?  inf : origin + bin_size[axis] * (i + 1);
+                        bins[axis][i].bbox.expandBy(clipReference(ref, triangle, axis, lo, hi));
+                    }
+                }
+                bins[axis][first].enter++;
+                bins[axis][last].exit++;
+            }
+        }
 
-    bool foundIntersection = false;
-    uint32_t f = 0;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!(bin_size[axis] > 0))
+                continue;
+            const SpatialBin *axis_bins = bins[axis];
+
+            BoundingBox3f right_bboxes[SPATIAL_BINS];
+            right_bboxes[SPATIAL_BINS - 1] = axis_bins[SPATIAL_BINS - 1].bbox;
+            for (int i = SPATIAL_BINS - 2; i >= 1; --i)
+                right_bboxes[i] = BoundingBox3f::merge(right_bboxes[i + 1], axis_bins[i].bbox);
+
+            BoundingBox3f bbox_left;
+            uint32_t prims_left = 0, prims_right = (uint32_t) refs.size();
+            for (int i = 0; i < SPATIAL_BINS - 1; ++i) {
+                bbox_left.expandBy(axis_bins[i].bbox);
+                prims_left += axis_bins[i].enter;
+                prims_right -= axis_bins[i].exit;
+                if (prims_left == 0 || prims_right == 0)
+                    continue;
+
+                float sah_cost = 2.0f * BVHBuildTask::TRAVERSAL_COST +
+                    tri_factor * (prims_left * bbox_left.getSurfaceArea() +
+                                  prims_right * right_bboxes[i + 1].getSurfaceArea());
+                if (sah_cost < best.cost) {
+                    best.cost = sah_cost;
+                    best.axis = axis;
+                    best.spatial = true;
+                    best.index = (uint32_t) i;
+                    best.pos = bbox.min[axis] + bin_size[axis] * (i + 1);
+                    best.leftCount = prims_left;
+                    best.rightCount = prims_right;
+                    best.leftBox = bbox_left;
+                    best.rightBox = right_bboxes[i + 1];
+                }
+            }
+        }
 
-    while (true) {
-        const BVHNode &node = m_nodes[node_idx];
+        return best;
+    }
 
-        if (!node.bbox.rayIntersect(ray)) {
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
+    /// Distribute the references according to an object split
+    void partitionObject(std::vector<Reference> &refs, const Split &split,
+                         std::vector<Reference> &left, std::vector<Reference> &right) const {
+        if (split.centroidBounds.isValid()) {
+            BinMapping mapping(split.centroidBounds, Bins::BIN_COUNT);
+            left.reserve(split.leftCount);
+            right.reserve(split.rightCount);
+            for (const Reference &ref : refs) {
+                if (mapping.index(ref.bbox.getCenter(), split.axis, Bins::BIN_COUNT) <= (int) split.index)
+                    left.push_back(ref);
+                else
+                    right.push_back(ref);
+            }
+            return;
         }
 
-        if (node.isInner()) {
-            stack[stack_idx++] = node.inner.rightChild;
-            node_idx++;
-            assert(stack_idx<64);
-        } else {
-            for (uint32_t i = node.start(), end = node.end(); i < end; ++i) {
-                uint32_t idx = m_indices[i];
-                const Shape *shape = m_shapes[findShape(idx)];
-
-                float u, v, t;
-                if (shape->rayIntersect(idx, ray, u, v, t)) {
-                    if (shadowRay)
-                        return true;
-                    foundIntersection = true;
-                    ray.maxt = its.t = t;
-                    its.uv = Point2f(u, v);
-                    its.mesh = shape;
-                    f = idx;
+        sortReferences(refs, split.axis);
+        left.assign(refs.begin(), refs.begin() + split.index);
+        right.assign(refs.begin() + split.index, refs.end());
+    }
+
+    /**
+     * \brief Distribute the references according to a spatial split
+     *
+     * References that straddle the split plane are duplicated, unless
+     * moving them entirely to one side is cheaper ("reference
+     * unsplitting"). Returns \c false if one of the sides ended up empty
+     * or the memory budget does not allow for the duplicates.
+     */
+    bool partitionSpatial(const std::vector<Reference> &refs, const BoundingBox3f &bbox,
+                          const Split &split, std::vector<Reference> &left,
+                          std::vector<Reference> &right) {
+        /* Reserve the worst-case number of duplicates */
+        size_t reserved = split.leftCount + split.rightCount - refs.size();
+        if (references.fetch_add(reserved) + reserved > maxReferences) {
+            references -= reserved;
+            return false;
+        }
+
+        int axis = split.axis;
+        float origin = bbox.min[axis],
+              inv_bin_size = SPATIAL_BINS / (bbox.max[axis] - origin);
+        BoundingBox3f bbox_left = split.leftBox, bbox_right = split.rightBox;
+        float prims_left = (float) split.leftCount, prims_right = (float) split.rightCount;
+
+        left.reserve(split.leftCount);
+        right.reserve(split.rightCount);
+        for (const Reference &ref : refs) {
+            int first = binIndex(ref.bbox.min[axis], origin, inv_bin_size),
+                last  = binIndex(ref.bbox.max[axis], origin, inv_bin_size);
+
+            if (last <= (int) split.index) {
+                left.push_back(ref);
+            } else if (first > (int) split.index) {
+                right.push_back(ref);
+            } else {
+                Reference ref_left, ref_right;
+                splitReference(ref, axis, split.pos, ref_left, ref_right);
+
+                if (!ref_left.bbox.isValid()) {
+                    right.push_back(ref_right);
+                    prims_left -= 1;
+                    continue;
+                } else if (!ref_right.bbox.isValid()) {
+                    left.push_back(ref_left);
+                    prims_right -= 1;
+                    continue;
+                }
+
+                BoundingBox3f bbox_left_unsplit = BoundingBox3f::merge(bbox_left, ref.bbox),
+                              bbox_right_unsplit = BoundingBox3f::merge(bbox_right, ref.bbox);
+                float cost_split = prims_left * bbox_left.getSurfaceArea() +
+                                   prims_right * bbox_right.getSurfaceArea(),
+                      cost_left  = prims_left * bbox_left_unsplit.getSurfaceArea() +
+                                   (prims_right - 1) * bbox_right.getSurfaceArea(),
+                      cost_right = (prims_left - 1) * bbox_left.getSurfaceArea() +
+                                   prims_right * bbox_right_unsplit.getSurfaceArea();
+
+                if (cost_left < cost_split && cost_left <= cost_right) {
+                    left.push_back(ref);
+                    bbox_left = bbox_left_unsplit;
+                    prims_right -= 1;
+                } else if (cost_right < cost_split) {
+                    right.push_back(ref);
+                    bbox_right = bbox_right_unsplit;
+                    prims_left -= 1;
+                } else {
+                    left.push_back(ref_left);
+                    right.push_back(ref_right);
                 }
             }
-            if (stack_idx == 0)
-                break;
-            node_idx = stack[--stack_idx];
-            continue;
         }
+
+        /* Return the part of the reservation that was not needed */
+        references -= reserved - (left.size() + right.size() - refs.size());
+
+        if (left.empty() || right.empty()) {
+            references -= left.size() + right.size() - refs.size();
+            left.clear();
+            right.clear();
+            return false;
+        }
+
+        return true;
     }
 
-    if (foundIntersection) {
-        its.mesh->setHitInformation(f,ray,its);
+    /// Split a reference by an axis-aligned plane (see \ref clipReference())
+    void splitReference(const Reference &ref, int axis, float pos,
+                        Reference &left, Reference &right) const {
+        const float inf = std::numeric_limits<float>::infinity();
+        Point3f p[3];
+        const Point3f *triangle = getTriangle(ref.prim, p) ? p : nullptr;
+        left.prim = right.prim = ref.prim;
+        left.bbox = clipReference(ref, triangle, axis, -inf, pos);
+        right.bbox = clipReference(ref, triangle, axis, pos, inf);
+    }
+
+    /// Fetch the vertices of a primitive, or return \c false if it is not a triangle
+    bool getTriangle(uint32_t idx, Point3f *p) const {
+        uint32_t shapeIdx = bvh.findShape(idx);
+        const Mesh *mesh = meshes[shapeIdx];
+        if (!mesh)
+            return false;
+        const MatrixXuView &F = mesh->getIndices();
+        for (int i = 0; i < 3; ++i)
+            p[i] = mesh->getVertexPosition(F(i, idx));
+        return true;
+    }
+
+    /**
+     * \brief Compute the bounds of the part of a reference between two
+     * axis-aligned planes
+     *
+     * Triangles (given by their vertices \c p) are clipped exactly; other
+     * primitives are only known through their bounding boxes, which are
+     * cut at the planes. If no part of the primitive lies between the
+     * planes, the result is an invalid bounding box.
+     */
+    static BoundingBox3f clipReference(const Reference &ref, const Point3f *p, int axis,
+                                       float lo, float hi) {
+        BoundingBox3f result;
+        if (p) {
+            for (int i = 0; i < 3; ++i) {
+                const Point3f &p0 = p[i], &p1 = p[(i + 1) % 3];
+                float v0 = p0[axis], v1 = p1[axis];
+                if (v0 >= lo && v0 <= hi)
+                    result.expandBy(p0);
+
+                /* Add the intersections of the edge and the planes */
+                for (float pos : { lo, hi }) {
+                    if ((v0 < pos && v1 > pos) || (v0 > pos && v1 < pos)) {
+                        Point3f t = p0 + (p1 - p0) * ((pos - v0) / (v1 - v0));
+                        t[axis] = pos;
+                        result.expandBy(t);
+                    }
+                }
+            }
+        } else {
+            result = ref.bbox;
+        }
+
+        result.min[axis] = std::max(result.min[axis], lo);
+        result.max[axis] = std::min(result.max[axis], hi);
+        result.clip(ref.bbox);
+        return result;
+    }
+
+    /// Sort references by their centroid along an axis (ties are broken by the primitive index)
+    static void sortReferences(std::vector<Reference> &refs, int axis) {
+        auto compare = [axis](const Reference &r1, const Reference &r2) {
+            float c1 = r1.bbox.min[axis] + r1.bbox.max[axis],
+                  c2 = r2.bbox.min[axis] + r2.bbox.max[axis];
+            return c1 < c2 || (c1 == c2 && r1.prim < r2.prim);
+        };
+        if (refs.size() >= PARALLEL_THRESHOLD)
+            tbb::parallel_sort(refs.begin(), refs.end(), compare);
+        else
+            std::sort(refs.begin(), refs.end(), compare);
+    }
+
+    static int binIndex(float value, float origin, float inv_bin_size) {
+        return std::min(std::max((int) ((value - origin) * inv_bin_size), 0),
+                        (int) SPATIAL_BINS - 1);
+    }
+
+    /// Append a subtree that was built into separate arrays
+    static void append(std::vector<BVH::BVHNode> &nodes, std::vector<uint32_t> &indices,
+                       const std::vector<BVH::BVHNode> &sub_nodes,
+                       const std::vector<uint32_t> &sub_indices) {
+        uint32_t node_offset = (uint32_t) nodes.size(),
+                 index_offset = (uint32_t) indices.size();
+        for (BVH::BVHNode node : sub_nodes) {
+            if (node.isLeaf())
+                node.leaf.start += index_offset;
+            else
+                node.inner.rightChild += node_offset;
+            nodes.push_back(node);
+        }
+        indices.insert(indices.end(), sub_indices.begin(), sub_indices.end());
+    }
+
+private:
+    const BVH &bvh;
+    float splitBudget;
+    std::vector<const Mesh *> meshes;
+    std::atomic<size_t> references;
+    size_t maxReferences;
+    float rootArea;
+    size_t peakMemory = 0;
+};
+
+/**
+ * \brief Builder for linear BVHs (LBVH) and hierarchical linear BVHs (HLBVH)
+ *
+ * The primitives are sorted along a Morton curve through their centroids
+ * using a parallel radix sort. Every range of primitives whose Morton
+ * codes share a common prefix then forms a subtree, which is split where
+ * the first differing bit changes. This takes linear time and is much
+ * faster than the SAH builders, at the cost of a less efficient tree.
+ *
+ * The hierarchical variant only uses the Morton codes within clusters
+ * of primitives that share the leading \c CLUSTER_BITS bits, and builds
+ * the top levels over these clusters using the SAH.
+ *
+ * The methods are described in the papers
+ * "Fast BVH Construction on GPUs" by Christian Lauterbach et al.
+ * (Computer Graphics Forum, Proc. Eurographics 2009) and
+ * "HLBVH: Hierarchical LBVH Construction for Real-Time Ray Tracing of
+ * Dynamic Geometry" by Jacopo Pantaleoni and David Luebke (Proc. HPG 2010)
+ */
+class LBVHBuilder {
+public:
+    /// Build-related parameters
+    enum {
+        /// Bits per axis of the 63-bit Morton codes
+        MORTON_BITS = 21,
+
+        /// Leading bits of the Morton codes that define the clusters of the HLBVH
+        CLUSTER_BITS = 15,
+
+        /// Ranges with at most this many primitives become leaves
+        MAX_LEAF_SIZE = 4,
+
+        /// Build the two subtrees of nodes with at least 4K primitives in parallel
+        PARALLEL_THRESHOLD = 4096,
+
+        /// Digits of the radix sort (in bits)
+        RADIX_BITS = 8,
+
+        /// Number of primitives processed by every task of the radix sort
+        RADIX_BLOCK_SIZE = 65536
+    };
+
+    /**
+     * Create a new builder
+     *
+     * \param hierarchical
+     *    Build the top levels over clusters of primitives using the SAH?
+     */
+    LBVHBuilder(const BVH &bvh, bool hierarchical) : bvh(bvh), hierarchical(hierarchical) { }
+
+    /// Build a tree over the given primitives and store it in depth-first order
+    void build(const std::vector<uint32_t> &prims, std::vector<BVH::BVHNode> &nodes,
+               std::vector<uint32_t> &indices) {
+        uint32_t size = (uint32_t) prims.size();
+
+        /* Bound the primitives and their centroids */
+        std::vector<BoundingBox3f> bounds(size);
+        std::vector<Point3f> centroids(size);
+        BoundingBox3f centroidBounds = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    bounds[i] = bvh.getBoundingBox(prims[i]);
+                    centroids[i] = bvh.getCentroid(prims[i]);
+                    result.expandBy(centroids[i]);
+                }
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+
+        /* Compute the Morton codes of the centroids and sort them */
+        keys.resize(size);
+        std::vector<uint32_t> order(size);
+        Vector3f extents = centroidBounds.getExtents(), scale;
+        for (int i = 0; i < 3; ++i)
+            scale[i] = extents[i] > 0 ? ((1 << MORTON_BITS) - 1) / extents[i] : 0.f;
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    Vector3f p = (centroids[i] - centroidBounds.min).cwiseProduct(scale);
+                    keys[i] = (spreadBits(quantize(p.x())) << 2) |
+                              (spreadBits(quantize(p.y())) << 1) |
+                               spreadBits(quantize(p.z()));
+                    order[i] = i;
+                }
+            }
+        );
+        centroids.clear();
+        centroids.shrink_to_fit();
+        peakMemory = sizeof(BoundingBox3f) * bounds.capacity() +
+                     2 * (sizeof(uint64_t) + sizeof(uint32_t)) * (size_t) size;
+        radixSort(keys, order);
+
+        /* Arrange the primitives along the curve */
+        sortedBounds.resize(size);
+        sortedPrims.resize(size);
+        tbb::parallel_for(
+            tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    sortedBounds[i] = bounds[order[i]];
+                    sortedPrims[i] = prims[order[i]];
+                }
+            }
+        );
+        bounds.clear();
+        bounds.shrink_to_fit();
+        std::vector<uint32_t>().swap(order);
+
+        /* A subtree with n primitives has at most 2n-1 nodes. This
+           determines where the right child of every node is placed. */
+        nodes.assign(std::max(2 * (size_t) size, (size_t) 1), BVH::BVHNode());
+        indices.resize(size);
+        output = indices.data();
+
+        if (hierarchical && size > 0) {
+            std::vector<Cluster> clusters = findClusters();
+            buildClusters(nodes.data(), 0, clusters.data(), clusters.data() + clusters.size(), 0, 0);
+        } else {
+            emit(nodes.data(), 0, 0, size, 0, 0);
+        }
+        peakMemory = std::max(peakMemory,
+            sizeof(uint64_t) * keys.capacity() + sizeof(BoundingBox3f) * sortedBounds.capacity() +
+            sizeof(uint32_t) * (sortedPrims.capacity() + indices.capacity()) +
+            sizeof(BVH::BVHNode) * nodes.capacity());
+        BVH::compactNodes(nodes);
+    }
+
+    /// Return the peak memory used by the last build (including the output arrays)
+    size_t getPeakMemory() const { return peakMemory; }
+
+private:
+    /// Range of primitives whose Morton codes share the leading \c CLUSTER_BITS bits
+    struct Cluster {
+        uint32_t begin, end;
+        BoundingBox3f bbox;
+    };
+
+    /// Convert a coordinate to an integer with \c MORTON_BITS bits
+    static uint64_t quantize(float value) {
+        return (uint64_t) std::min(std::max(value, 0.f), (float) ((1 << MORTON_BITS) - 1));
+    }
+
+    /// Insert two zero bits after each of the lower 21 bits of \c x
+    static uint64_t spreadBits(uint64_t x) {
+        x &= 0x1fffff;
+        x = (x | (x << 32)) & 0x1f00000000ffffull;
+        x = (x | (x << 16)) & 0x1f0000ff0000ffull;
+        x = (x | (x << 8))  & 0x100f00f00f00f00full;
+        x = (x | (x << 4))  & 0x10c30c30c30c30c3ull;
+        x = (x | (x << 2))  & 0x1249249249249249ull;
+        return x;
+    }
+
+    /// Return the index of the most significant set bit of a nonzero value
+    static int highestBit(uint64_t x) {
+        int result = 0;
+        for (int shift = 32; shift > 0; shift /= 2) {
+            if (x >> shift) {
+                x >>= shift;
+                result += shift;
+            }
+        }
+        return result;
+    }
+
+    /// Sort the keys and reorder the values accordingly (stable LSD radix sort)
+    static void radixSort(std::vector<uint64_t> &keys, std::vector<uint32_t> &values) {
+        const uint32_t radix = 1 << RADIX_BITS;
+        uint32_t size = (uint32_t) keys.size(),
+                 blocks = (size + RADIX_BLOCK_SIZE - 1) / RADIX_BLOCK_SIZE;
+        std::vector<uint64_t> keys_temp(size);
+        std::vector<uint32_t> values_temp(size);
+        std::vector<uint32_t> offsets((size_t) blocks * radix);
+        if (size == 0)
+            return;
+
+        for (int shift = 0; shift < 3 * MORTON_BITS; shift += RADIX_BITS) {
+            /* Count the digits within every block */
+            tbb::parallel_for(0u, blocks, [&](uint32_t block) {
+                uint32_t *count = &offsets[(size_t) block * radix];
+                std::fill(count, count + radix, 0u);
+                uint32_t end = std::min(size, (block + 1) * RADIX_BLOCK_SIZE);
+                for (uint32_t i = block * RADIX_BLOCK_SIZE; i < end; ++i)
+                    count[(keys[i] >> shift) & (radix - 1)]++;
+            });
+
+            /* Skip digits that are the same for all keys */
+            uint32_t total = 0;
+            for (uint32_t block = 0; block < blocks; ++block)
+                total += offsets[(size_t) block * radix + ((keys[0] >> shift) & (radix - 1))];
+            if (total == size)
+                continue;
+
+            /* Convert the counts into output offsets */
+            uint32_t sum = 0;
+            for (uint32_t digit = 0; digit < radix; ++digit) {
+                for (uint32_t block = 0; block < blocks; ++block) {
+                    uint32_t &offset = offsets[(size_t) block * radix + digit];
+                    uint32_t count = offset;
+                    offset = sum;
+                    sum += count;
+                }
+            }
+
+            tbb::parallel_for(0u, blocks, [&](uint32_t block) {
+                uint32_t *offset = &offsets[(size_t) block * radix];
+                uint32_t end = std::min(size, (block + 1) * RADIX_BLOCK_SIZE);
+                for (uint32_t i = block * RADIX_BLOCK_SIZE; i < end; ++i) {
+                    uint32_t idx = offset[(keys[i] >> shift) & (radix - 1)]++;
+                    keys_temp[idx] = keys[i];
+                    values_temp[idx] = values[i];
+                }
+            });
+            keys.swap(keys_temp);
+            values.swap(values_temp);
+        }
+    }
+
+    /// Build the subtree over a range of the sorted primitives, whose references start at \c out
+    BoundingBox3f emit(BVH::BVHNode *nodes, uint32_t node_idx, uint32_t begin, uint32_t end,
+                       uint32_t out, uint32_t depth) {
+        BVH::BVHNode &node = nodes[node_idx];
+        uint32_t size = end - begin;
+
+        if (size <= MAX_LEAF_SIZE) {
+            node.leaf.flag = 1;
+            node.leaf.start = out;
+            node.leaf.size = size;
+            node.bbox.reset();
+            for (uint32_t i = begin; i < end; ++i) {
+                node.bbox.expandBy(sortedBounds[i]);
+                output[out + i - begin] = sortedPrims[i];
+            }
+            return node.bbox;
+        }
+
+        /* Split where the first bit that differs within the range changes.
+           Ranges with identical codes are split in the middle, and so are
+           ranges whose balanced subtree would otherwise no longer fit
+           below BVH::MAX_DEPTH (e.g. for clumps of nearby primitives) */
+        uint64_t diff = keys[begin] ^ keys[end - 1];
+        uint32_t split = begin + size / 2;
+        int axis = -1;
+        if (diff != 0 && depth + highestBit(size) < BVH::MAX_DEPTH) {
+            int bit = highestBit(diff);
+            uint64_t mask = (uint64_t) 1 << bit;
+            split = (uint32_t) (std::partition_point(keys.begin() + begin, keys.begin() + end,
+                [mask](uint64_t key) { return (key & mask) == 0; }) - keys.begin());
+            axis = 2 - bit % 3;
+        }
+
+        uint32_t left_count = split - begin;
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        if (size >= PARALLEL_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&] { emit(nodes, node_idx_left, begin, split, out, depth + 1); },
+                [&] { emit(nodes, node_idx_right, split, end, out + left_count, depth + 1); }
+            );
+        } else {
+            emit(nodes, node_idx_left, begin, split, out, depth + 1);
+            emit(nodes, node_idx_right, split, end, out + left_count, depth + 1);
+        }
+
+        node.bbox = BoundingBox3f::merge(nodes[node_idx_left].bbox, nodes[node_idx_right].bbox);
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = axis >= 0 ? axis : node.bbox.getLargestAxis();
+        node.inner.flag = 0;
+        return node.bbox;
+    }
+
+    /// Group the sorted primitives into clusters (HLBVH)
+    std::vector<Cluster> findClusters() const {
+        std::vector<Cluster> clusters;
+        uint32_t size = (uint32_t) keys.size();
+        for (uint32_t i = 0; i < size; ++i) {
+            if (i == 0 || (keys[i] >> (3 * MORTON_BITS - CLUSTER_BITS)) !=
+                          (keys[i - 1] >> (3 * MORTON_BITS - CLUSTER_BITS))) {
+                if (!clusters.empty())
+                    clusters.back().end = i;
+                clusters.push_back(Cluster{ i, size, BoundingBox3f() });
+            }
+        }
+
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, clusters.size()),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t c = range.begin(); c != range.end(); ++c)
+                    for (uint32_t i = clusters[c].begin; i < clusters[c].end; ++i)
+                        clusters[c].bbox.expandBy(sortedBounds[i]);
+            }
+        );
+        return clusters;
+    }
+
+    /// Build the top levels of the HLBVH over a set of clusters using the SAH
+    void buildClusters(BVH::BVHNode *nodes, uint32_t node_idx, Cluster *first, Cluster *last,
+                       uint32_t out, uint32_t depth) {
+        if (last - first == 1) {
+            emit(nodes, node_idx, first->begin, first->end, out, depth);
+            return;
+        }
+
+        /* Sweep over the clusters sorted by centroid along every axis, weighting
+           the children by their number of primitives. Unlike in the regular
+           builders, splitting is mandatory here. */
+        BVH::BVHNode &node = nodes[node_idx];
+        uint32_t count = (uint32_t) (last - first), size = 0;
+        node.bbox.reset();
+        for (Cluster *c = first; c != last; ++c) {
+            node.bbox.expandBy(c->bbox);
+            size += c->end - c->begin;
+        }
+
+        std::vector<float> left_costs(count);
+        float best_cost = std::numeric_limits<float>::infinity();
+        int best_axis = 0;
+        uint32_t best_index = count / 2;
+        for (int axis = 0; axis < 3; ++axis) {
+            sortClusters(first, last, axis);
+            BoundingBox3f bbox;
+            uint32_t prims = 0;
+            for (uint32_t i = 0; i < count - 1; ++i) {
+                bbox.expandBy(first[i].bbox);
+                prims += first[i].end - first[i].begin;
+                left_costs[i] = prims * bbox.getSurfaceArea();
+            }
+            bbox.reset();
+            prims = 0;
+            for (uint32_t i = count - 1; i >= 1; --i) {
+                bbox.expandBy(first[i].bbox);
+                prims += first[i].end - first[i].begin;
+                float cost = left_costs[i - 1] + prims * bbox.getSurfaceArea();
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_index = i;
+                }
+            }
+        }
+        sortClusters(first, last, best_axis);
+
+        uint32_t left_count = 0;
+        for (uint32_t i = 0; i < best_index; ++i)
+            left_count += first[i].end - first[i].begin;
+        uint32_t node_idx_left = node_idx + 1;
+        uint32_t node_idx_right = node_idx + 2 * left_count;
+        Cluster *middle = first + best_index;
+        if (size >= PARALLEL_THRESHOLD) {
+            tbb::parallel_invoke(
+                [&] { buildClusters(nodes, node_idx_left, first, middle, out, depth + 1); },
+                [&] { buildClusters(nodes, node_idx_right, middle, last, out + left_count, depth + 1); }
+            );
+        } else {
+            buildClusters(nodes, node_idx_left, first, middle, out, depth + 1);
+            buildClusters(nodes, node_idx_right, middle, last, out + left_count, depth + 1);
+        }
+
+        node.inner.rightChild = node_idx_right;
+        node.inner.axis = best_axis;
+        node.inner.flag = 0;
+    }
+
+    /// Sort clusters by their centroid (ties are broken by position along the curve)
+    static void sortClusters(Cluster *first, Cluster *last, int axis) {
+        std::sort(first, last, [axis](const Cluster &c1, const Cluster &c2) {
+            float v1 = c1.bbox.min[axis] + c1.bbox.max[axis],
+                  v2 = c2.bbox.min[axis] + c2.bbox.max[axis];
+            return v1 < v2 || (v1 == v2 && c1.begin < c2.begin);
+        });
+    }
+
+private:
+    const BVH &bvh;
+    bool hierarchical;
+    std::vector<uint64_t> keys;             ///< Sorted Morton codes
+    std::vector<BoundingBox3f> sortedBounds; ///< Primitive bounds in curve order
+    std::vector<uint32_t> sortedPrims;      ///< Primitive indices in curve order
+    uint32_t *output;                       ///< Destination of the primitive references
+    size_t peakMemory = 0;                  ///< See \ref getPeakMemory()
+};
+
+/// Return the index of the lowest set bit of a nonzero integer
+static inline int countTrailingZeros(uint32_t value) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return (int) index;
+#else
+    return __builtin_ctz(value);
+#endif
+}
+
+/**
+ * \brief Treelet restructuring of a binary BVH
+ *
+ * A treelet consists of an inner node and some of its descendants. It is
+ * grown by repeatedly expanding the treelet leaf with the largest surface
+ * area, and its leaves may be arbitrary subtrees. The optimizer finds the
+ * topology over these leaves with the lowest SAH cost by dynamic
+ * programming over all subsets of them, and reuses the inner nodes of the
+ * treelet for it. Every inner node of a large enough subtree is the root
+ * of a treelet. These are processed bottom-up, and the subtrees of
+ * different nodes are processed in parallel. The leaves of the tree
+ * itself are not changed.
+ *
+ * The method is described in the paper
+ * "Fast Parallel Construction of High-Quality Bounding Volume Hierarchies"
+ * by Tero Karras and Timo Aila (Proc. HPG 2013)
+ */
+class TreeletOptimizer {
+public:
+    /// Optimization-related parameters
+    enum {
+        /// Maximum number of leaves of a treelet
+        TREELET_SIZE = 7,
+
+        /// Number of passes over the tree
+        ROUNDS = 3,
+
+        /// Process the two subtrees of nodes on the first few levels in parallel
+        PARALLEL_DEPTH = 6
+    };
+
+    TreeletOptimizer(BVH &bvh) : bvh(bvh) { }
+
+    /// Restructure the tree of the BVH and store it in depth-first order
+    void optimize() {
+        uint32_t count = (uint32_t) bvh.m_nodes.size();
+        nodes = bvh.m_nodes;
+        children.resize(2 * count);
+        costs.resize(count);
+        sizes.resize(count);
+        for (uint32_t i = 0; i < count; ++i) {
+            if (nodes[i].isInner()) {
+                children[2 * i] = i + 1;
+                children[2 * i + 1] = nodes[i].inner.rightChild;
+            }
+        }
+
+        /* Like the paper, only consider subtrees with at least as many
+           primitives as the treelet has leaves, and double this
+           threshold in every round */
+        uint32_t minSize = TREELET_SIZE;
+        for (int round = 0; round < ROUNDS; ++round) {
+            optimizeSubtree(0u, minSize, 0u);
+            minSize *= 2;
+        }
+
+        /* Store the new tree in depth-first order, which also requires the
+           primitive references of every subtree to be contiguous */
+        bvh.m_nodes.clear();
+        std::vector<uint32_t> indices;
+        indices.reserve(bvh.m_indices.size());
+        emit(0u, indices);
+        bvh.m_indices = std::move(indices);
+    }
+
+protected:
+    /// Subset of the leaves of a treelet
+    typedef uint32_t Subset;
+
+    /// Data of the treelet that is currently optimized
+    struct Treelet {
+        uint32_t leaves[TREELET_SIZE];      ///< Nodes that are the leaves of the treelet
+        uint32_t inner[TREELET_SIZE - 1];   ///< Inner nodes of the treelet (the first is the root)
+        BoundingBox3f bbox[1 << TREELET_SIZE]; ///< Bounding box of each subset of leaves
+        float cost[1 << TREELET_SIZE];      ///< Lowest SAH cost of a subtree over each subset
+        Subset split[1 << TREELET_SIZE];    ///< Leaves of the left child of that subtree
+        uint32_t nextInner;                 ///< Next unused inner node during reconstruction
+    };
+
+    /// Optimize all treelets within a subtree (in post-order)
+    void optimizeSubtree(uint32_t node_idx, uint32_t minSize, uint32_t depth) {
+        const BVH::BVHNode &node = nodes[node_idx];
+        if (node.isLeaf()) {
+            sizes[node_idx] = node.leaf.size;
+            costs[node_idx] = (float) BVHBuildTask::INTERSECTION_COST *
+                node.leaf.size * node.bbox.getSurfaceArea();
+            return;
+        }
+
+        uint32_t left = children[2 * node_idx], right = children[2 * node_idx + 1];
+        if (depth < PARALLEL_DEPTH) {
+            tbb::parallel_invoke(
+                [&] { optimizeSubtree(left, minSize, depth + 1); },
+                [&] { optimizeSubtree(right, minSize, depth + 1); }
+            );
+        } else {
+            optimizeSubtree(left, minSize, depth + 1);
+            optimizeSubtree(right, minSize, depth + 1);
+        }
+
+        sizes[node_idx] = sizes[left] + sizes[right];
+        costs[node_idx] = 2 * BVHBuildTask::TRAVERSAL_COST * node.bbox.getSurfaceArea() +
+            costs[left] + costs[right];
+        if (sizes[node_idx] >= minSize)
+            optimizeTreelet(node_idx);
+    }
+
+    /// Replace the treelet rooted at the given node by the one with the lowest SAH cost
+    void optimizeTreelet(uint32_t root) {
+        Treelet treelet;
+        uint32_t leafCount = 2, innerCount = 1;
+        treelet.inner[0] = root;
+        treelet.leaves[0] = children[2 * root];
+        treelet.leaves[1] = children[2 * root + 1];
+
+        /* Grow the treelet by expanding the leaf with the largest surface area */
+        while (leafCount < TREELET_SIZE) {
+            int best = -1;
+            float bestArea = -1;
+            for (uint32_t i = 0; i < leafCount; ++i) {
+                const BVH::BVHNode &node = nodes[treelet.leaves[i]];
+                float area = node.bbox.getSurfaceArea();
+                if (node.isInner() && area > bestArea) {
+                    best = (int) i;
+                    bestArea = area;
+                }
+            }
+            if (best < 0)
+                break;
+            uint32_t node_idx = treelet.leaves[best];
+            treelet.inner[innerCount++] = node_idx;
+            treelet.leaves[best] = children[2 * node_idx];
+            treelet.leaves[leafCount++] = children[2 * node_idx + 1];
+        }
+
+        /* Find the best subtree over every subset, in order of increasing
+           size (every proper subset has a smaller bit mask) */
+        Subset full = (1u << leafCount) - 1;
+        for (Subset s = 1; s <= full; ++s) {
+            Subset lowest = s & (0u - s);
+            if (s == lowest) {
+                uint32_t leaf = treelet.leaves[countTrailingZeros(s)];
+                treelet.bbox[s] = nodes[leaf].bbox;
+                treelet.cost[s] = costs[leaf];
+                continue;
+            }
+            treelet.bbox[s] = BoundingBox3f::merge(treelet.bbox[s ^ lowest], treelet.bbox[lowest]);
+
+            /* Partitions are symmetric, hence the left side always
+               contains the lowest leaf of the subset */
+            float bestCost = std::numeric_limits<float>::infinity();
+            Subset bestSplit = 0;
+            for (Subset p = (s - 1) & s; p != 0; p = (p - 1) & s) {
+                if (!(p & lowest))
+                    continue;
+                float cost = treelet.cost[p] + treelet.cost[s ^ p];
+                if (cost < bestCost) {
+                    bestCost = cost;
+                    bestSplit = p;
+                }
+            }
+            treelet.cost[s] = 2 * BVHBuildTask::TRAVERSAL_COST *
+                treelet.bbox[s].getSurfaceArea() + bestCost;
+            treelet.split[s] = bestSplit;
+        }
+
+        /* Keep the current treelet unless there is a noticeable improvement */
+        if (!(treelet.cost[full] < costs[root] * (1 - 1e-4f)))
+            return;
+
+        treelet.nextInner = 1;
+        reconstruct(treelet, root, full);
+    }
+
+    /// Rebuild the part of an optimized treelet that covers the given subset
+    void reconstruct(Treelet &treelet, uint32_t node_idx, Subset s) {
+        Subset subsets[2] = { treelet.split[s], s ^ treelet.split[s] };
+        for (int i = 0; i < 2; ++i) {
+            uint32_t child;
+            if ((subsets[i] & (subsets[i] - 1)) == 0) {
+                child = treelet.leaves[countTrailingZeros(subsets[i])];
+            } else {
+                child = treelet.inner[treelet.nextInner++];
+                reconstruct(treelet, child, subsets[i]);
+            }
+            children[2 * node_idx + i] = child;
+        }
+
+        uint32_t left = children[2 * node_idx], right = children[2 * node_idx + 1];
+        nodes[node_idx].bbox = treelet.bbox[s];
+        costs[node_idx] = treelet.cost[s];
+        sizes[node_idx] = sizes[left] + sizes[right];
+    }
+
+    /// Append a subtree to the node array of the BVH in depth-first order
+    void emit(uint32_t node_idx, std::vector<uint32_t> &indices) {
+        uint32_t result = (uint32_t) bvh.m_nodes.size();
+        bvh.m_nodes.push_back(nodes[node_idx]);
+
+        if (nodes[node_idx].isLeaf()) {
+            BVH::BVHNode &leaf = bvh.m_nodes[result];
+            indices.insert(indices.end(), bvh.m_indices.begin() + leaf.start(),
+                           bvh.m_indices.begin() + leaf.end());
+            leaf.leaf.start = (uint32_t) indices.size() - leaf.leaf.size;
+            return;
+        }
+
+        /* Traversal visits the left child first unless the ray direction is
+           negative along the split axis. Use the axis that separates the
+           children the most, and put the lower one on the left. */
+        uint32_t left = children[2 * node_idx], right = children[2 * node_idx + 1];
+        Vector3f offset = nodes[right].bbox.getCenter() - nodes[left].bbox.getCenter();
+        int axis = 0;
+        offset.cwiseAbs().maxCoeff(&axis);
+        if (offset[axis] < 0)
+            std::swap(left, right);
+
+        emit(left, indices);
+        uint32_t rightChild = (uint32_t) bvh.m_nodes.size();
+        emit(right, indices);
+
+        BVH::BVHNode &node = bvh.m_nodes[result];
+        node.inner.flag = 0;
+        node.inner.axis = (uint32_t) axis;
+        node.inner.rightChild = rightChild;
+    }
+
+private:
+    BVH &bvh;
+    std::vector<BVH::BVHNode> nodes; ///< Copy of the nodes with updated bounding boxes
+    std::vector<uint32_t> children;  ///< Left and right child of every inner node
+    std::vector<float> costs;        ///< SAH cost of every subtree (not normalized by its area)
+    std::vector<uint32_t> sizes;     ///< Number of primitive references of every subtree
+};
+
+/* 64-bit FNV-1a hash, used to detect changes of the scene geometry
+   and corrupted cache files */
+static const uint64_t BVH_HASH_SEED = 0xcbf29ce484222325ull;
+
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    const uint8_t *ptr = (const uint8_t *) data;
+    for (size_t i = 0; i < size; ++i)
+        hash = (hash ^ ptr[i]) * 0x100000001b3ull;
+    return hash;
+}
+
+template <typename T> static uint64_t hashValue(uint64_t hash, const T &value) {
+    return hashBytes(hash, &value, sizeof(T));
+}
+
+BVH::BVH(const PropertyList &propList) : BVH() {
+    m_width = (uint32_t) propList.getInteger("bvhWidth", 2);
+    if (m_width != 2 && m_width != 4 && m_width != 8)
+        throw NoriException("BVH: unsupported width %i (must be 2, 4 or 8)", m_width);
+    m_quantization = (uint32_t) propList.getInteger("bvhQuantization", 0);
+    if (m_quantization != 0 && m_quantization != 8 && m_quantization != 16)
+        throw NoriException("BVH: unsupported quantization %i (must be 0, 8 or 16 bits)", m_quantization);
+    if (m_quantization != 0 && m_width == 2)
+        throw NoriException("BVH: quantized nodes require a width of 4 or 8");
+
+    std::string builder = propList.getString("bvhBuilder", "sah");
+    if (builder == "sah")
+        m_builder = Builder::SAH;
+    else if (builder == "sbvh")
+        m_builder = Builder::SBVH;
+    else if (builder == "lbvh")
+        m_builder = Builder::LBVH;
+    else if (builder == "hlbvh")
+        m_builder = Builder::HLBVH;
+    else
+        throw NoriException("BVH: unknown builder \"%s\" (must be \"sah\", \"sbvh\", "
+                            "\"lbvh\" or \"hlbvh\")", builder);
+    m_restructure = propList.getBoolean("bvhRestructure", false);
+    std::string layout = propList.getString("bvhLayout", "depth-first");
+    if (layout == "clustered")
+        m_clustered = true;
+    else if (layout != "depth-first")
+        throw NoriException("BVH: unknown layout \"%s\" (must be \"depth-first\" or "
+                            "\"clustered\")", layout);
+    int blockSize = propList.getInteger("bvhBlockSize", 4096);
+    if (blockSize < 64)
+        throw NoriException("BVH: the block size must be at least 64 bytes");
+    m_blockSize = (uint32_t) blockSize;
+    m_splitBudget = propList.getFloat("bvhSplitBudget", 0.3f);
+    m_refitThreshold = propList.getFloat("bvhRefitThreshold", 1.3f);
+    if (propList.getBoolean("bvhLazy", false)) {
+        int lazySize = propList.getInteger("bvhLazySize", 4096);
+        if (lazySize < 1)
+            throw NoriException("BVH: the size of lazily built subtrees must be positive");
+        m_lazySize = (uint32_t) lazySize;
+    }
+
+    /* Relative cache paths refer to the directory of the scene file */
+    std::string cacheFilename = propList.getString("bvhCache", "");
+    if (!cacheFilename.empty()) {
+        filesystem::path path(cacheFilename);
+        if (!path.is_absolute())
+            path = *getFileResolver()->begin() / path;
+        m_cacheFilename = path.str();
+    }
+
+    if (m_lazySize > 0 && (m_builder != Builder::SAH || m_width != 2 || m_restructure ||
+                           !m_cacheFilename.empty()))
+        throw NoriException("BVH: lazy construction requires the \"sah\" builder and a width "
+                            "of 2, and cannot be combined with restructuring or a cache");
+}
+
+void BVH::addShape(Shape *shape) {
+    m_shapes.push_back(shape);
+    m_shapeOffset.push_back(m_shapeOffset.back() + shape->getPrimitiveCount());
+    m_bbox.expandBy(shape->getBoundingBox());
+}
+
+void BVH::clear() {
+    for (auto shape : m_shapes)
+        delete shape;
+    m_shapes.clear();
+    m_shapeOffset.clear();
+    m_shapeOffset.push_back(0u);
+    m_nodes.clear();
+    m_indices.clear();
+    m_primitives.clear();
+    m_leafBlocks.clear();
+    m_clusteredNodes.clear();
+    m_nodes4.clear();
+    m_nodes8.clear();
+    m_nodes4q8.clear();
+    m_nodes8q8.clear();
+    m_nodes4q16.clear();
+    m_nodes8q16.clear();
+    m_buildCosts.clear();
+    m_lazySubtrees.clear();
+    m_pendingSubtrees = 0;
+    m_buildBounds.clear();
+    m_buildCentroids.clear();
+    m_bbox.reset();
+    m_nodes.shrink_to_fit();
+    m_shapes.shrink_to_fit();
+    m_shapeOffset.shrink_to_fit();
+    m_indices.shrink_to_fit();
+    m_primitives.shrink_to_fit();
+    m_leafBlocks.shrink_to_fit();
+    m_clusteredNodes.shrink_to_fit();
+    m_nodes4.shrink_to_fit();
+    m_nodes8.shrink_to_fit();
+    m_nodes4q8.shrink_to_fit();
+    m_nodes8q8.shrink_to_fit();
+    m_nodes4q16.shrink_to_fit();
+    m_nodes8q16.shrink_to_fit();
+    m_buildCosts.shrink_to_fit();
+    m_lazySubtrees.shrink_to_fit();
+    m_buildBounds.shrink_to_fit();
+    m_buildCentroids.shrink_to_fit();
+}
+
+void BVH::build() {
+    uint32_t size  = getPrimitiveCount();
+    if (size == 0)
+        return;
+
+    /* The shapes may have moved since they were added */
+    m_bbox.reset();
+    for (const Shape *shape : m_shapes)
+        m_bbox.expandBy(shape->getBoundingBox());
+    m_buildCosts.clear();
+
+    Timer timer;
+    uint64_t hash = 0;
+    bool cached = false;
+    if (!m_cacheFilename.empty()) {
+        /* Trees of different builders must not be mixed up */
+        hash = computeGeometryHash();
+        hash = hashValue(hash, m_builder);
+        if (m_builder == Builder::SBVH)
+            hash = hashValue(hash, m_splitBudget);
+        hash = hashValue(hash, m_restructure);
+        if (filesystem::path(m_cacheFilename).exists()) {
+            cout << "Loading cached BVH from \"" << m_cacheFilename << "\" .. ";
+            cout.flush();
+            cached = loadCache(hash);
+            if (!cached)
+                cout << "outdated or invalid." << endl;
+        }
+    }
+
+    float objectSplitCost = 0.0f, spatialSplitCost = 0.0f, unoptimizedCost = 0.0f;
+    std::string constructionTime, optimizationTime;
+    m_peakBuildMemory = 0;
+    if (!cached) {
+        const char *names[] = { "SAH", "spatial split", "linear", "hierarchical linear" };
+        cout << "Constructing a " << names[(int) m_builder]
+            << " BVH (" << m_shapes.size()
+            << (m_shapes.size() == 1 ? " shape, " : " shapes, ")
+            << size << " primitives) .. ";
+        cout.flush();
+        Timer constructionTimer;
+        if (m_builder == Builder::SBVH) {
+            /* Also build a regular tree, and keep it if the spatial splits don't pay off */
+            m_indices.resize(size);
+            for (uint32_t i = 0; i < size; ++i)
+                m_indices[i] = i;
+            construct(m_bbox);
+            objectSplitCost = statistics().first;
+            std::vector<BVHNode> nodes = std::move(m_nodes);
+            std::vector<uint32_t> indices = std::move(m_indices);
+            size_t objectSplitMemory = sizeof(BVHNode) * nodes.capacity() +
+                                       sizeof(uint32_t) * indices.capacity(),
+                   peakMemory = m_peakBuildMemory;
+
+            m_peakBuildMemory = 0;
+            constructTree();
+            m_peakBuildMemory = std::max(peakMemory, m_peakBuildMemory + objectSplitMemory);
+            if (statistics().first > objectSplitCost) {
+                spatialSplitCost = statistics().first;
+                objectSplitCost = 0.0f;
+                m_nodes = std::move(nodes);
+                m_indices = std::move(indices);
+            }
+        } else {
+            constructTree();
+        }
+        constructionTime = constructionTimer.elapsedString();
+        if (m_restructure) {
+            Timer optimizationTimer;
+            unoptimizedCost = statistics().first;
+            TreeletOptimizer(*this).optimize();
+            optimizationTime = optimizationTimer.elapsedString();
+        }
+        if (!m_cacheFilename.empty())
+            saveCache(hash);
+    }
+
+    prepareTraversal();
+
+    std::pair<size_t, size_t> wideMemory = getWideNodeMemory();
+    cout << "done (took " << timer.elapsedString() << " and "
+        << memString(sizeof(BVHNode) * (m_nodes.size() + m_clusteredNodes.size()) +
+                     sizeof(uint32_t) * m_indices.size() +
+                     sizeof(PrimitiveBlock) * m_primitives.size() +
+                     sizeof(uint32_t) * m_leafBlocks.size() + wideMemory.first);
+    if (!constructionTime.empty())
+        cout << ", hierarchy built in " << constructionTime << " using at most "
+             << memString(m_peakBuildMemory);
+    cout << (m_lazySubtrees.empty() ? ", SAH cost = " : ", SAH cost of the top levels = ")
+         << statistics().first;
+    if (objectSplitCost > 0)
+        cout << " vs. " << objectSplitCost << " without spatial splits";
+    if (spatialSplitCost > 0)
+        cout << " (spatial splits discarded, they gave " << spatialSplitCost << ")";
+    if (unoptimizedCost > 0)
+        cout << " vs. " << unoptimizedCost << " before restructuring in " << optimizationTime;
+    if (m_indices.size() > size)
+        cout << ", " << tfm::format("%.1f", 100.0 * (m_indices.size() - size) / size)
+             << "% duplicate references";
+    if (!m_lazySubtrees.empty())
+        cout << ", " << m_lazySubtrees.size()
+             << (m_lazySubtrees.size() == 1 ? " subtree" : " subtrees") << " deferred";
+    if (m_width > 2)
+        cout << ", " << m_width << "-wide";
+    if (m_quantization > 0)
+        cout << ", " << m_quantization << "-bit quantized nodes: " << memString(wideMemory.first)
+             << " instead of " << memString(wideMemory.second);
+    cout << ")." << endl;
+}
+
+void BVH::construct(const BoundingBox3f &bbox) {
+    uint32_t size = (uint32_t) m_indices.size();
+
+    if (sizeof(BVHNode) != 32)
+        throw NoriException("BVH Node is not packed! Investigate compiler settings.");
+
+    /* Reserve one node per primitive, which suffices unless the average
+       leaf has less than two primitives (the pool grows if necessary).
+       Unused pages of this allocation are never touched. */
+    BVHBuildTask::NodePool pool;
+    pool.reserve(size);
+    BVHNode &root = *pool.grow_by(1);
+    root.data = 0;
+    root.bbox = bbox;
+
+    /* Precompute the bounds and centroids of the primitives, which
+       saves many virtual function calls during the build */
+    m_buildBounds.resize(getPrimitiveCount());
+    m_buildCentroids.resize(getPrimitiveCount());
+    BoundingBox3f centroidBounds = tbb::parallel_reduce(
+        tbb::blocked_range<uint32_t>(0u, size, BVHBuildTask::GRAIN_SIZE),
+        BoundingBox3f(),
+        [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                uint32_t f = m_indices[i];
+                m_buildBounds[f] = getBoundingBox(f);
+                m_buildCentroids[f] = getCentroid(f);
+                result.expandBy(m_buildCentroids[f]);
+            }
+            return result;
+        },
+        [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+            return BoundingBox3f::merge(b1, b2);
+        }
+    );
+
+    uint32_t *indices = m_indices.data();
+    BVHBuildTask& task = *new(tbb::task::allocate_root())
+        BVHBuildTask(*this, pool, 0u, indices, indices + size, centroidBounds);
+    tbb::task::spawn_root_and_wait(task);
+
+    size_t poolMemory = sizeof(BVHNode) * pool.capacity(),
+           indexMemory = sizeof(uint32_t) * m_indices.capacity();
+    updatePeakBuildMemory(poolMemory + indexMemory +
+                          sizeof(BoundingBox3f) * m_buildBounds.capacity() +
+                          sizeof(Point3f) * m_buildCentroids.capacity());
+    if (m_lazySize == 0) {
+        /* Lazily built subtrees still need the bounds and centroids */
+        m_buildBounds.clear();
+        m_buildBounds.shrink_to_fit();
+        m_buildCentroids.clear();
+        m_buildCentroids.shrink_to_fit();
+    }
+
+    /* Store the tree in depth-first order */
+    m_nodes.clear();
+    m_nodes.shrink_to_fit();
+    m_nodes.resize(pool.size());
+    storeDepthFirst(pool, m_nodes, [&](uint32_t node_idx) { return pool[node_idx].inner.rightChild - 1; });
+    updatePeakBuildMemory(poolMemory + indexMemory + sizeof(BVHNode) * m_nodes.capacity());
+
+    if (m_lazySize > 0)
+        createLazySubtrees();
+}
+
+template <typename Input, typename LeftChild> uint32_t BVH::storeDepthFirst(const Input &input,
+        std::vector<BVHNode> &output, LeftChild leftChild) {
+    /* Stack of nodes to visit, along with the parent whose right child they are */
+    const uint32_t none = std::numeric_limits<uint32_t>::max();
+    std::vector<std::pair<uint32_t, uint32_t>> stack(1, std::make_pair(0u, none));
+    uint32_t count = 0;
+
+    while (!stack.empty()) {
+        std::pair<uint32_t, uint32_t> entry = stack.back();
+        stack.pop_back();
+        BVHNode node = input[entry.first];
+        if (node.isInner()) {
+            stack.push_back(std::make_pair(node.inner.rightChild, count));
+            stack.push_back(std::make_pair(leftChild(entry.first), none));
+        }
+        if (entry.second != none)
+            output[entry.second].inner.rightChild = count;
+        output[count++] = node;
+    }
+    return count;
+}
+
+void BVH::compactNodes(std::vector<BVHNode> &nodes) {
+    if (nodes.empty() || nodes[0].isUnused()) {
+        nodes.clear();
+        return;
+    }
+
+    /* The node array was allocated conservatively and now contains many
+       unused entries. The used ones are in depth-first order, hence every
+       node moves to a position that does not hold a node which is yet to
+       be visited, and the compactification can be done in place. */
+    uint32_t count = storeDepthFirst(nodes, nodes, [](uint32_t node_idx) { return node_idx + 1; });
+    nodes.resize(count);
+}
+
+void BVH::updatePeakBuildMemory(size_t bytes) {
+    m_peakBuildMemory = std::max(m_peakBuildMemory, bytes);
+}
+
+void BVH::constructTree() {
+    uint32_t size = getPrimitiveCount();
+    if (m_builder == Builder::SAH) {
+        m_indices.resize(size);
+        for (uint32_t i = 0; i < size; ++i)
+            m_indices[i] = i;
+        construct(m_bbox);
+        return;
+    }
+
+    std::vector<uint32_t> prims(size);
+    for (uint32_t i = 0; i < size; ++i)
+        prims[i] = i;
+
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> indices;
+    if (m_builder == Builder::SBVH) {
+        SBVHBuilder builder(*this, m_splitBudget);
+        builder.build(prims, nodes, indices);
+        updatePeakBuildMemory(builder.getPeakMemory() + sizeof(uint32_t) * prims.capacity());
+    } else {
+        LBVHBuilder builder(*this, m_builder == Builder::HLBVH);
+        builder.build(prims, nodes, indices);
+        updatePeakBuildMemory(builder.getPeakMemory() + sizeof(uint32_t) * prims.capacity());
+    }
+    std::vector<uint32_t>().swap(prims);
+
+    /* Shrinking the arrays briefly needs memory for both copies */
+    updatePeakBuildMemory(sizeof(BVHNode) * (nodes.capacity() + nodes.size()) +
+                          sizeof(uint32_t) * (indices.capacity() + indices.size()));
+    nodes.shrink_to_fit();
+    indices.shrink_to_fit();
+    m_nodes = std::move(nodes);
+    m_indices = std::move(indices);
+}
+
+void BVH::prepareTraversal() {
+    /* Every inner node on the path to a leaf occupies at most one stack entry */
+    uint32_t depth = getMaxDepth();
+    if (depth > MAX_DEPTH)
+        throw NoriException("BVH: the tree has a depth of %i, but traversal supports at most %i levels",
+                            depth, (uint32_t) MAX_DEPTH);
+
+    buildPrimitiveBlocks();
+
+    m_clusteredNodes.clear();
+    if (m_clustered && m_width == 2)
+        clusterNodes();
+
+    /* Optionally collapse the binary tree into a wide BVH */
+    if (m_width == 4)
+        prepareWideNodes<4>(m_nodes4, m_nodes4q8, m_nodes4q16);
+    else if (m_width == 8)
+        prepareWideNodes<8>(m_nodes8, m_nodes8q8, m_nodes8q16);
+}
+
+uint32_t BVH::getMaxDepth() const {
+    uint32_t result = 0;
+    if (m_nodes.empty())
+        return result;
+
+    std::vector<std::pair<uint32_t, uint32_t>> stack(1, std::make_pair(0u, 0u));
+    while (!stack.empty()) {
+        uint32_t node_idx = stack.back().first, depth = stack.back().second;
+        stack.pop_back();
+        const BVHNode &node = m_nodes[node_idx];
+        if (node.isLeaf()) {
+            result = std::max(result, depth);
+        } else {
+            stack.push_back(std::make_pair(node_idx + 1, depth + 1));
+            stack.push_back(std::make_pair(node.inner.rightChild, depth + 1));
+        }
+    }
+    return result;
+}
+
+template <int Width> void BVH::prepareWideNodes(NodeVector<WideNode<Width>> &nodes,
+        NodeVector<QuantizedWideNode<Width, uint8_t>> &nodes8Bit,
+        NodeVector<QuantizedWideNode<Width, uint16_t>> &nodes16Bit) {
+    nodes.clear();
+    nodes8Bit.clear();
+    nodes16Bit.clear();
+    collapse<Width>(0u, nodes);
+
+    /* Traversal only uses one of the formats, release the other one */
+    if (m_quantization == 8)
+        quantize(nodes, nodes8Bit);
+    else if (m_quantization == 16)
+        quantize(nodes, nodes16Bit);
+    if (m_quantization != 0) {
+        nodes.clear();
+        nodes.shrink_to_fit();
+    }
+
+    if (m_clustered) {
+        clusterWideNodes(nodes);
+        clusterWideNodes(nodes8Bit);
+        clusterWideNodes(nodes16Bit);
+    }
+}
+
+void BVH::clusterNodes() {
+    /* Every unit is a pair of siblings that fills one cache line, and is
+       identified by the index of its parent. The root is a unit of its own. */
+    const uint32_t ROOT = (uint32_t) -1;
+    uint32_t capacity = std::max(1u, m_blockSize / (uint32_t) (2 * sizeof(BVHNode)));
+    std::vector<uint32_t> position(m_nodes.size()), blocks(1, ROOT), queue;
+    uint32_t pairCount = 0;
+
+    while (!blocks.empty()) {
+        /* Fill a block with the top levels of a subtree in breadth-first order */
+        queue.assign(1, blocks.back());
+        blocks.pop_back();
+        size_t head = 0;
+        for (; head < queue.size() && head < capacity; ++head) {
+            uint32_t parent = queue[head], slot = 2 * pairCount++;
+            uint32_t members[2] = { 0u, ROOT };
+            if (parent != ROOT) {
+                members[0] = parent + 1;
+                members[1] = m_nodes[parent].inner.rightChild;
+            }
+            for (int i = 0; i < 2 && members[i] != ROOT; ++i) {
+                position[members[i]] = slot + i;
+                if (m_nodes[members[i]].isInner())
+                    queue.push_back(members[i]);
+            }
+        }
+
+        /* The remaining subtrees start blocks of their own, which are
+           stored in depth-first order */
+        for (size_t i = queue.size(); i-- > head; )
+            blocks.push_back(queue[i]);
+    }
+
+    m_clusteredNodes.resize(2 * (size_t) pairCount);
+    for (uint32_t i = 0; i < (uint32_t) m_nodes.size(); ++i) {
+        BVHNode &node = m_clusteredNodes[position[i]];
+        node = m_nodes[i];
+        if (node.isInner())
+            node.inner.rightChild = position[node.inner.rightChild];
+    }
+}
+
+template <typename Node> void BVH::clusterWideNodes(NodeVector<Node> &nodes) const {
+    if (nodes.empty())
+        return;
+
+    uint32_t capacity = std::max(1u, m_blockSize / (uint32_t) sizeof(Node));
+    std::vector<uint32_t> position(nodes.size()), order, blocks(1, 0u), queue;
+    order.reserve(nodes.size());
+
+    while (!blocks.empty()) {
+        queue.assign(1, blocks.back());
+        blocks.pop_back();
+        size_t head = 0;
+        for (; head < queue.size() && head < capacity; ++head) {
+            uint32_t node_idx = queue[head];
+            position[node_idx] = (uint32_t) order.size();
+            order.push_back(node_idx);
+            const Node &node = nodes[node_idx];
+            for (int i = 0; i < Node::ChildCount; ++i) {
+                if (node.size[i] == 0 && node.child[i] != 0)
+                    queue.push_back(node.child[i]);
+            }
+        }
+        for (size_t i = queue.size(); i-- > head; )
+            blocks.push_back(queue[i]);
+    }
+
+    /* The root stays at index 0, which marks unused child slots */
+    NodeVector<Node> result(nodes.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        Node &node = result[i];
+        node = nodes[order[i]];
+        for (int j = 0; j < Node::ChildCount; ++j) {
+            if (node.size[j] == 0 && node.child[j] != 0)
+                node.child[j] = position[node.child[j]];
+        }
+    }
+    nodes.swap(result);
+}
+
+std::pair<size_t, size_t> BVH::getWideNodeMemory() const {
+    size_t count4 = m_nodes4.size() + m_nodes4q8.size() + m_nodes4q16.size(),
+           count8 = m_nodes8.size() + m_nodes8q8.size() + m_nodes8q16.size();
+    size_t memory =
+        sizeof(WideNode<4>) * m_nodes4.size() + sizeof(WideNode<8>) * m_nodes8.size() +
+        sizeof(QuantizedWideNode<4, uint8_t>) * m_nodes4q8.size() +
+        sizeof(QuantizedWideNode<8, uint8_t>) * m_nodes8q8.size() +
+        sizeof(QuantizedWideNode<4, uint16_t>) * m_nodes4q16.size() +
+        sizeof(QuantizedWideNode<8, uint16_t>) * m_nodes8q16.size();
+    return std::make_pair(memory, sizeof(WideNode<4>) * count4 + sizeof(WideNode<8>) * count8);
+}
+
+void BVH::refit() {
+    if (m_nodes.empty())
+        return;
+
+    cout << "Refitting BVH .. ";
+    cout.flush();
+    Timer timer;
+
+    if (m_lazySize > 0) {
+        /* Only the top levels of a lazy tree are built eagerly, and starting
+           over is cheaper than building all of its subtrees to refit them */
+        m_bbox.reset();
+        for (const Shape *shape : m_shapes)
+            m_bbox.expandBy(shape->getBoundingBox());
+        constructTree();
+        prepareTraversal();
+        cout << "done (took " << timer.elapsedString() << "; rebuilt the top levels, "
+             << m_lazySubtrees.size() << " subtrees deferred)." << endl;
+        return;
+    }
+
+    /* The nodes still have the bounding boxes of the tree as it was
+       constructed, which serves as the reference for its quality */
+    if (m_buildCosts.size() != m_nodes.size()) {
+        m_buildCosts.resize(m_nodes.size());
+        refitNode(0u, m_buildCosts, false);
+    }
+
+    m_bbox.reset();
+    for (const Shape *shape : m_shapes)
+        m_bbox.expandBy(shape->getBoundingBox());
+
+    std::vector<float> costs(m_nodes.size());
+    refitNode(0u, costs, true);
+    float refitCost = costs[0], buildCost = m_buildCosts[0];
+
+    /* Quality monitor: locate the subtrees whose SAH cost degraded too much */
+    std::vector<uint32_t> degraded;
+    if (m_nodes[0].isInner() && costs[0] > m_refitThreshold * m_buildCosts[0])
+        findDegradedSubtrees(0u, costs, degraded);
+
+    uint32_t degradedPrims = 0;
+    for (uint32_t node_idx : degraded) {
+        uint32_t node_end, index_start, index_end;
+        getSubtreeRange(node_idx, node_end, index_start, index_end);
+        degradedPrims += index_end - index_start;
+    }
+
+    bool rebuild = !degraded.empty() && (degraded[0] == 0 || 2 * degradedPrims > m_indices.size());
+    if (rebuild) {
+        constructTree();
+        if (m_restructure)
+            TreeletOptimizer(*this).optimize();
+        m_buildCosts.resize(m_nodes.size());
+        refitNode(0u, m_buildCosts, false);
+    } else {
+        /* Start with the last subtree, so that the indices of the others remain valid */
+        for (auto it = degraded.rbegin(); it != degraded.rend(); ++it)
+            rebuildSubtree(*it);
+    }
+
+    prepareTraversal();
+
+    cout << "done (took " << timer.elapsedString() << ", SAH cost = " << refitCost
+         << " vs. " << buildCost << " after construction";
+    if (rebuild)
+        cout << "; rebuilt the entire tree";
+    else if (!degraded.empty())
+        cout << "; rebuilt " << degraded.size()
+             << (degraded.size() == 1 ? " subtree with " : " subtrees with ")
+             << degradedPrims << " references";
+    if (!degraded.empty())
+        cout << ", SAH cost = " << statistics().first;
+    cout << ")." << endl;
+}
+
+void BVH::refitNode(uint32_t node_idx, std::vector<float> &costs, bool updateBounds,
+                    uint32_t depth) {
+    /* Process the subtrees of the first few levels in parallel */
+    const uint32_t PARALLEL_DEPTH = 6;
+
+    BVHNode &node = m_nodes[node_idx];
+    if (node.isLeaf()) {
+        if (updateBounds) {
+            node.bbox.reset();
+            for (uint32_t i = node.start(); i < node.end(); ++i)
+                node.bbox.expandBy(getBoundingBox(m_indices[i]));
+        }
+        costs[node_idx] = (float) BVHBuildTask::INTERSECTION_COST * node.leaf.size;
+        return;
+    }
+
+    uint32_t left = node_idx + 1u, right = node.inner.rightChild;
+    if (depth < PARALLEL_DEPTH) {
+        tbb::parallel_invoke(
+            [&] { refitNode(left, costs, updateBounds, depth + 1); },
+            [&] { refitNode(right, costs, updateBounds, depth + 1); }
+        );
+    } else {
+        refitNode(left, costs, updateBounds, depth + 1);
+        refitNode(right, costs, updateBounds, depth + 1);
+    }
+
+    const BoundingBox3f &bbox_left = m_nodes[left].bbox, &bbox_right = m_nodes[right].bbox;
+    if (updateBounds)
+        node.bbox = BoundingBox3f::merge(bbox_left, bbox_right);
+
+    costs[node_idx] = 2 * BVHBuildTask::TRAVERSAL_COST +
+        (bbox_left.getSurfaceArea() * costs[left] +
+         bbox_right.getSurfaceArea() * costs[right]) / node.bbox.getSurfaceArea();
+}
+
+void BVH::findDegradedSubtrees(uint32_t node_idx, const std::vector<float> &costs,
+                               std::vector<uint32_t> &result) const {
+    uint32_t children[2] = { node_idx + 1u, m_nodes[node_idx].inner.rightChild };
+    bool found = false;
+    for (uint32_t child : children) {
+        if (m_nodes[child].isInner() &&
+            costs[child] > m_refitThreshold * m_buildCosts[child]) {
+            findDegradedSubtrees(child, costs, result);
+            found = true;
+        }
+    }
+
+    /* Otherwise, the cost increased because the children overlap more */
+    if (!found)
+        result.push_back(node_idx);
+}
+
+void BVH::getSubtreeRange(uint32_t node_idx, uint32_t &node_end, uint32_t &index_start,
+                          uint32_t &index_end) const {
+    /* Subtrees are stored in depth-first order and occupy contiguous ranges */
+    uint32_t first = node_idx, last = node_idx;
+    while (m_nodes[first].isInner())
+        first++;
+    while (m_nodes[last].isInner())
+        last = m_nodes[last].inner.rightChild;
+    node_end = last + 1;
+    index_start = m_nodes[first].start();
+    index_end = m_nodes[last].end();
+}
+
+void BVH::rebuildSubtree(uint32_t node_idx) {
+    uint32_t node_end, index_start, index_end;
+    getSubtreeRange(node_idx, node_end, index_start, index_end);
+
+    /* Spatial splits may have referenced some primitives more than once */
+    std::vector<uint32_t> prims(m_indices.begin() + index_start, m_indices.begin() + index_end);
+    std::sort(prims.begin(), prims.end());
+    prims.erase(std::unique(prims.begin(), prims.end()), prims.end());
+
+    std::vector<BVHNode> nodes;
+    std::vector<uint32_t> indices;
+    if (m_builder == Builder::SBVH) {
+        SBVHBuilder builder(*this, m_splitBudget);
+        builder.build(prims, nodes, indices);
+    } else if (m_builder == Builder::LBVH || m_builder == Builder::HLBVH) {
+        LBVHBuilder builder(*this, m_builder == Builder::HLBVH);
+        builder.build(prims, nodes, indices);
+    } else {
+        /* construct() works on the member arrays -- swap them temporarily */
+        BoundingBox3f bbox = m_nodes[node_idx].bbox;
+        m_nodes.swap(nodes);
+        m_indices.swap(indices);
+        m_indices = std::move(prims);
+        construct(bbox);
+        m_nodes.swap(nodes);
+        m_indices.swap(indices);
+    }
+
+    /* Shift the references of the nodes after the subtree */
+    int64_t node_shift = (int64_t) nodes.size() - (node_end - node_idx),
+            index_shift = (int64_t) indices.size() - (index_end - index_start);
+    for (uint32_t i = 0; i < (uint32_t) m_nodes.size(); ++i) {
+        BVHNode &node = m_nodes[i];
+        if (i >= node_idx && i < node_end)
+            continue;
+        if (node.isLeaf() && node.start() >= index_end)
+            node.leaf.start = (uint32_t) (node.start() + index_shift);
+        else if (node.isInner() && node.inner.rightChild >= node_end)
+            node.inner.rightChild = (uint32_t) (node.inner.rightChild + node_shift);
+    }
+
+    for (BVHNode &node : nodes) {
+        if (node.isLeaf())
+            node.leaf.start += index_start;
+        else
+            node.inner.rightChild += node_idx;
+    }
+
+    m_nodes.erase(m_nodes.begin() + node_idx, m_nodes.begin() + node_end);
+    m_nodes.insert(m_nodes.begin() + node_idx, nodes.begin(), nodes.end());
+    m_indices.erase(m_indices.begin() + index_start, m_indices.begin() + index_end);
+    m_indices.insert(m_indices.begin() + index_start, indices.begin(), indices.end());
+
+    /* The new subtree is the reference for future refits */
+    m_buildCosts.erase(m_buildCosts.begin() + node_idx, m_buildCosts.begin() + node_end);
+    m_buildCosts.insert(m_buildCosts.begin() + node_idx, nodes.size(), 0.0f);
+    refitNode(node_idx, m_buildCosts, false);
+}
+
+uint64_t BVH::computeGeometryHash() const {
+    uint64_t hash = BVH_HASH_SEED;
+    hash = hashValue(hash, (uint32_t) m_shapes.size());
+
+    for (const Shape *shape : m_shapes) {
+        uint32_t count = shape->getPrimitiveCount();
+        hash = hashValue(hash, count);
+
+        if (const Mesh *mesh = dynamic_cast<const Mesh *>(shape)) {
+            const MatrixXfView &V = mesh->getVertexPositions();
+            const MatrixXuView &F = mesh->getIndices();
+            if (V.cols() == mesh->getVertexCount()) {
+                hash = hashBytes(hash, V.data(), sizeof(float) * V.size());
+            } else {
+                /* Quantized positions */
+                for (uint32_t i = 0; i < mesh->getVertexCount(); ++i)
+                    hash = hashValue(hash, mesh->getVertexPosition(i));
+            }
+            hash = hashBytes(hash, F.data(), sizeof(uint32_t) * F.size());
+        } else {
+            /* Other shapes are only known through their bounding boxes */
+            for (uint32_t i = 0; i < count; ++i) {
+                BoundingBox3f bbox = shape->getBoundingBox(i);
+                hash = hashValue(hash, bbox.min);
+                hash = hashValue(hash, bbox.max);
+            }
+        }
+    }
+
+    return hash;
+}
+
+/* Header of a BVH cache file, which is followed by the nodes and indices */
+struct BVHCacheHeader {
+    char magic[4];        ///< Always "NBVH"
+    uint32_t version;     ///< File format version
+    uint64_t hash;        ///< Hash of the geometry the BVH was built for
+    uint64_t checksum;    ///< Hash of the nodes and indices that follow
+    uint32_t nodeCount;   ///< Number of BVH nodes
+    uint32_t indexCount;  ///< Number of primitive indices
+};
+
+static const uint32_t BVH_CACHE_VERSION = 1;
+
+bool BVH::loadCache(uint64_t hash) {
+    try {
+        MemoryMappedFile file(m_cacheFilename);
+        BVHCacheHeader header;
+        if (file.size() < sizeof(BVHCacheHeader))
+            return false;
+        memcpy(&header, file.data(), sizeof(BVHCacheHeader));
+
+        if (memcmp(header.magic, "NBVH", 4) != 0 || header.version != BVH_CACHE_VERSION ||
+            header.hash != hash || header.nodeCount == 0 ||
+            file.size() != sizeof(BVHCacheHeader) + sizeof(BVHNode) * (size_t) header.nodeCount
+                                                  + sizeof(uint32_t) * (size_t) header.indexCount)
+            return false;
+
+        const uint8_t *ptr = file.data() + sizeof(BVHCacheHeader);
+        if (hashBytes(BVH_HASH_SEED, ptr, file.size() - sizeof(BVHCacheHeader)) != header.checksum)
+            return false;
+
+        const BVHNode *nodes = (const BVHNode *) ptr;
+        m_nodes.assign(nodes, nodes + header.nodeCount);
+        ptr += sizeof(BVHNode) * m_nodes.size();
+        m_indices.resize(header.indexCount);
+        memcpy(m_indices.data(), ptr, sizeof(uint32_t) * m_indices.size());
+    } catch (const NoriException &) {
+        return false;
+    }
+
+    /* Reject files whose references are out of range */
+    uint32_t primitiveCount = getPrimitiveCount(), nodeCount = (uint32_t) m_nodes.size();
+    bool valid = true;
+    for (uint32_t index : m_indices)
+        valid &= index < primitiveCount;
+    for (const BVHNode &node : m_nodes) {
+        if (node.isLeaf())
+            valid &= (uint64_t) node.start() + node.leaf.size <= m_indices.size();
+        else
+            valid &= node.inner.rightChild < nodeCount;
+    }
+
+    if (!valid) {
+        m_nodes.clear();
+        m_indices.clear();
+    }
+
+    return valid;
+}
+
+/// Return the ID of the current process (used to name temporary files)
+static int getProcessId() {
+#if defined(PLATFORM_WINDOWS)
+    return _getpid();
+#else
+    return (int) getpid();
+#endif
+}
+
+void BVH::saveCache(uint64_t hash) const {
+    /* Write to a temporary file with a name that is unique to this process
+       and call first, so that concurrent renders never see (or write into)
+       a partially written cache */
+    static std::atomic<uint32_t> tempFileCounter(0);
+    std::string tempFilename = tfm::format("%s.%i.%i.tmp", m_cacheFilename,
+                                           getProcessId(), tempFileCounter++);
+    {
+        std::ofstream os(tempFilename, std::ios::binary);
+        BVHCacheHeader header;
+        memcpy(header.magic, "NBVH", 4);
+        header.version = BVH_CACHE_VERSION;
+        header.hash = hash;
+        header.nodeCount = (uint32_t) m_nodes.size();
+        header.indexCount = (uint32_t) m_indices.size();
+        header.checksum = hashBytes(BVH_HASH_SEED, m_nodes.data(), sizeof(BVHNode) * m_nodes.size());
+        header.checksum = hashBytes(header.checksum, m_indices.data(), sizeof(uint32_t) * m_indices.size());
+        os.write((const char *) &header, sizeof(BVHCacheHeader));
+        os.write((const char *) m_nodes.data(), sizeof(BVHNode) * m_nodes.size());
+        os.write((const char *) m_indices.data(), sizeof(uint32_t) * m_indices.size());
+        if (!os) {
+            cerr << "Warning: could not write the BVH cache \"" << m_cacheFilename << "\"" << endl;
+            os.close();
+            std::remove(tempFilename.c_str());
+            return;
+        }
+    }
+
+    std::remove(m_cacheFilename.c_str());
+    if (std::rename(tempFilename.c_str(), m_cacheFilename.c_str()) != 0) {
+        cerr << "Warning: could not write the BVH cache \"" << m_cacheFilename << "\"" << endl;
+        std::remove(tempFilename.c_str());
+    }
+}
+
+void BVH::buildPrimitiveBlocks() {
+    buildPrimitiveBlocks(m_nodes, 0u, (uint32_t) m_indices.size(), m_primitives, m_leafBlocks, true);
+}
+
+void BVH::buildPrimitiveBlocks(const std::vector<BVHNode> &nodes, uint32_t start, uint32_t end,
+        NodeVector<PrimitiveBlock> &primitives, std::vector<uint32_t> &leafBlocks,
+        bool parallel) const {
+    typedef tbb::blocked_range<size_t> Range;
+    auto forEach = [parallel](const Range &range, const std::function<void(const Range &)> &body) {
+        if (parallel)
+            tbb::parallel_for(range, body);
+        else
+            body(range);
+    };
+
+    const uint32_t Width = PrimitiveBlock::Width;
+    std::vector<const Mesh *> meshes(m_shapes.size());
+    std::vector<const Sphere *> spheres(m_shapes.size());
+    std::vector<uint32_t> shapeTypes(m_shapes.size());
+    for (size_t i = 0; i < m_shapes.size(); ++i) {
+        meshes[i] = dynamic_cast<const Mesh *>(m_shapes[i]);
+        spheres[i] = dynamic_cast<const Sphere *>(m_shapes[i]);
+        shapeTypes[i] = meshes[i] ? PrimitiveBlock::ETriangles :
+            (spheres[i] ? PrimitiveBlock::ESpheres : PrimitiveBlock::EGeneric);
+    }
+
+    /* Shape of every index reference (relative to start) */
+    std::vector<uint32_t> refShapes(end - start);
+    forEach(
+        Range(0u, refShapes.size(), BVHBuildTask::GRAIN_SIZE),
+        [&](const Range &range) {
+            for (size_t i = range.begin(); i != range.end(); ++i) {
+                uint32_t idx = m_indices[start + i];
+                refShapes[i] = findShape(idx);
+            }
+        }
+    );
+
+    /* Every leaf starts a new block, and so does every type of primitive
+       within a leaf. Count the blocks of the leaf that starts at each
+       reference, and turn this into the index of the first block with a
+       prefix sum (references are covered by exactly one nonempty leaf). */
+    std::vector<std::pair<uint32_t, uint32_t>> leaves;
+    leafBlocks.assign(end - start + 1, 0u);
+    for (const BVHNode &node : nodes) {
+        if (!node.isLeaf() || node.leaf.size == 0)
+            continue;
+        uint32_t typeCounts[PrimitiveBlock::ETypeCount] = { };
+        for (uint32_t i = node.start(); i < node.end(); ++i)
+            typeCounts[shapeTypes[refShapes[i - start]]]++;
+        uint32_t blocks = 0;
+        for (uint32_t count : typeCounts)
+            blocks += (count + Width - 1) / Width;
+        leaves.push_back(std::make_pair(node.start() - start, node.leaf.size));
+        leafBlocks[node.start() - start] = blocks;
+    }
+    uint32_t blockCount = 0;
+    for (uint32_t &count : leafBlocks) {
+        uint32_t blocks = count;
+        count = blockCount;
+        blockCount += blocks;
+    }
+
+    primitives.resize(blockCount);
+    forEach(
+        Range(0u, leaves.size(), BVHBuildTask::GRAIN_SIZE / Width),
+        [&](const Range &range) {
+            const float nan = std::numeric_limits<float>::quiet_NaN();
+            for (size_t l = range.begin(); l != range.end(); ++l) {
+                uint32_t leafStart = leaves[l].first, leafEnd = leafStart + leaves[l].second;
+                PrimitiveBlock *block = primitives.data() + leafBlocks[leafStart];
+
+                for (uint32_t type = 0; type < PrimitiveBlock::ETypeCount; ++type) {
+                    PrimitiveBlock *b = nullptr;
+                    for (uint32_t i = leafStart; i < leafEnd; ++i) {
+                        uint32_t shapeIdx = refShapes[i];
+                        if (shapeTypes[shapeIdx] != type)
+                            continue;
+
+                        if (!b || b->count == Width) {
+                            b = block++;
+                            std::fill(&b->triangles.p0[0][0],
+                                      &b->triangles.p0[0][0] + 9 * Width, nan);
+                            std::fill(b->shapeIdx, b->shapeIdx + Width, 0u);
+                            std::fill(b->primIdx, b->primIdx + Width, 0u);
+                            b->type = type;
+                            b->count = 0;
+                        }
+
+                        uint32_t idx = m_indices[start + i] - m_shapeOffset[shapeIdx], lane = b->count++;
+                        b->shapeIdx[lane] = shapeIdx;
+                        b->primIdx[lane] = idx;
+                        if (type == PrimitiveBlock::ETriangles) {
+                            const Mesh *mesh = meshes[shapeIdx];
+                            const MatrixXuView &F = mesh->getIndices();
+                            Point3f p0 = mesh->getVertexPosition(F(0, idx)),
+                                    p1 = mesh->getVertexPosition(F(1, idx)),
+                                    p2 = mesh->getVertexPosition(F(2, idx));
+                            for (int k = 0; k < 3; ++k) {
+                                b->triangles.p0[k][lane] = p0[k];
+                                b->triangles.p1[k][lane] = p1[k];
+                                b->triangles.p2[k][lane] = p2[k];
+                            }
+                        } else if (type == PrimitiveBlock::ESpheres) {
+                            const Sphere *sphere = spheres[shapeIdx];
+                            for (int k = 0; k < 3; ++k)
+                                b->spheres.center[k][lane] = sphere->getCenter()[k];
+                            b->spheres.radius[lane] = sphere->getRadius();
+                        }
+                    }
+                }
+            }
+        }
+    );
+}
+
+void BVH::createLazySubtrees() {
+    /* The leaves of the top levels cover consecutive ranges of references
+       in depth-first order, hence a subtree ends where the next leaf starts */
+    m_lazySubtrees.clear();
+    LazySubtree *previous = nullptr;
+    for (BVHNode &node : m_nodes) {
+        if (!node.isLeaf())
+            continue;
+        if (previous)
+            previous->end = node.start();
+        previous = nullptr;
+        if (node.leaf.size == 0) {
+            m_lazySubtrees.emplace_back(new LazySubtree());
+            previous = m_lazySubtrees.back().get();
+            previous->start = node.start();
+            node.leaf.start = (uint32_t) m_lazySubtrees.size() - 1;
+        }
+    }
+    if (previous)
+        previous->end = (uint32_t) m_indices.size();
+
+    m_pendingSubtrees = (uint32_t) m_lazySubtrees.size();
+    if (m_lazySubtrees.empty()) {
+        m_buildBounds.clear();
+        m_buildBounds.shrink_to_fit();
+        m_buildCentroids.clear();
+        m_buildCentroids.shrink_to_fit();
+    }
+}
+
+BVH::BinaryTree BVH::getLazySubtree(uint32_t index) const {
+    LazySubtree &subtree = *m_lazySubtrees[index];
+    if (subtree.state.load(std::memory_order_acquire) != LazySubtree::EReady)
+        buildLazySubtree(subtree);
+    return BinaryTree { subtree.nodes.data(), false, subtree.primitives.data(),
+                        subtree.leafBlocks.data(), subtree.start };
+}
+
+void BVH::buildLazySubtree(LazySubtree &subtree) const {
+    uint32_t expected = LazySubtree::EPending;
+    if (!subtree.state.compare_exchange_strong(expected, LazySubtree::EBuilding,
+                                               std::memory_order_acquire)) {
+        while (subtree.state.load(std::memory_order_acquire) != LazySubtree::EReady)
+            std::this_thread::yield();
+        return;
+    }
+
+    /* Building a subtree does not change the result of any query. It only
+       writes to the references reserved for the subtree, which are not
+       read by anyone else before it is published. */
+    BVH &bvh = const_cast<BVH &>(*this);
+    uint32_t *start = bvh.m_indices.data() + subtree.start,
+             *end = bvh.m_indices.data() + subtree.end;
+
+    BoundingBox3f bbox, centroidBounds;
+    for (uint32_t *it = start; it != end; ++it) {
+        bbox.expandBy(m_buildBounds[*it]);
+        centroidBounds.expandBy(m_buildCentroids[*it]);
+    }
+
+    BVHBuildTask::NodePool pool;
+    BVHNode &root = *pool.grow_by(1);
+    root.data = 0;
+    root.bbox = bbox;
+    BVHBuildTask::execute_serially(bvh, pool, 0u, start, end, centroidBounds);
+
+    subtree.nodes.resize(pool.size());
+    storeDepthFirst(pool, subtree.nodes, [&](uint32_t node_idx) { return pool[node_idx].inner.rightChild - 1; });
+    buildPrimitiveBlocks(subtree.nodes, subtree.start, subtree.end, subtree.primitives,
+                         subtree.leafBlocks, false);
+    subtree.state.store(LazySubtree::EReady, std::memory_order_release);
+
+    /* The last subtree releases the data that was kept for building them */
+    if (--bvh.m_pendingSubtrees == 0) {
+        bvh.m_buildBounds.clear();
+        bvh.m_buildBounds.shrink_to_fit();
+        bvh.m_buildCentroids.clear();
+        bvh.m_buildCentroids.shrink_to_fit();
+    }
+}
+
+template <> const BVH::NodeVector<BVH::WideNode<4>> &BVH::getWideNodes() const { return m_nodes4; }
+template <> const BVH::NodeVector<BVH::WideNode<8>> &BVH::getWideNodes() const { return m_nodes8; }
+template <> const BVH::NodeVector<BVH::QuantizedWideNode<4, uint8_t>> &BVH::getWideNodes() const { return m_nodes4q8; }
+template <> const BVH::NodeVector<BVH::QuantizedWideNode<8, uint8_t>> &BVH::getWideNodes() const { return m_nodes8q8; }
+template <> const BVH::NodeVector<BVH::QuantizedWideNode<4, uint16_t>> &BVH::getWideNodes() const { return m_nodes4q16; }
+template <> const BVH::NodeVector<BVH::QuantizedWideNode<8, uint16_t>> &BVH::getWideNodes() const { return m_nodes8q16; }
+
+/// Return the power of two 2^exponent (for exponents between -126 and 127)
+static inline float powerOfTwo(int exponent) {
+    uint32_t bits = (uint32_t) (exponent + 127) << 23;
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
+template <int Width, typename T> const typename BVH::QuantizedWideNode<Width, T>::Bounds &
+        BVH::QuantizedWideNode<Width, T>::getBounds(Bounds &buffer) const {
+    /* Widen all values before writing to the buffer: 8-bit values could
+       otherwise alias it, which prevents the compiler from vectorizing */
+    int32_t values[6][Width];
+    for (int i = 0; i < 3; ++i) {
+        for (int c = 0; c < Width; ++c) {
+            values[i][c] = lower[i][c];
+            values[i + 3][c] = upper[i][c];
+        }
+    }
+
+    for (int i = 0; i < 3; ++i) {
+        float scale = powerOfTwo(exponent[i]), offset = origin[i];
+        for (int c = 0; c < Width; ++c) {
+            buffer[i][c] = offset + scale * (float) values[i][c];
+            buffer[i + 3][c] = offset + scale * (float) values[i + 3][c];
+        }
+    }
+    return buffer;
+}
+
+template <int Width, typename T> void BVH::quantize(const NodeVector<WideNode<Width>> &nodes,
+        NodeVector<QuantizedWideNode<Width, T>> &result) {
+    const int maxValue = std::numeric_limits<T>::max();
+    result.resize(nodes.size());
+
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, nodes.size()),
+        [&](const tbb::blocked_range<size_t> &range) {
+            for (size_t n = range.begin(); n != range.end(); ++n) {
+                const WideNode<Width> &node = nodes[n];
+                QuantizedWideNode<Width, T> &qnode = result[n];
+                memcpy(qnode.child, node.child, sizeof(node.child));
+                memcpy(qnode.size, node.size, sizeof(node.size));
+
+                for (int i = 0; i < 3; ++i) {
+                    float min = std::numeric_limits<float>::infinity(), max = -min;
+                    for (int c = 0; c < Width; ++c) {
+                        if (node.bounds[i][c] <= node.bounds[i + 3][c]) {
+                            min = std::min(min, node.bounds[i][c]);
+                            max = std::max(max, node.bounds[i + 3][c]);
+                        }
+                    }
+                    if (!(min <= max))
+                        min = max = 0.f;
+
+                    /* Smallest power-of-two step that covers the extent with
+                       one step to spare for rounding. frexp() returns an
+                       exponent with 2^exponent > the argument. */
+                    int exponent;
+                    std::frexp((max - min) / (maxValue - 1), &exponent);
+                    exponent = std::max(-126, std::min(127, exponent));
+                    float scale = powerOfTwo(exponent);
+                    qnode.origin[i] = min;
+                    qnode.exponent[i] = (int8_t) exponent;
+
+                    for (int c = 0; c < Width; ++c) {
+                        float cmin = node.bounds[i][c], cmax = node.bounds[i + 3][c];
+                        if (!(cmin <= cmax)) {
+                            qnode.lower[i][c] = (T) maxValue;
+                            qnode.upper[i][c] = 0;
+                            continue;
+                        }
+
+                        /* Round outwards, and verify this using the same
+                           arithmetic as the decoder in getBounds() */
+                        int lower = std::max(0, std::min(maxValue, (int) std::floor((cmin - min) / scale)));
+                        int upper = std::max(0, std::min(maxValue, (int) std::ceil((cmax - min) / scale)));
+                        while (lower > 0 && min + scale * (float) lower > cmin)
+                            --lower;
+                        while (upper < maxValue && min + scale * (float) upper < cmax)
+                            ++upper;
+                        qnode.lower[i][c] = (T) lower;
+                        qnode.upper[i][c] = (T) upper;
+                    }
+                }
+            }
+        }
+    );
+}
+
+template <int Width> uint32_t BVH::collapse(uint32_t node_idx, NodeVector<WideNode<Width>> &nodes) const {
+    uint32_t children[Width];
+    int count = 0;
+
+    if (m_nodes[node_idx].isLeaf()) {
+        /* Only happens when the entire tree is a single leaf */
+        children[count++] = node_idx;
+    } else {
+        children[count++] = node_idx + 1;
+        children[count++] = m_nodes[node_idx].inner.rightChild;
+
+        /* Greedily open the inner child with the largest surface area
+           until all slots of the wide node are used up */
+        while (count < Width) {
+            int best = -1;
+            float bestArea = -1;
+            for (int i = 0; i < count; ++i) {
+                const BVHNode &child = m_nodes[children[i]];
+                float area = child.bbox.getSurfaceArea();
+                if (child.isInner() && area > bestArea) {
+                    best = i;
+                    bestArea = area;
+                }
+            }
+            if (best == -1)
+                break;
+            uint32_t idx = children[best];
+            children[best] = idx + 1;
+            children[count++] = m_nodes[idx].inner.rightChild;
+        }
+    }
+
+    uint32_t result = (uint32_t) nodes.size();
+    nodes.emplace_back();
+
+    for (int i = 0; i < Width; ++i) {
+        WideNode<Width> &node = nodes[result];
+        const BVHNode *child = i < count ? &m_nodes[children[i]] : nullptr;
+
+        /* Unused slots (and empty leaves) receive an invalid bounding box */
+        BoundingBox3f bbox;
+        if (child && !(child->isLeaf() && child->leaf.size == 0))
+            bbox = child->bbox;
+        for (int j = 0; j < 3; ++j) {
+            node.bounds[j][i] = bbox.min[j];
+            node.bounds[j + 3][i] = bbox.max[j];
+        }
+        node.child[i] = 0;
+        node.size[i] = 0;
+
+        if (!child || !bbox.isValid())
+            continue;
+
+        if (child->isLeaf()) {
+            node.child[i] = child->start();
+            node.size[i] = child->leaf.size;
+        } else {
+            /* Note: recursion may reallocate 'nodes' */
+            uint32_t idx = collapse<Width>(children[i], nodes);
+            nodes[result].child[i] = idx;
+        }
+    }
+
+    return result;
+}
+
+std::pair<float, uint32_t> BVH::statistics(uint32_t node_idx) const {
+    const BVHNode &node = m_nodes[node_idx];
+    if (node.isLeaf()) {
+        uint32_t size = node.leaf.size;
+        if (size == 0 && !m_lazySubtrees.empty()) {
+            /* Count the placeholder of a lazy subtree as a leaf with all of its primitives */
+            const LazySubtree &subtree = *m_lazySubtrees[node.start()];
+            size = subtree.end - subtree.start;
+        }
+        return std::make_pair((float) BVHBuildTask::INTERSECTION_COST * size, 1u);
+    } else {
+        std::pair<float, uint32_t> stats_left = statistics(node_idx + 1u);
+        std::pair<float, uint32_t> stats_right = statistics(node.inner.rightChild);
+        float saLeft = m_nodes[node_idx + 1u].bbox.getSurfaceArea();
+        float saRight = m_nodes[node.inner.rightChild].bbox.getSurfaceArea();
+        float saCur = node.bbox.getSurfaceArea();
+        float sahCost =
+            2 * BVHBuildTask::TRAVERSAL_COST +
+            (saLeft * stats_left.first + saRight * stats_right.first) / saCur;
+        return std::make_pair(
+            sahCost,
+            stats_left.second + stats_right.second + 1u
+        );
+    }
+}
+
+/// Surface area of the part of a triangle that lies inside a bounding box
+static float clippedTriangleArea(const Point3f &p0, const Point3f &p1,
+                                 const Point3f &p2, const BoundingBox3f &bbox) {
+    /* Sutherland-Hodgman clipping against the 6 slabs adds at most one
+       vertex per plane */
+    Point3f poly[9], clipped[9];
+    poly[0] = p0;
+    poly[1] = p1;
+    poly[2] = p2;
+    int count = 3;
+
+    for (int axis = 0; axis < 3 && count >= 3; ++axis) {
+        for (int side = 0; side < 2 && count >= 3; ++side) {
+            float plane = side == 0 ? bbox.min[axis] : bbox.max[axis];
+            float sign = side == 0 ? 1.0f : -1.0f;
+            int clippedCount = 0;
+            for (int i = 0; i < count; ++i) {
+                const Point3f &a = poly[i], &b = poly[(i + 1) % count];
+                float da = sign * (a[axis] - plane), db = sign * (b[axis] - plane);
+                if (da >= 0)
+                    clipped[clippedCount++] = a;
+                if ((da < 0 && db > 0) || (da > 0 && db < 0)) {
+                    Point3f p = a + (b - a) * (da / (da - db));
+                    p[axis] = plane;
+                    clipped[clippedCount++] = p;
+                }
+            }
+            count = clippedCount;
+            std::copy(clipped, clipped + count, poly);
+        }
+    }
+
+    Vector3f normal = Vector3f::Zero();
+    for (int i = 1; i + 1 < count; ++i)
+        normal += (poly[i] - poly[0]).cross(poly[i + 1] - poly[0]);
+    return 0.5f * normal.norm();
+}
+
+/// Count the wide nodes on every level and sum up the surface areas of their children
+template <typename Vector> static void wideNodeStatistics(const Vector &nodes,
+        std::vector<uint32_t> &levelNodes, std::vector<size_t> &levelMemory, double &childArea) {
+    typedef typename Vector::value_type Node;
+    typename Node::Bounds buffer;
+    std::vector<uint32_t> level(1, 0u), next;
+    childArea = 0;
+
+    while (!level.empty()) {
+        levelNodes.push_back((uint32_t) level.size());
+        levelMemory.push_back(sizeof(Node) * level.size());
+        next.clear();
+        for (uint32_t idx : level) {
+            const Node &node = nodes[idx];
+            const typename Node::Bounds &bounds = node.getBounds(buffer);
+            for (int i = 0; i < Node::ChildCount; ++i) {
+                if (node.child[i] == 0 && node.size[i] == 0)
+                    continue;
+                BoundingBox3f bbox(
+                    Point3f(bounds[0][i], bounds[1][i], bounds[2][i]),
+                    Point3f(bounds[3][i], bounds[4][i], bounds[5][i]));
+                childArea += bbox.getSurfaceArea();
+                if (node.size[i] == 0)
+                    next.push_back(node.child[i]);
+            }
+        }
+        level.swap(next);
+    }
+}
+
+BVH::TreeStatistics BVH::computeStatistics(bool epo) const {
+    TreeStatistics result;
+    if (m_nodes.empty())
+        return result;
+
+    const float rootArea = m_nodes[0].bbox.getSurfaceArea();
+    result.sahCost = statistics().first;
+
+    /* Depth-first pass over the binary tree */
+    std::vector<std::pair<uint32_t, uint32_t>> stack(1, std::make_pair(0u, 0u));
+    double innerArea = 0, primitiveArea = 0, overlapArea = 0, overlapSum = 0;
+    while (!stack.empty()) {
+        uint32_t node_idx = stack.back().first, depth = stack.back().second;
+        stack.pop_back();
+        const BVHNode &node = m_nodes[node_idx];
+        float area = node.bbox.getSurfaceArea();
+
+        if (node.isLeaf()) {
+            result.leaves++;
+            result.references += node.leaf.size;
+            if (result.leafDepths.size() <= depth)
+                result.leafDepths.resize(depth + 1, 0u);
+            if (result.leafSizes.size() <= node.leaf.size)
+                result.leafSizes.resize(node.leaf.size + 1, 0u);
+            result.leafDepths[depth]++;
+            result.leafSizes[node.leaf.size]++;
+            primitiveArea += (double) area * node.leaf.size;
+        } else {
+            result.innerNodes++;
+            innerArea += area;
+
+            BoundingBox3f intersection = m_nodes[node_idx + 1].bbox;
+            intersection.clip(m_nodes[node.inner.rightChild].bbox);
+            if (intersection.isValid() && area > 0) {
+                overlapArea += intersection.getSurfaceArea();
+                overlapSum += intersection.getSurfaceArea() / area;
+            }
+            stack.push_back(std::make_pair(node.inner.rightChild, depth + 1));
+            stack.push_back(std::make_pair(node_idx + 1, depth + 1));
+        }
+
+        if (result.levelNodes.size() <= depth)
+            result.levelNodes.resize(depth + 1, 0u);
+        result.levelNodes[depth]++;
+    }
+
+    result.expectedPrimitives = (float) (primitiveArea / rootArea);
+    result.overlap = result.innerNodes > 0 ? (float) (overlapSum / result.innerNodes) : 0.f;
+    result.overlapVisits = (float) (overlapArea / rootArea);
+    result.primitiveMemory = sizeof(PrimitiveBlock) * m_primitives.size() +
+        sizeof(uint32_t) * m_leafBlocks.size();
+
+    if (m_width == 2) {
+        /* Every node is visited when the ray intersects its parent */
+        result.expectedNodes = 1.f + (float) (2 * innerArea / rootArea);
+        for (uint32_t count : result.levelNodes)
+            result.levelMemory.push_back(sizeof(BVHNode) * count);
+    } else {
+        /* Traversal uses the wide nodes, which are visited (like leaves)
+           when the ray intersects their box stored in the parent */
+        result.levelNodes.clear();
+        double childArea = 0;
+        if (m_width == 4) {
+            if (m_quantization == 8)
+                wideNodeStatistics(m_nodes4q8, result.levelNodes, result.levelMemory, childArea);
+            else if (m_quantization == 16)
+                wideNodeStatistics(m_nodes4q16, result.levelNodes, result.levelMemory, childArea);
+            else
+                wideNodeStatistics(m_nodes4, result.levelNodes, result.levelMemory, childArea);
+        } else {
+            if (m_quantization == 8)
+                wideNodeStatistics(m_nodes8q8, result.levelNodes, result.levelMemory, childArea);
+            else if (m_quantization == 16)
+                wideNodeStatistics(m_nodes8q16, result.levelNodes, result.levelMemory, childArea);
+            else
+                wideNodeStatistics(m_nodes8, result.levelNodes, result.levelMemory, childArea);
+        }
+        result.expectedNodes = 1.f + (float) (childArea / rootArea);
+    }
+
+    if (!epo)
+        return result;
+
+    /* Effective parent overlap: for every node, find the leaves outside of
+       its subtree that overlap its box, and clip their primitives against
+       the intersection of both boxes. Spatial splits may reference a
+       primitive from several leaves, but each reference only contributes
+       the part within the box of its leaf. */
+    typedef std::pair<double, double> AreaPair;
+    AreaPair sums = tbb::parallel_reduce(
+        tbb::blocked_range<uint32_t>(0u, (uint32_t) m_nodes.size(), 64),
+        AreaPair(0.0, 0.0),
+        [&](const tbb::blocked_range<uint32_t> &range, AreaPair sums) {
+            std::vector<uint32_t> stack;
+            for (uint32_t node_idx = range.begin(); node_idx != range.end(); ++node_idx) {
+                const BVHNode &target = m_nodes[node_idx];
+                float cost = target.isLeaf() ? (float) BVHBuildTask::INTERSECTION_COST
+                                             : (float) BVHBuildTask::TRAVERSAL_COST;
+                sums.second += cost * target.bbox.getSurfaceArea();
+
+                double area = 0;
+                stack.assign(1, 0u);
+                while (node_idx != 0 && !stack.empty()) {
+                    uint32_t idx = stack.back();
+                    stack.pop_back();
+                    const BVHNode &node = m_nodes[idx];
+                    BoundingBox3f bbox = node.bbox;
+                    bbox.clip(target.bbox);
+                    if (idx == node_idx || !bbox.isValid())
+                        continue;
+
+                    if (node.isInner()) {
+                        stack.push_back(node.inner.rightChild);
+                        stack.push_back(idx + 1);
+                        continue;
+                    }
+
+                    for (uint32_t b = m_leafBlocks[node.start()]; b < m_leafBlocks[node.end()]; ++b) {
+                        const PrimitiveBlock &block = m_primitives[b];
+                        for (uint32_t lane = 0; lane < block.count; ++lane) {
+                            if (block.type == PrimitiveBlock::ETriangles) {
+                                const auto &tri = block.triangles;
+                                area += clippedTriangleArea(
+                                    Point3f(tri.p0[0][lane], tri.p0[1][lane], tri.p0[2][lane]),
+                                    Point3f(tri.p1[0][lane], tri.p1[1][lane], tri.p1[2][lane]),
+                                    Point3f(tri.p2[0][lane], tri.p2[1][lane], tri.p2[2][lane]), bbox);
+                                continue;
+                            }
+
+                            /* Approximate other shapes by half the surface
+                               area of their clipped bounding box */
+                            BoundingBox3f primBBox = m_shapes[block.shapeIdx[lane]]
+                                ->getBoundingBox(block.primIdx[lane]);
+                            primBBox.clip(bbox);
+                            if (primBBox.isValid())
+                                area += 0.5f * primBBox.getSurfaceArea();
+                        }
+                    }
+                }
+                sums.first += cost * area;
+            }
+            return sums;
+        },
+        [](const AreaPair &a, const AreaPair &b) {
+            return AreaPair(a.first + b.first, a.second + b.second);
+        }
+    );
+    result.epo = sums.second > 0 ? (float) (sums.first / sums.second) : 0.f;
+
+    return result;
+}
+
+BVH::ShearedRay::ShearedRay(const Ray3f &ray) {
+    /* Permute the axes so that the ray direction is largest along z (and
+       the winding of the triangles is preserved), and shear the triangles
+       so that the ray points along the z axis */
+    ray.d.cwiseAbs().maxCoeff(&kz);
+    kx = (kz + 1) % 3;
+    ky = (kx + 1) % 3;
+    if (ray.d[kz] < 0)
+        std::swap(kx, ky);
+    sz = 1.0f / ray.d[kz];
+    sx = ray.d[kx] * sz;
+    sy = ray.d[ky] * sz;
+}
+
+/// Return the lane of the closest hit within \c t (or of any hit, for \c AnyHit queries)
+template <BVH::Query Q, int N> static inline int selectHit(const Eigen::Array<bool, N, 1> &hit,
+                                                          const Eigen::Array<float, N, 1> &t) {
+    if (!hit.any())
+        return -1;
+    int lane;
+    if (Q == BVH::Query::AnyHit)
+        hit.template cast<int>().maxCoeff(&lane);
+    else
+        hit.select(t, Eigen::Array<float, N, 1>::Constant(
+            std::numeric_limits<float>::infinity())).minCoeff(&lane);
+    return lane;
+}
+
+template <BVH::Query Q> int BVH::intersectTriangles(const PrimitiveBlock &block,
+        const ShearedRay &sheared, const Ray3f &ray, float &t, Point2f &uv) {
+    typedef Eigen::Array<float, PrimitiveBlock::Width, 1> FloatP;
+    typedef Eigen::Array<bool, PrimitiveBlock::Width, 1> MaskP;
+    typedef Eigen::Map<const FloatP> FloatPMap;
+    typedef Eigen::Array<double, PrimitiveBlock::Width, 1> DoubleP;
+
+    const int kx = sheared.kx, ky = sheared.ky, kz = sheared.kz;
+    const auto &tri = block.triangles;
+
+    /* Vertices relative to the ray origin in the sheared space */
+    FloatP az = FloatPMap(tri.p0[kz]) - ray.o[kz],
+           bz = FloatPMap(tri.p1[kz]) - ray.o[kz],
+           cz = FloatPMap(tri.p2[kz]) - ray.o[kz];
+    FloatP ax = FloatPMap(tri.p0[kx]) - ray.o[kx] - sheared.sx * az,
+           ay = FloatPMap(tri.p0[ky]) - ray.o[ky] - sheared.sy * az,
+           bx = FloatPMap(tri.p1[kx]) - ray.o[kx] - sheared.sx * bz,
+           by = FloatPMap(tri.p1[ky]) - ray.o[ky] - sheared.sy * bz,
+           cx = FloatPMap(tri.p2[kx]) - ray.o[kx] - sheared.sx * cz,
+           cy = FloatPMap(tri.p2[ky]) - ray.o[ky] - sheared.sy * cz;
+
+    /* Scaled barycentric coordinates, i.e. the 2D edge functions */
+    FloatP u = cx * by - cy * bx,
+           v = ax * cy - ay * cx,
+           w = bx * ay - by * ax;
+
+    /* Recompute them in double precision when the ray passes through an
+       edge, so that its sign is consistent for both adjacent triangles */
+    if (((u == 0.f) || (v == 0.f) || (w == 0.f)).any()) {
+        DoubleP axd = ax.cast<double>(), ayd = ay.cast<double>(),
+                bxd = bx.cast<double>(), byd = by.cast<double>(),
+                cxd = cx.cast<double>(), cyd = cy.cast<double>();
+        u = (cxd * byd - cyd * bxd).cast<float>();
+        v = (axd * cyd - ayd * cxd).cast<float>();
+        w = (bxd * ayd - byd * axd).cast<float>();
+    }
+
+    FloatP det = u + v + w;
+    FloatP tHit = (u * az + v * bz + w * cz) * sheared.sz / det;
+    MaskP hit = (((u >= 0.f) && (v >= 0.f) && (w >= 0.f)) ||
+                 ((u <= 0.f) && (v <= 0.f) && (w <= 0.f))) &&
+                (det != 0.f) && (tHit >= ray.mint) && (tHit <= ray.maxt);
+
+    int lane = selectHit<Q>(hit, tHit);
+    if (lane >= 0) {
+        float invDet = 1.0f / det[lane];
+        t = tHit[lane];
+        uv = Point2f(v[lane] * invDet, w[lane] * invDet);
+    }
+    return lane;
+}
+
+template <BVH::Query Q> int BVH::intersectSpheres(const PrimitiveBlock &block,
+        const Ray3f &ray, float &t, Point2f &uv) {
+    typedef Eigen::Array<float, PrimitiveBlock::Width, 1> FloatP;
+    typedef Eigen::Array<bool, PrimitiveBlock::Width, 1> MaskP;
+    typedef Eigen::Map<const FloatP> FloatPMap;
+
+    /* Same quadratic as Sphere::rayIntersect(), for all lanes at once (the
+       sums are ordered like Eigen's dot products to get identical results) */
+    const auto &sph = block.spheres;
+    FloatP ox = ray.o.x() - FloatPMap(sph.center[0]),
+           oy = ray.o.y() - FloatPMap(sph.center[1]),
+           oz = ray.o.z() - FloatPMap(sph.center[2]),
+           radius = FloatPMap(sph.radius);
+
+    float a = ray.d.squaredNorm();
+    FloatP b = 2 * (ox * ray.d.x() + (oy * ray.d.y() + oz * ray.d.z()));
+    FloatP c = (ox * ox + (oy * oy + oz * oz)) - radius * radius;
+    FloatP delta = b * b - 4 * a * c;
+    FloatP root = delta.max(0.f).sqrt();
+    FloatP tNear = (-b - root) / (2 * a),
+           tFar = (-b + root) / (2 * a);
+
+    MaskP nearHit = (tNear >= ray.mint) && (tNear <= ray.maxt);
+    FloatP tHit = nearHit.select(tNear, tFar);
+    MaskP hit = (delta >= 0.f) && (tHit >= ray.mint) && (tHit <= ray.maxt);
+
+    int lane = selectHit<Q>(hit, tHit);
+    if (lane >= 0) {
+        t = tHit[lane];
+        uv = Point2f(0.f);
+    }
+    return lane;
+}
+
+template <BVH::Query Q> int BVH::intersectGeneric(const PrimitiveBlock &block,
+        const Ray3f &ray_, float &t, Point2f &uv, uint32_t &nestedPrim) const {
+    Ray3f ray(ray_);
+    int lane = -1;
+    for (uint32_t i = 0; i < block.count; ++i) {
+        const Shape *shape = m_shapes[block.shapeIdx[i]];
+        if (Q == Query::AnyHit) {
+            if (!shape->rayOccluded(block.primIdx[i], ray))
+                continue;
+            lane = (int) i;
+            break;
+        }
+
+        float u, v;
+        uint32_t prim;
+        if (!shape->rayIntersectNested(block.primIdx[i], ray, u, v, t, prim))
+            continue;
+        lane = (int) i;
+        ray.maxt = t;
+        uv = Point2f(u, v);
+        nestedPrim = prim;
+    }
+    if (lane >= 0)
+        t = ray.maxt;
+    return lane;
+}
+
+template <BVH::Query Q> bool BVH::intersectBlocks(const PrimitiveBlock *begin,
+        const PrimitiveBlock *end, Ray3f &ray, Intersection *its, uint32_t &f) const {
+    ShearedRay sheared(ray);
+    bool foundIntersection = false;
+
+    for (const PrimitiveBlock *it = begin; it != end; ++it) {
+        const PrimitiveBlock &block = *it;
+        float t;
+        Point2f uv;
+        uint32_t nestedPrim = 0;
+        int lane;
+
+        switch (block.type) {
+            case PrimitiveBlock::ETriangles:
+                lane = intersectTriangles<Q>(block, sheared, ray, t, uv);
+                break;
+            case PrimitiveBlock::ESpheres:
+                lane = intersectSpheres<Q>(block, ray, t, uv);
+                break;
+            default:
+                lane = intersectGeneric<Q>(block, ray, t, uv, nestedPrim);
+                break;
+        }
+
+        if (lane < 0)
+            continue;
+        if (Q == Query::AnyHit)
+            return true;
+
+        ray.maxt = its->t = t;
+        its->uv = uv;
+        its->mesh = m_shapes[block.shapeIdx[lane]];
+        its->nestedPrim = nestedPrim;
+        f = block.primIdx[lane];
+        foundIntersection = true;
+    }
+
+    return foundIntersection;
+}
+
+template <BVH::Query Q> bool BVH::intersectLeaf(uint32_t start, uint32_t end, Ray3f &ray,
+                                                 Intersection *its, uint32_t &f) const {
+    const PrimitiveBlock *primitives = m_primitives.data();
+    return intersectBlocks<Q>(primitives + m_leafBlocks[start], primitives + m_leafBlocks[end],
+                              ray, its, f);
+}
+
+template <BVH::Query Q, bool Ordered, typename Node, typename Stats> bool BVH::rayIntersectWide(Ray3f &ray,
+        Intersection *its, uint32_t &f, Stats &stats) const {
+    enum { Width = Node::ChildCount };
+    typedef Eigen::Array<float, Width, 1> FloatW;
+    typedef Eigen::Map<const FloatW> FloatWMap;
+
+    struct StackEntry {
+        uint32_t child, size;
+        float t;
+    };
+
+    const NodeVector<Node> &nodes = getWideNodes<Node>();
+    typename Node::Bounds buffer;
+    StackEntry stack[MAX_DEPTH * Width];
+    uint32_t stack_idx = 0;
+
+    /* Select the near and far slab of each axis based on the ray direction */
+    int nearIdx[3], farIdx[3];
+    for (int i = 0; i < 3; ++i) {
+        bool negative = ray.dRcp[i] < 0;
+        nearIdx[i] = negative ? i + 3 : i;
+        farIdx[i]  = negative ? i : i + 3;
+    }
+
+    bool foundIntersection = false;
+    StackEntry entry = { 0u, 0u, ray.mint };
+
+    while (true) {
+        stats.node();
+        if (entry.size == 0) {
+            const Node &node = nodes[entry.child];
+            const typename Node::Bounds &bounds = node.getBounds(buffer);
+
+            /* Slab test against all children at once. The operand order
+               of max()/min() ensures that NaNs (0 * inf) are ignored */
+            FloatW tNear = FloatW::Constant(ray.mint),
+                   tFar  = FloatW::Constant(ray.maxt);
+            for (int i = 0; i < 3; ++i) {
+                FloatW t0 = (FloatWMap(bounds[nearIdx[i]]) - ray.o[i]) * ray.dRcp[i];
+                FloatW t1 = (FloatWMap(bounds[farIdx[i]]) - ray.o[i]) * ray.dRcp[i];
+                tNear = t0.max(tNear);
+                tFar = t1.min(tFar);
+            }
+
+            /* Push the intersected children so that the closest one ends up
+               on top. Any-hit queries can stop at any hit, and don't sort.
+               Unordered traversal pushes them in reverse storage order. */
+            uint32_t first = stack_idx;
+            for (int j = 0; j < Width; ++j) {
+                int i = Ordered ? j : Width - 1 - j;
+
+                /* Also skip unused slots, whose quantized boxes may touch the ray */
+                if (!(tNear[i] <= tFar[i]) || (node.child[i] == 0 && node.size[i] == 0))
+                    continue;
+                StackEntry e = { node.child[i], node.size[i], tNear[i] };
+                uint32_t k = stack_idx++;
+                while (Q == Query::ClosestHit && Ordered && k > first && stack[k - 1].t < e.t) {
+                    stack[k] = stack[k - 1];
+                    --k;
+                }
+                stack[k] = e;
+            }
+            assert(stack_idx < 64 * Width);
+        } else {
+            stats.leaf(entry.size);
+            if (intersectLeaf<Q>(entry.child, entry.child + entry.size, ray, its, f)) {
+                if (Q == Query::AnyHit)
+                    return true;
+                foundIntersection = true;
+            }
+        }
+
+        /* Fetch the next entry, skipping those beyond the closest hit */
+        do {
+            if (stack_idx == 0)
+                return foundIntersection;
+            entry = stack[--stack_idx];
+        } while (entry.t > ray.maxt);
+    }
+}
+
+template <BVH::Query Q, bool Ordered, typename Stats> bool BVH::rayIntersectWide(Ray3f &ray,
+        Intersection *its, uint32_t &f, Stats &stats) const {
+    if (m_width == 4) {
+        if (m_quantization == 8)
+            return rayIntersectWide<Q, Ordered, QuantizedWideNode<4, uint8_t>>(ray, its, f, stats);
+        else if (m_quantization == 16)
+            return rayIntersectWide<Q, Ordered, QuantizedWideNode<4, uint16_t>>(ray, its, f, stats);
+        return rayIntersectWide<Q, Ordered, WideNode<4>>(ray, its, f, stats);
+    } else {
+        if (m_quantization == 8)
+            return rayIntersectWide<Q, Ordered, QuantizedWideNode<8, uint8_t>>(ray, its, f, stats);
+        else if (m_quantization == 16)
+            return rayIntersectWide<Q, Ordered, QuantizedWideNode<8, uint16_t>>(ray, its, f, stats);
+        return rayIntersectWide<Q, Ordered, WideNode<8>>(ray, its, f, stats);
+    }
+}
+
+/// Structure-of-arrays representation of a packet of up to 8 rays
+struct BVH::RayPacket8 {
+    typedef Eigen::Array<float, 8, 1> Float8;
+
+    Ray3f rays[8];           ///< Rays with adaptive epsilon and current \c maxt
+    Float8 o[3], dRcp[3];    ///< Ray origins and reciprocal directions
+    Float8 mint, maxt;       ///< Ray segments (empty for inactive lanes)
+    uint32_t f[8];           ///< Primitive index of the closest hit
+    uint32_t active = 0;     ///< Lanes that still need to be traversed
+    uint32_t hits = 0;       ///< Lanes that found an intersection
+    uint32_t negative[3] = { 0, 0, 0 }; ///< Lanes with a negative direction along each axis
+
+    /**
+     * \brief Slab test of all rays against a box
+     *
+     * Returns the mask of active lanes that intersect the box and
+     * stores the entry distances into \c tNear. The reciprocal ray
+     * directions are finite (see \ref rayIntersect8()), hence no NaNs
+     * can occur and the test maps to plain SIMD min/max operations.
+     */
+    uint32_t intersect(const float *min, const float *max, Float8 &tNear) const {
+        Float8 tFar = maxt;
+        tNear = mint;
+        for (int i = 0; i < 3; ++i) {
+            Float8 t0 = (min[i] - o[i]) * dRcp[i];
+            Float8 t1 = (max[i] - o[i]) * dRcp[i];
+            tNear = tNear.max(t0.min(t1));
+            tFar = tFar.min(t0.max(t1));
+        }
+
+        uint32_t mask = 0;
+        for (int i = 0; i < 8; ++i)
+            mask |= (tNear[i] <= tFar[i] ? 1u : 0u) << i;
+        return mask & active;
+    }
+};
+
+template <BVH::Query Q> void BVH::intersectLeafPacket(const PrimitiveBlock *begin,
+        const PrimitiveBlock *end, uint32_t mask, RayPacket8 &packet, Intersection *its) const {
+    for (uint32_t i = 0; mask != 0; ++i, mask >>= 1) {
+        if (!(mask & 1) || !intersectBlocks<Q>(begin, end, packet.rays[i],
+                Q == Query::ClosestHit ? its + i : nullptr, packet.f[i]))
+            continue;
+        packet.hits |= 1u << i;
+        packet.maxt[i] = packet.rays[i].maxt;
+        if (Q == Query::AnyHit) {
+            /* Occluded rays are done */
+            packet.active &= ~(1u << i);
+            packet.maxt[i] = -std::numeric_limits<float>::infinity();
+        }
+    }
+}
+
+template <BVH::Query Q> void BVH::rayIntersectPacket(const BinaryTree &tree, RayPacket8 &packet,
+        Intersection *its) const {
+    RayPacket8::Float8 tNear;
+    uint32_t node_idx = 0, stack_idx = 0, stack[MAX_DEPTH];
+
+    while (true) {
+        const BVHNode &node = tree.nodes[node_idx];
+        uint32_t mask = packet.intersect(node.bbox.min.data(), node.bbox.max.data(), tNear);
+
+        if (mask != 0 && node.isInner()) {
+            uint32_t left = tree.clustered ? node.inner.rightChild - 1 : node_idx + 1;
+
+            /* Visit the near child of the first active ray first */
+            if (packet.negative[node.inner.axis] & mask & (0u - mask)) {
+                stack[stack_idx++] = left;
+                node_idx = node.inner.rightChild;
+            } else {
+                stack[stack_idx++] = node.inner.rightChild;
+                node_idx = left;
+            }
+            assert(stack_idx<64);
+            continue;
+        }
+
+        if (mask != 0 && node.leaf.size == 0 && !m_lazySubtrees.empty())
+            rayIntersectPacket<Q>(getLazySubtree(node.start()), packet, its);
+        else if (mask != 0)
+            intersectLeafPacket<Q>(tree.getBlock(node.start()), tree.getBlock(node.end()),
+                                   mask, packet, its);
+
+        if (stack_idx == 0 || packet.active == 0)
+            break;
+        node_idx = stack[--stack_idx];
+    }
+}
+
+template <BVH::Query Q, typename Node> void BVH::rayIntersectPacketWide(RayPacket8 &packet,
+        Intersection *its) const {
+    enum { Width = Node::ChildCount };
+    typedef RayPacket8::Float8 Float8;
+
+    struct StackEntry {
+        Float8 tNear;
+        uint32_t child, size;
+        float t;
+    };
+
+    const NodeVector<Node> &nodes = getWideNodes<Node>();
+    typename Node::Bounds buffer;
+    StackEntry stack[MAX_DEPTH * Width];
+    uint32_t stack_idx = 0;
+
+    StackEntry entry;
+    entry.tNear = packet.mint;
+    entry.child = entry.size = 0;
+
+    while (true) {
+        /* Skip rays whose closest hit lies in front of this entry */
+        uint32_t mask = 0;
+        for (int i = 0; i < 8; ++i)
+            mask |= (entry.tNear[i] <= packet.maxt[i] ? 1u : 0u) << i;
+        mask &= packet.active;
+
+        if (mask != 0 && entry.size == 0) {
+            const Node &node = nodes[entry.child];
+            const typename Node::Bounds &bounds = node.getBounds(buffer);
+
+            /* Push the intersected children so that the closest one ends up on top */
+            uint32_t first = stack_idx;
+            for (int c = 0; c < Width; ++c) {
+                /* Skip unused slots and empty leaves (their box is invalid) */
+                if (node.child[c] == 0 && node.size[c] == 0)
+                    continue;
+                float min[3] = { bounds[0][c], bounds[1][c], bounds[2][c] },
+                      max[3] = { bounds[3][c], bounds[4][c], bounds[5][c] };
+                StackEntry e;
+                uint32_t childMask = packet.intersect(min, max, e.tNear) & mask;
+                if (childMask == 0)
+                    continue;
+                e.child = node.child[c];
+                e.size = node.size[c];
+                e.t = std::numeric_limits<float>::infinity();
+                for (int i = 0; i < 8; ++i) {
+                    if (childMask & (1u << i))
+                        e.t = std::min(e.t, e.tNear[i]);
+                    else
+                        e.tNear[i] = std::numeric_limits<float>::infinity();
+                }
+                uint32_t k = stack_idx++;
+                while (Q == Query::ClosestHit && k > first && stack[k - 1].t < e.t) {
+                    stack[k] = stack[k - 1];
+                    --k;
+                }
+                stack[k] = e;
+            }
+            assert(stack_idx < 64 * Width);
+        } else if (mask != 0) {
+            intersectLeafPacket<Q>(m_primitives.data() + m_leafBlocks[entry.child],
+                                   m_primitives.data() + m_leafBlocks[entry.child + entry.size],
+                                   mask, packet, its);
+        }
+
+        if (stack_idx == 0 || packet.active == 0)
+            return;
+        entry = stack[--stack_idx];
+    }
+}
+
+template <BVH::Query Q> uint32_t BVH::rayIntersect8(const Ray3f *rays, Intersection *its,
+                                                     uint32_t count) const {
+    if (count > 8)
+        throw NoriException("BVH::rayIntersect8(): packets can contain at most 8 rays!");
+
+    /* Unused lanes get an empty ray segment */
+    RayPacket8 packet;
+    for (uint32_t i = 0; i < 8; ++i) {
+        Ray3f &ray = packet.rays[i];
+        if (i < count) {
+            /* Ray3f has no copy assignment operator */
+            new (&ray) Ray3f(rays[i]);
+            if (Q == Query::ClosestHit)
+                its[i].t = std::numeric_limits<float>::infinity();
+
+            /* Use an adaptive ray epsilon */
+            if (ray.mint == Epsilon)
+                ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+            if (!(ray.maxt < ray.mint))
+                packet.active |= 1u << i;
+        } else {
+            ray.o = ray.dRcp = Vector3f(0.f);
+        }
+        for (int j = 0; j < 3; ++j) {
+            /* Clamp to a finite value so that the slab test never computes 0 * inf */
+            const float maxRcp = std::numeric_limits<float>::max();
+            packet.o[j][i] = ray.o[j];
+            packet.dRcp[j][i] = std::max(-maxRcp, std::min(maxRcp, ray.dRcp[j]));
+            if (ray.dRcp[j] < 0)
+                packet.negative[j] |= 1u << i;
+        }
+        packet.mint[i] = ray.mint;
+        packet.maxt[i] = (packet.active & (1u << i)) ? ray.maxt
+            : -std::numeric_limits<float>::infinity();
+    }
+
+    if (m_nodes.empty() || packet.active == 0)
+        return 0;
+
+    if (m_width == 4 && m_quantization == 8)
+        rayIntersectPacketWide<Q, QuantizedWideNode<4, uint8_t>>(packet, its);
+    else if (m_width == 4 && m_quantization == 16)
+        rayIntersectPacketWide<Q, QuantizedWideNode<4, uint16_t>>(packet, its);
+    else if (m_width == 4)
+        rayIntersectPacketWide<Q, WideNode<4>>(packet, its);
+    else if (m_width == 8 && m_quantization == 8)
+        rayIntersectPacketWide<Q, QuantizedWideNode<8, uint8_t>>(packet, its);
+    else if (m_width == 8 && m_quantization == 16)
+        rayIntersectPacketWide<Q, QuantizedWideNode<8, uint16_t>>(packet, its);
+    else if (m_width == 8)
+        rayIntersectPacketWide<Q, WideNode<8>>(packet, its);
+    else
+        rayIntersectPacket<Q>(getTopTree(), packet, its);
+
+    if (Q == Query::ClosestHit) {
+        for (uint32_t i = 0; i < count; ++i) {
+            if (packet.hits & (1u << i))
+                its[i].mesh->setHitInformation(packet.f[i], packet.rays[i], its[i]);
+        }
+    }
+
+    return packet.hits;
+}
+
+template uint32_t BVH::rayIntersect8<BVH::Query::ClosestHit>(const Ray3f *, Intersection *, uint32_t) const;
+template uint32_t BVH::rayIntersect8<BVH::Query::AnyHit>(const Ray3f *, Intersection *, uint32_t) const;
+
+uint32_t BVH::rayIntersect8(const Ray3f *rays, Intersection *its, uint32_t count,
+                           bool shadowRay) const {
+    return shadowRay ? rayIntersect8<Query::AnyHit>(rays, its, count)
+                     : rayIntersect8<Query::ClosestHit>(rays, its, count);
+}
+
+template <BVH::Query Q, bool Ordered, typename Stats> bool BVH::traverseBinary(
+        const BinaryTree &tree, Ray3f &ray, Intersection *its, uint32_t &f, Stats &stats) const {
+    uint32_t node_idx = 0, stack_idx = 0, stack[MAX_DEPTH];
+    bool foundIntersection = false;
+
+    while (true) {
+        const BVHNode &node = tree.nodes[node_idx];
+        stats.node();
+
+        if (!node.bbox.rayIntersect(ray)) {
+            if (stack_idx == 0)
+                break;
+            node_idx = stack[--stack_idx];
+            continue;
+        }
+
+        if (node.isInner()) {
+            uint32_t left = tree.clustered ? node.inner.rightChild - 1 : node_idx + 1;
+
+            /* Visit the child on the near side of the split plane first
+               (this does not help any-hit queries) */
+            if (Ordered && Q == Query::ClosestHit && ray.dRcp[node.inner.axis] < 0) {
+                stack[stack_idx++] = left;
+                node_idx = node.inner.rightChild;
+            } else {
+                stack[stack_idx++] = node.inner.rightChild;
+                node_idx = left;
+            }
+            assert(stack_idx<64);
+        } else {
+            bool hit;
+            if (node.leaf.size == 0 && !m_lazySubtrees.empty()) {
+                /* Placeholder of a lazy subtree, whose root has the same bounds */
+                hit = traverseBinary<Q, Ordered>(getLazySubtree(node.start()), ray, its, f, stats);
+            } else {
+                stats.leaf(node.leaf.size);
+                hit = intersectBlocks<Q>(tree.getBlock(node.start()), tree.getBlock(node.end()),
+                                         ray, its, f);
+            }
+            if (hit) {
+                if (Q == Query::AnyHit)
+                    return true;
+                foundIntersection = true;
+            }
+            if (stack_idx == 0)
+                break;
+            node_idx = stack[--stack_idx];
+            continue;
+        }
+    }
+
+    return foundIntersection;
+}
+
+template <BVH::Query Q, bool Ordered, typename Stats> bool BVH::traverse(const Ray3f &_ray,
+        Intersection *its, Stats &stats, uint32_t *prim) const {
+    if (Q == Query::ClosestHit)
+        its->t = std::numeric_limits<float>::infinity();
+
+    /* Use an adaptive ray epsilon */
+    Ray3f ray(_ray);
+    if (ray.mint == Epsilon)
+        ray.mint = std::max(ray.mint, ray.mint * ray.o.array().abs().maxCoeff());
+
+    if (m_nodes.empty() || ray.maxt < ray.mint)
+        return false;
+
+    bool foundIntersection = false;
+    uint32_t f = 0;
+
+    if (m_width > 2)
+        foundIntersection = rayIntersectWide<Q, Ordered>(ray, its, f, stats);
+    else
+        foundIntersection = traverseBinary<Q, Ordered>(getTopTree(), ray, its, f, stats);
+
+    if (Q == Query::ClosestHit && foundIntersection) {
+        if (prim)
+            *prim = f;
+        else
+            its->mesh->setHitInformation(f,ray,*its);
     }
 
     return foundIntersection;
 }
 
+template <BVH::Query Q> bool BVH::rayIntersect(const Ray3f &ray, Intersection &its) const {
+    NoStats stats;
+    return traverse<Q, true>(ray, &its, stats);
+}
+
+template bool BVH::rayIntersect<BVH::Query::ClosestHit>(const Ray3f &, Intersection &) const;
+template bool BVH::rayIntersect<BVH::Query::AnyHit>(const Ray3f &, Intersection &) const;
+
+bool BVH::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay) const {
+    NoStats stats;
+    if (shadowRay) {
+        its.t = std::numeric_limits<float>::infinity();
+        return traverse<Query::AnyHit, true>(ray, &its, stats);
+    } else {
+        return traverse<Query::ClosestHit, true>(ray, &its, stats);
+    }
+}
+
+bool BVH::occluded(const Ray3f &ray) const {
+    NoStats stats;
+    return traverse<Query::AnyHit, true>(ray, nullptr, stats);
+}
+
+bool BVH::rayIntersectPrimitive(const Ray3f &ray, Intersection &its, uint32_t &prim) const {
+    NoStats stats;
+    return traverse<Query::ClosestHit, true>(ray, &its, stats, &prim);
+}
+
+bool BVH::rayIntersect(const Ray3f &ray, Intersection &its, bool shadowRay,
+                       TraversalStats &stats, bool ordered) const {
+    if (shadowRay)
+        return ordered ? traverse<Query::AnyHit, true>(ray, &its, stats)
+                       : traverse<Query::AnyHit, false>(ray, &its, stats);
+    else
+        return ordered ? traverse<Query::ClosestHit, true>(ray, &its, stats)
+                       : traverse<Query::ClosestHit, false>(ray, &its, stats);
+}
+
 NORI_NAMESPACE_END
@@ -0,0 +1,100 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <memory>
+
+/**
+ * Traversal benchmark: shoots one camera ray through the center of every
+ * pixel and reports the average number of visited BVH nodes and tested
+ * primitives per ray, both for front-to-back and storage order traversal.
+ * The BVH is configured by the scene (e.g. its \c bvhWidth parameter).
+ */
+
+NORI_NAMESPACE_BEGIN
+
+static void benchmark(const std::string &sceneName) {
+    getFileResolver()->prepend(filesystem::path(sceneName).parent_path());
+    std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+    if (root->getClassType() != NoriObject::EScene)
+        throw NoriException("The root element of \"%s\" is not a scene!", sceneName);
+    const Scene *scene = static_cast<const Scene *>(root.get());
+
+    /* Generate the camera rays */
+    const Camera *camera = scene->getCamera();
+    Vector2i size = camera->getOutputSize();
+    std::vector<Ray3f> rays((size_t) size.x() * size.y());
+    for (int y = 0; y < size.y(); ++y) {
+        for (int x = 0; x < size.x(); ++x) {
+            Point2f pixelSample((float) x + 0.5f, (float) y + 0.5f);
+            camera->sampleRay(rays[(size_t) y * size.x() + x], pixelSample, Point2f(0.5f));
+        }
+    }
+
+    const BVH *bvh = scene->getBVH();
+    cout << endl << "Scene \"" << sceneName << "\" (" << rays.size() << " camera rays, "
+         << bvh->getWidth() << "-wide BVH)" << endl;
+
+    cout << tfm::format("  %-15s %10s %12s %10s %10s", "Traversal",
+                        "Nodes/ray", "Prims/ray", "Mrays/s", "Hits") << endl;
+
+    for (int ordered = 0; ordered < 2; ++ordered) {
+        BVH::TraversalStats stats;
+        uint64_t hits = 0;
+        Timer timer;
+        for (const Ray3f &ray : rays) {
+            Intersection its;
+            if (bvh->rayIntersect(ray, its, false, stats, ordered != 0))
+                hits++;
+        }
+        double elapsed = timer.elapsed();
+
+        cout << tfm::format("  %-15s %10.2f %12.2f %10.2f %9.1f%%",
+            ordered ? "front to back" : "storage order",
+            stats.nodes / (double) rays.size(),
+            stats.primitives / (double) rays.size(),
+            rays.size() / (1000.0 * elapsed),
+            100.0 * hits / (double) rays.size()) << endl;
+    }
+}
+
+NORI_NAMESPACE_END
+
+int main(int argc, char **argv) {
+    using namespace nori;
+
+    if (argc < 2) {
+        std::cerr << "Syntax: " << argv[0] << " <scene.xml> [<scene.xml> ...]" << std::endl
+                  << "Reports BVH node visits per camera ray for different traversal orders." << std::endl;
+        return 1;
+    }
+
+    try {
+        for (int i = 1; i < argc; ++i)
+            benchmark(argv[i]);
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return 2;
+    }
+
+    return 0;
+}
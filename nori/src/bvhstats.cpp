@@ -0,0 +1,297 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/mesh.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <pcg32.h>
+#include <memory>
+
+/**
+ * BVH quality report: prints the structure of the tree built for a scene
+ * (depth and leaf size histograms, memory per level, sibling overlap and
+ * EPO), and compares the node visits and primitive tests predicted by the
+ * SAH with the ones of camera rays through random positions of the image.
+ * The BVH is configured by the scene (e.g. its \c bvhBuilder parameter).
+ *
+ * Optionally, the meshes of the scene are then animated for a number of
+ * frames. After every frame, the BVH is refitted (see \ref BVH::refit())
+ * and its hits are compared with those of a BVH built from scratch over a
+ * second copy of the scene.
+ */
+
+NORI_NAMESPACE_BEGIN
+
+/// Print the nonzero entries of a histogram along with a bar chart
+static void printHistogram(const std::string &label, const std::vector<uint32_t> &histogram) {
+    uint64_t total = 0;
+    uint32_t largest = 0;
+    for (uint32_t count : histogram) {
+        total += count;
+        largest = std::max(largest, count);
+    }
+
+    cout << tfm::format("  %6s %10s %7s", label, "Leaves", "") << endl;
+    for (size_t i = 0; i < histogram.size(); ++i) {
+        if (histogram[i] == 0)
+            continue;
+        int bar = (int) std::ceil(40.0 * histogram[i] / largest);
+        cout << tfm::format("  %6i %10i %6.2f%% %s", i, histogram[i],
+                            100.0 * histogram[i] / total, std::string(bar, '#')) << endl;
+    }
+}
+
+/// Load a scene file, whose root element must be a scene
+static Scene *loadScene(const std::string &sceneName) {
+    std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+    if (root->getClassType() != NoriObject::EScene)
+        throw NoriException("The root element of \"%s\" is not a scene!", sceneName);
+    return static_cast<Scene *>(root.release());
+}
+
+/// Generate camera rays through random positions of the image
+static std::vector<Ray3f> sampleCameraRays(const Camera *camera, uint32_t rayCount) {
+    Vector2i size = camera->getOutputSize();
+    pcg32 rng;
+    std::vector<Ray3f> rays;
+    rays.reserve(rayCount);
+    for (uint32_t i = 0; i < rayCount; ++i) {
+        Point2f pixelSample(rng.nextFloat() * size.x(), rng.nextFloat() * size.y());
+        Point2f apertureSample(rng.nextFloat(), rng.nextFloat());
+        Ray3f ray;
+        camera->sampleRay(ray, pixelSample, apertureSample);
+        rays.push_back(ray);
+    }
+    return rays;
+}
+
+static void report(const std::string &sceneName, uint32_t rayCount, bool epo) {
+    std::unique_ptr<Scene> scene(loadScene(sceneName));
+    const BVH *bvh = scene->getBVH();
+
+    Timer timer;
+    BVH::TreeStatistics stats = bvh->computeStatistics(epo);
+    cout << endl << "Scene \"" << sceneName << "\" (" << bvh->getPrimitiveCount()
+         << " primitives, " << bvh->getWidth() << "-wide BVH, statistics computed in "
+         << timer.elapsedString() << ")" << endl;
+
+    double depthSum = 0;
+    for (size_t i = 0; i < stats.leafDepths.size(); ++i)
+        depthSum += (double) i * stats.leafDepths[i];
+
+    cout << tfm::format("  Inner nodes          %12i", stats.innerNodes) << endl
+         << tfm::format("  Leaves               %12i", stats.leaves) << endl
+         << tfm::format("  References/primitive %12.3f",
+                        stats.references / (double) bvh->getPrimitiveCount()) << endl
+         << tfm::format("  References/leaf      %12.3f",
+                        stats.references / (double) stats.leaves) << endl
+         << tfm::format("  Leaf depth (avg/max) %12.2f %i", depthSum / stats.leaves,
+                        stats.leafDepths.size() - 1) << endl
+         << tfm::format("  SAH cost             %12.4f", stats.sahCost) << endl
+         << tfm::format("  Sibling overlap      %12.4f (mean surface area relative to the parent)",
+                        stats.overlap) << endl
+         << tfm::format("  Overlap visits/ray   %12.4f", stats.overlapVisits) << endl;
+    if (epo)
+        cout << tfm::format("  EPO                  %12.4f", stats.epo) << endl;
+
+    cout << endl;
+    printHistogram("Depth", stats.leafDepths);
+    cout << endl;
+    printHistogram("Size", stats.leafSizes);
+
+    cout << endl << tfm::format("  %6s %10s %12s", "Level", "Nodes", "Memory") << endl;
+    size_t totalMemory = 0;
+    for (size_t i = 0; i < stats.levelNodes.size(); ++i) {
+        totalMemory += stats.levelMemory[i];
+        cout << tfm::format("  %6i %10i %12s", i, stats.levelNodes[i],
+                            memString(stats.levelMemory[i])) << endl;
+    }
+    cout << tfm::format("  %6s %10s %12s (+ %s of primitive blocks)", "Total", "",
+                        memString(totalMemory), memString(stats.primitiveMemory)) << endl;
+
+    /* The SAH only considers rays that intersect the scene's bounding box */
+    std::vector<Ray3f> rays;
+    for (const Ray3f &ray : sampleCameraRays(scene->getCamera(), rayCount))
+        if (bvh->getBoundingBox().rayIntersect(ray))
+            rays.push_back(ray);
+    if (rays.empty())
+        return;
+
+    cout << endl << "  " << rays.size() << " of " << rayCount
+         << " camera rays intersect the bounding box of the scene" << endl;
+    cout << tfm::format("  %-12s %10s %10s %12s %10s %10s", "Query", "Nodes/ray",
+                        "(SAH)", "Prims/ray", "(SAH)", "Mrays/s") << endl;
+
+    for (int shadowRay = 0; shadowRay < 2; ++shadowRay) {
+        BVH::TraversalStats traversal;
+        Timer rayTimer;
+        for (const Ray3f &ray : rays) {
+            Intersection its;
+            bvh->rayIntersect(ray, its, shadowRay != 0, traversal);
+        }
+        double elapsed = rayTimer.elapsed();
+
+        cout << tfm::format("  %-12s %10.2f %10.2f %12.2f %10.2f %10.2f",
+            shadowRay ? "any hit" : "closest hit",
+            traversal.nodes / (double) rays.size(), stats.expectedNodes,
+            traversal.primitives / (double) rays.size(), stats.expectedPrimitives,
+            rays.size() / (1000.0 * elapsed)) << endl;
+    }
+}
+
+/**
+ * \brief Move the vertices of the meshes of a scene to a frame of a test
+ * animation
+ *
+ * A wave travels through all meshes, which mostly keeps the quality of
+ * a refitted tree. In addition, one mesh per frame (in turn) is scaled
+ * up about its center, which degrades the subtrees that contain it.
+ */
+static void animate(Scene *scene, const std::vector<MatrixXf> &positions,
+                    const BoundingBox3f &bbox, int frame) {
+    float extent = bbox.getExtents().maxCoeff();
+    size_t scaledMesh = (size_t) (frame - 1) % positions.size();
+    size_t meshIdx = 0;
+    for (Shape *shape : scene->getShapes()) {
+        Mesh *mesh = dynamic_cast<Mesh *>(shape);
+        if (!mesh)
+            continue;
+        const MatrixXf &V0 = positions[meshIdx];
+        Point3f center = 0.5f * (V0.rowwise().minCoeff() + V0.rowwise().maxCoeff());
+        MatrixXf V(3, V0.cols());
+        for (ptrdiff_t i = 0; i < V0.cols(); ++i) {
+            Point3f p = V0.col(i);
+            if (meshIdx == scaledMesh)
+                p = center + (p - center) * (1.0f + 0.5f * frame);
+            float phase = 4 * M_PI * (p.x() - bbox.min.x()) / extent + 0.5f * frame;
+            p.y() += 0.01f * extent * std::sin(phase);
+            V.col(i) = p;
+        }
+        mesh->setVertexPositions(V);
+        meshIdx++;
+    }
+}
+
+/**
+ * \brief Animate a scene, refit its BVH after every frame, and compare
+ * the hits of camera rays with those of a rebuilt BVH
+ *
+ * Returns \c false if any ray found a different intersection.
+ */
+static bool checkRefit(const std::string &sceneName, uint32_t rayCount, int frames) {
+    std::unique_ptr<Scene> scene(loadScene(sceneName)), reference(loadScene(sceneName));
+
+    /* Keep the original vertex positions, which every frame displaces */
+    std::vector<MatrixXf> positions;
+    for (const Shape *shape : scene->getShapes()) {
+        if (const Mesh *mesh = dynamic_cast<const Mesh *>(shape)) {
+            MatrixXf V(3, mesh->getVertexCount());
+            for (uint32_t i = 0; i < mesh->getVertexCount(); ++i)
+                V.col(i) = mesh->getVertexPosition(i);
+            positions.push_back(std::move(V));
+        }
+    }
+    if (positions.empty()) {
+        cout << endl << "Scene \"" << sceneName << "\" has no meshes to animate." << endl;
+        return true;
+    }
+
+    BoundingBox3f bbox = scene->getBoundingBox();
+    std::vector<Ray3f> rays = sampleCameraRays(scene->getCamera(), rayCount);
+    bool success = true;
+    cout << endl << "Refitting the BVH of scene \"" << sceneName << "\" for "
+         << frames << (frames == 1 ? " frame" : " frames") << endl;
+
+    for (int frame = 1; frame <= frames; ++frame) {
+        animate(scene.get(), positions, bbox, frame);
+        scene->getBVH()->refit();
+        animate(reference.get(), positions, bbox, frame);
+        reference->getBVH()->build();
+
+        const BVH *bvh = scene->getBVH(), *rebuilt = reference->getBVH();
+        uint32_t closestHits = 0, anyHits = 0;
+        for (const Ray3f &ray : rays) {
+            Intersection its1, its2;
+            bool hit1 = bvh->rayIntersect(ray, its1, false),
+                 hit2 = rebuilt->rayIntersect(ray, its2, false);
+            if (hit1 != hit2 || (hit1 && std::abs(its1.t - its2.t) > 1e-4f * its2.t))
+                closestHits++;
+            if (bvh->occluded(ray) != rebuilt->occluded(ray))
+                anyHits++;
+        }
+
+        cout << tfm::format("  Frame %i: SAH cost %.4f (refitted) vs. %.4f (rebuilt), "
+                            "%i closest hits and %i shadow rays of %i differ", frame,
+                            bvh->computeStatistics(false).sahCost,
+                            rebuilt->computeStatistics(false).sahCost,
+                            closestHits, anyHits, rays.size()) << endl;
+        if (closestHits > 0 || anyHits > 0)
+            success = false;
+    }
+    return success;
+}
+
+NORI_NAMESPACE_END
+
+int main(int argc, char **argv) {
+    using namespace nori;
+
+    uint32_t rayCount = 1u << 16;
+    int refitFrames = 0;
+    bool epo = true;
+    std::vector<std::string> scenes;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg(argv[i]);
+        if (arg == "-r" && i + 1 < argc)
+            rayCount = (uint32_t) std::max(1, atoi(argv[++i]));
+        else if (arg == "--no-epo")
+            epo = false;
+        else if (arg == "--refit" && i + 1 < argc)
+            refitFrames = std::max(1, atoi(argv[++i]));
+        else
+            scenes.push_back(arg);
+    }
+
+    if (scenes.empty()) {
+        std::cerr << "Syntax: " << argv[0] << " [-r <rays>] [--no-epo] [--refit <frames>] <scene.xml> [<scene.xml> ...]" << std::endl
+                  << "Reports quality metrics of the BVH of a scene, and compares the traversal" << std::endl
+                  << "cost predicted by the SAH with that of <rays> random camera rays (default: 65536)." << std::endl
+                  << "--no-epo skips the effective parent overlap, which is slow on large scenes." << std::endl
+                  << "--refit animates the meshes for <frames> frames, refits the BVH after each one," << std::endl
+                  << "and checks that the camera rays hit the same surfaces as with a rebuilt BVH." << std::endl;
+        return 1;
+    }
+
+    bool success = true;
+    try {
+        for (const std::string &scene : scenes) {
+            getFileResolver()->prepend(filesystem::path(scene).parent_path());
+            report(scene, rayCount, epo);
+            if (refitFrames > 0 && !checkRefit(scene, rayCount, refitFrames))
+                success = false;
+        }
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return 2;
+    }
+
+    return success ? 0 : 3;
+}
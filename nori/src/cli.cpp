@@ -0,0 +1,140 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/render.h>
+#include <nori/parser.h>
+#include <nori/scene.h>
+#include <nori/camera.h>
+#include <nori/bitmap.h>
+#include <nori/sampler.h>
+#include <nori/integrator.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/task_scheduler_init.h>
+#include <memory>
+
+/* Exit codes reported by the batch renderer */
+enum EExitCode {
+    ESuccess = 0,
+    EInvalidArguments = 1,
+    ERenderFailure = 2
+};
+
+static void usage(const char *program) {
+    std::cerr << "Syntax: " << program << " [options] <scene.xml>" << std::endl
+         << "Renders a Nori scene without opening a window." << std::endl << std::endl
+         << "Options:" << std::endl
+         << "  -t, --threads <count>  Number of render threads (default: all cores)" << std::endl
+         << "  -s, --spp <count>      Override the sampler's sample count" << std::endl
+         << "  -o, --output <file>    Output image (.exr or .png, default: <scene>.exr)" << std::endl
+         << "  -h, --help             Print this message" << std::endl << std::endl
+         << "Exit codes: 0 = success, 1 = invalid arguments, 2 = loading or rendering failed" << std::endl;
+}
+
+int main(int argc, char **argv) {
+    using namespace nori;
+
+    int threadCount = tbb::task_scheduler_init::automatic;
+    int sampleCount = -1;
+    std::string sceneName, outputName;
+
+    try {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            bool hasValue = i + 1 < argc;
+            if (arg == "-h" || arg == "--help") {
+                usage(argv[0]);
+                return ESuccess;
+            } else if ((arg == "-t" || arg == "--threads") && hasValue) {
+                threadCount = toInt(argv[++i]);
+                if (threadCount <= 0)
+                    throw NoriException("Thread count must be positive!");
+            } else if ((arg == "-s" || arg == "--spp") && hasValue) {
+                sampleCount = toInt(argv[++i]);
+                if (sampleCount <= 0)
+                    throw NoriException("Sample count must be positive!");
+            } else if ((arg == "-o" || arg == "--output") && hasValue) {
+                outputName = argv[++i];
+            } else if (arg[0] != '-' && sceneName.empty()) {
+                sceneName = arg;
+            } else {
+                throw NoriException("Unexpected argument \"%s\"", arg);
+            }
+        }
+        if (sceneName.empty())
+            throw NoriException("No scene file was specified!");
+        if (filesystem::path(sceneName).extension() != "xml")
+            throw NoriException("Unknown file \"%s\", expected an extension of type .xml", sceneName);
+    } catch (const std::exception &e) {
+        cerr << "Error: " << e.what() << endl << endl;
+        usage(argv[0]);
+        return EInvalidArguments;
+    }
+
+    if (outputName.empty()) {
+        outputName = sceneName;
+        size_t lastdot = outputName.find_last_of(".");
+        if (lastdot != std::string::npos)
+            outputName.erase(lastdot, std::string::npos);
+        outputName += ".exr";
+    }
+
+    try {
+        tbb::task_scheduler_init init(threadCount);
+
+        /* Add the parent directory of the scene file to the
+           file resolver. That way, the XML file can reference
+           resources (OBJ files, textures) using relative paths */
+        getFileResolver()->prepend(filesystem::path(sceneName).parent_path());
+
+        std::unique_ptr<NoriObject> root(loadFromXML(sceneName));
+        if (root->getClassType() != NoriObject::EScene)
+            throw NoriException("The root element of \"%s\" is not a scene!", sceneName);
+
+        Scene *scene = static_cast<Scene *>(root.get());
+        const Camera *camera = scene->getCamera();
+        scene->getIntegrator()->preprocess(scene);
+
+        if (sampleCount < 0)
+            sampleCount = (int) scene->getSampler()->getSampleCount();
+
+        /* Allocate memory for the entire output image and clear it */
+        ImageBlock result(camera->getOutputSize(), camera->getReconstructionFilter());
+        result.clear();
+
+        cout << "Rendering (" << sampleCount << " spp) .. ";
+        cout.flush();
+        Timer timer;
+        renderImage(scene, result, (uint32_t) sampleCount);
+        cout << "done. (took " << timer.elapsedString() << ")" << endl;
+
+        /* Now turn the rendered image block into
+           a properly normalized bitmap */
+        std::unique_ptr<Bitmap> bitmap(result.toBitmap());
+
+        if (filesystem::path(outputName).extension() == "png")
+            bitmap->saveToLDR(outputName);
+        else
+            bitmap->save(outputName);
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return ERenderFailure;
+    }
+
+    return ESuccess;
+}
@@ -12,9 +12,16 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its)){
+        bool hit = scene->rayIntersect(ray, its);
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+               const Intersection *primary) const {
+        if (!primary) {
             return Color3f(0);
         }
+        const Intersection &its = *primary;
 
         Color3f Lo(0);
 
@@ -25,30 +32,46 @@ public:
             Lo += Le;
         }
 
-        for (auto light : scene->getLights()) {
-            //reflected
-            EmitterQueryRecord lRec;
-            lRec.ref = its.p;
-            Color3f value = light->sample(lRec, sampler->next2D());
+        // Sample up to 8 lights and trace their shadow rays as one packet
+        auto const &lights = scene->getLights();
+        for (size_t first = 0; first < lights.size(); first += 8) {
+            size_t count = std::min(lights.size() - first, (size_t) 8);
+            EmitterQueryRecord lRecs[8];
+            Color3f values[8];
+            Ray3f shadowRays[8];
+            bool occluded[8];
 
-            // If ray is occluded
-            if (scene->rayIntersect(lRec.shadowRay)) {
-                continue;
+            for (size_t i = 0; i < count; ++i) {
+                lRecs[i].ref = its.p;
+                values[i] = lights[first + i]->sample(lRecs[i], sampler->next2D());
+                new (&shadowRays[i]) Ray3f(lRecs[i].shadowRay);
             }
+            scene->rayIntersectPacket(shadowRays, occluded, count);
+
+            for (size_t i = 0; i < count; ++i) {
+                //reflected
+                const EmitterQueryRecord &lRec = lRecs[i];
+                const Color3f &value = values[i];
 
-            // Convert to local frame
-            auto localLRec = its.shFrame.toLocal(lRec.wi);
-            auto localRay = its.shFrame.toLocal(-ray.d);
+                // If ray is occluded
+                if (occluded[i]) {
+                    continue;
+                }
 
-            // Cosine value between shading normal and lRec
-            auto cosineTerm = Frame::cosTheta(localLRec);
+                // Convert to local frame
+                auto localLRec = its.shFrame.toLocal(lRec.wi);
+                auto localRay = its.shFrame.toLocal(-ray.d);
 
-            // Evaluate the BSDF for a pair of directions (lRec and ray)
-            BSDFQueryRecord bsdfRec(localRay, localLRec, ESolidAngle);
-            bsdfRec.uv = its.uv;
-            auto bsdf = its.mesh->getBSDF()->eval(bsdfRec);
+                // Cosine value between shading normal and lRec
+                auto cosineTerm = Frame::cosTheta(localLRec);
 
-            Lo += value * cosineTerm * bsdf;
+                // Evaluate the BSDF for a pair of directions (lRec and ray)
+                BSDFQueryRecord bsdfRec(localRay, localLRec, ESolidAngle);
+                bsdfRec.uv = its.uv;
+                auto bsdf = its.mesh->getBSDF()->eval(bsdfRec);
+
+                Lo += value * cosineTerm * bsdf;
+            }
         }
 
         return Lo;
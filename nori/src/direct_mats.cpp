@@ -12,9 +12,16 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its)){
+        bool hit = scene->rayIntersect(ray, its);
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+               const Intersection *primary) const override {
+        if (!primary) {
             return Color3f(0);
         }
+        const Intersection &its = *primary;
 
         Color3f Lo(0);
 
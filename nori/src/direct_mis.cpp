@@ -15,9 +15,16 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its)){
+        bool hit = scene->rayIntersect(ray, its);
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+               const Intersection *primary) const {
+        if (!primary) {
             return Color3f(0.0f);
         }
+        const Intersection &its = *primary;
             
         // check if the direction is emitter
         Color3f radiance_e(0);
@@ -32,31 +39,45 @@ public:
         Color3f radiance_ems(0);
 
         // intersect with object
-        auto light = scene->getLights();
-        for (unsigned long i = 0; i < light.size(); i++){
-            // 1. get light radiance over pdf
-            EmitterQueryRecord lRec;
-            lRec.ref = its.p;
-            auto Li_pdf = light[i]->sample(lRec, sampler->next2D());
-            auto w_em = light[i]->pdf(lRec);
-                // if occlusion (intersect before its.p)
-            if (scene->rayIntersect(lRec.shadowRay)) {
-                continue;
+        auto const &light = scene->getLights();
+        for (size_t first = 0; first < light.size(); first += 8) {
+            // 1. get light radiance over pdf for up to 8 lights
+            size_t count = std::min(light.size() - first, (size_t) 8);
+            EmitterQueryRecord lRecs[8];
+            Color3f Li_pdfs[8];
+            Ray3f shadowRays[8];
+            bool occluded[8];
+            for (size_t i = 0; i < count; i++){
+                lRecs[i].ref = its.p;
+                Li_pdfs[i] = light[first + i]->sample(lRecs[i], sampler->next2D());
+                new (&shadowRays[i]) Ray3f(lRecs[i].shadowRay);
             }
-            // 2. set BRDF property
-                // frame transformation
-            auto local_wo = its.shFrame.toLocal(lRec.wi);
-            auto local_wi = its.shFrame.toLocal(-ray.d);
-            BSDFQueryRecord bRec(local_wi, local_wo, ESolidAngle);
-            bRec.uv = its.uv;
-            auto bsdf = its.mesh->getBSDF()->eval(bRec);
-            auto w_mat = its.mesh->getBSDF()->pdf(bRec);
+                // trace all shadow rays as one packet
+            scene->rayIntersectPacket(shadowRays, occluded, count);
+
+            for (size_t i = 0; i < count; i++){
+                const EmitterQueryRecord &lRec = lRecs[i];
+                const Color3f &Li_pdf = Li_pdfs[i];
+                auto w_em = light[first + i]->pdf(lRec);
+                    // if occlusion (intersect before its.p)
+                if (occluded[i]) {
+                    continue;
+                }
+                // 2. set BRDF property
+                    // frame transformation
+                auto local_wo = its.shFrame.toLocal(lRec.wi);
+                auto local_wi = its.shFrame.toLocal(-ray.d);
+                BSDFQueryRecord bRec(local_wi, local_wo, ESolidAngle);
+                bRec.uv = its.uv;
+                auto bsdf = its.mesh->getBSDF()->eval(bRec);
+                auto w_mat = its.mesh->getBSDF()->pdf(bRec);
         
-            if (w_em + w_mat >= Epsilon){
-                radiance_ems += w_em / (w_em + w_mat) * Li_pdf * bsdf * Frame::cosTheta(local_wo);
-            }
+                if (w_em + w_mat >= Epsilon){
+                    radiance_ems += w_em / (w_em + w_mat) * Li_pdf * bsdf * Frame::cosTheta(local_wo);
+                }
             
 
+            }
         }
         
 
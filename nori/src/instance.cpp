@@ -0,0 +1,156 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/bvh.h>
+#include <nori/mesh.h>
+#include <nori/bsdf.h>
+#include <filesystem/resolver.h>
+#include <map>
+#include <memory>
+#include <mutex>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Instance of a mesh file (\c .obj, \c .ply or \c .nmesh) with its own transformation
+ *
+ * All instances of the same file share a single copy of the mesh, which
+ * is loaded in object space, and a bottom-level BVH over its triangles.
+ * The instance itself is a single primitive of the scene's BVH, and rays
+ * are transformed into object space before traversing the shared tree.
+ * Memory usage hence scales with the amount of unique geometry rather
+ * than with the number of instances.
+ *
+ * Every instance has its own BSDF. Instances cannot be area emitters.
+ * The \c quantizeAttributes and \c quantizePositions parameters are
+ * passed on to the mesh (see \ref Mesh); instances only share meshes
+ * that are quantized in the same way.
+ */
+class Instance : public Shape {
+public:
+    Instance(const PropertyList &propList) {
+        m_filename = propList.getString("filename");
+        m_toWorld = propList.getTransform("toWorld", Transform());
+        m_toObject = m_toWorld.inverse();
+        m_bvh = loadGeometry(m_filename, propList.getBoolean("quantizeAttributes", false),
+                             propList.getBoolean("quantizePositions", false));
+
+        /* Bound the transformed corners of the object space bounding box */
+        const BoundingBox3f &bbox = m_bvh->getBoundingBox();
+        for (int i = 0; i < 8; ++i)
+            m_bbox.expandBy(m_toWorld * bbox.getCorner(i));
+    }
+
+    virtual void addChild(NoriObject *obj) override {
+        if (obj->getClassType() == EEmitter)
+            throw NoriException("Instance: area emitters are not supported!");
+        Shape::addChild(obj);
+    }
+
+    virtual BoundingBox3f getBoundingBox(uint32_t index) const override { return m_bbox; }
+
+    virtual Point3f getCentroid(uint32_t index) const override { return m_bbox.getCenter(); }
+
+    virtual bool rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const override {
+        uint32_t prim;
+        return rayIntersectNested(index, ray, u, v, t, prim);
+    }
+
+    virtual bool rayIntersectNested(uint32_t index, const Ray3f &ray, float &u, float &v,
+                                    float &t, uint32_t &nestedPrim) const override {
+        /* The transformed direction is not normalized, hence
+           distances along the ray are the same in both spaces */
+        Intersection its;
+        if (!m_bvh->rayIntersectPrimitive(m_toObject * ray, its, nestedPrim))
+            return false;
+        u = its.uv.x();
+        v = its.uv.y();
+        t = its.t;
+        return true;
+    }
+
+    virtual bool rayOccluded(uint32_t index, const Ray3f &ray) const override {
+        return m_bvh->occluded(m_toObject * ray);
+    }
+
+    virtual void setHitInformation(uint32_t index, const Ray3f &ray, Intersection &its) const override {
+        /* The triangle and its barycentric coordinates are known from rayIntersectNested() */
+        Intersection local(its);
+        m_bvh->getShape(0)->setHitInformation(its.nestedPrim, m_toObject * ray, local);
+
+        its.p = m_toWorld * local.p;
+        its.uv = local.uv;
+        its.geoFrame = Frame((m_toWorld * local.geoFrame.n).normalized());
+        its.shFrame = Frame((m_toWorld * local.shFrame.n).normalized());
+    }
+
+    virtual void sampleSurface(ShapeQueryRecord &sRec, const Point2f &sample) const override {
+        throw NoriException("Instance::sampleSurface(): not supported!");
+    }
+
+    virtual float pdfSurface(const ShapeQueryRecord &sRec) const override {
+        throw NoriException("Instance::pdfSurface(): not supported!");
+    }
+
+    virtual std::string toString() const override {
+        return tfm::format(
+                "Instance[\n"
+                "  filename = \"%s\",\n"
+                "  toWorld = %s,\n"
+                "  bsdf = %s\n"
+                "]",
+                m_filename,
+                indent(m_toWorld.toString(), 12),
+                m_bsdf ? indent(m_bsdf->toString()) : std::string("null"));
+    }
+
+protected:
+    /// Load a mesh in object space, or return the copy shared with other instances
+    static std::shared_ptr<BVH> loadGeometry(const std::string &filename,
+                                             bool quantizeAttributes, bool quantizePositions) {
+        static std::map<std::string, std::weak_ptr<BVH>> cache;
+        static std::mutex mutex;
+
+        std::string path = getFileResolver()->resolve(filename).str();
+        std::string key = tfm::format("%s:%i%i", path, quantizeAttributes, quantizePositions);
+        std::lock_guard<std::mutex> guard(mutex);
+        std::shared_ptr<BVH> bvh = cache[key].lock();
+        if (!bvh) {
+            PropertyList propList;
+            propList.setString("filename", path);
+            propList.setBoolean("quantizeAttributes", quantizeAttributes);
+            propList.setBoolean("quantizePositions", quantizePositions);
+            Shape *mesh = Mesh::load(propList);
+            mesh->activate();
+
+            bvh = std::make_shared<BVH>();
+            bvh->addShape(mesh);
+            bvh->build();
+            cache[key] = bvh;
+        }
+        return bvh;
+    }
+
+    std::string m_filename;
+    Transform m_toWorld;
+    Transform m_toObject;
+    std::shared_ptr<BVH> m_bvh; ///< Object space mesh and bottom-level BVH
+};
+
+NORI_REGISTER_CLASS(Instance, "instance");
+NORI_NAMESPACE_END
@@ -21,12 +21,149 @@
 #include <nori/bsdf.h>
 #include <nori/emitter.h>
 #include <nori/warp.h>
+#include <filesystem/path.h>
 #include <Eigen/Geometry>
+#include <tbb/tbb.h>
+#include <map>
+#include <mutex>
 
 NORI_NAMESPACE_BEGIN
 
+const int Mesh::QUANTIZED_POSITION_BITS;
+const uint64_t Mesh::QUANTIZED_POSITION_MASK;
+
+/// Vertex and index data owned by a mesh
+struct MeshStorage {
+    MatrixXf V, N, UV;
+    MatrixXu F;
+    std::vector<uint64_t> quantizedV;
+    std::vector<uint16_t> quantizedN, quantizedUV;
+};
+
+/// Data of a loaded mesh that later meshes can share (see \ref Mesh::shareData())
+struct SharedMeshData {
+    std::weak_ptr<const void> storage;  ///< Owner of the arrays below (expires with the last mesh)
+    uint32_t vertexCount, triangleCount;
+    const float *V, *N, *UV;
+    const uint32_t *F;
+    const uint64_t *quantizedV;
+    const uint16_t *quantizedN, *quantizedUV;
+    Vector3f positionOffset, positionScale;
+    BoundingBox3f bbox;
+};
+
+/// Process-wide registry of shared mesh data
+static std::map<std::string, SharedMeshData> sharedMeshData;
+static std::mutex sharedMeshDataMutex;
+
+/// Identify the data of a mesh by its file, transform and quantization parameters
+static std::string sharedMeshKey(const filesystem::path &filename, const Transform &trafo,
+                                 bool quantizeAttributes, bool quantizePositions) {
+    /* Missing files are reported by the loader */
+    std::string key = filename.exists() ? filename.make_absolute().str() : filename.str();
+    key.push_back('\0');
+    key.append((const char *) trafo.getMatrix().data(), sizeof(float) * 16);
+    key.push_back(quantizeAttributes ? '1' : '0');
+    key.push_back(quantizePositions ? '1' : '0');
+    return key;
+}
+
+static inline float signNotZero(float value) { return value >= 0.f ? 1.f : -1.f; }
+
+/// Decode a unit vector from its octahedral encoding
+static Normal3f decodeOctahedral(const uint16_t *q) {
+    Vector3f v(q[0] * (2.f / 65535.f) - 1.f, q[1] * (2.f / 65535.f) - 1.f, 0.f);
+    v.z() = 1.f - std::abs(v.x()) - std::abs(v.y());
+    if (v.z() < 0.f) {
+        float x = v.x();
+        v.x() = (1.f - std::abs(v.y())) * signNotZero(x);
+        v.y() = (1.f - std::abs(x)) * signNotZero(v.y());
+    }
+    return Normal3f(v.normalized());
+}
+
+/**
+ * \brief Encode a unit vector by projecting it onto an octahedron, whose
+ * lower half is folded over the upper one (Cigolle et al., "A Survey of
+ * Efficient Representations for Independent Unit Vectors", JCGT 2014)
+ *
+ * Of the four nearest grid points, the one that decodes to the closest
+ * direction is chosen.
+ */
+static void encodeOctahedral(const Normal3f &n, uint16_t *result) {
+    float norm = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+    Vector2f p = Vector2f::Zero();
+    if (norm > 0.f) {
+        p = Vector2f(n.x(), n.y()) / norm;
+        if (n.z() < 0.f)
+            p = Vector2f((1.f - std::abs(p.y())) * signNotZero(p.x()),
+                         (1.f - std::abs(p.x())) * signNotZero(p.y()));
+    }
+
+    Vector3f target = norm > 0.f ? Vector3f(n.normalized()) : Vector3f(0.f, 0.f, 1.f);
+    float best = -std::numeric_limits<float>::infinity();
+    for (int i = 0; i < 4; ++i) {
+        uint16_t q[2];
+        for (int k = 0; k < 2; ++k) {
+            float value = (p[k] * 0.5f + 0.5f) * 65535.f;
+            value = ((i >> k) & 1) ? std::ceil(value) : std::floor(value);
+            q[k] = (uint16_t) std::min(std::max(value, 0.f), 65535.f);
+        }
+        float similarity = decodeOctahedral(q).dot(target);
+        if (similarity > best) {
+            best = similarity;
+            result[0] = q[0];
+            result[1] = q[1];
+        }
+    }
+}
+
+/// Convert a float to half precision (rounding to nearest even)
+static uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(float));
+    uint16_t sign = (uint16_t) ((bits >> 16) & 0x8000u);
+    bits &= 0x7FFFFFFFu;
+
+    if (bits >= 0x7F800000u) /* Infinity or NaN */
+        return sign | 0x7C00u | (bits > 0x7F800000u ? 0x200u : 0u);
+    if (bits >= 0x477FF000u) /* Rounds to infinity */
+        return sign | 0x7C00u;
+    if (bits < 0x38800000u) { /* Subnormal or zero */
+        float abs;
+        memcpy(&abs, &bits, sizeof(float));
+        return sign | (uint16_t) std::nearbyint(abs * 16777216.f);
+    }
+    /* Rebias the exponent and round the mantissa */
+    bits += 0xC8000FFFu + ((bits >> 13) & 1u);
+    return sign | (uint16_t) (bits >> 13);
+}
+
+/// Convert a half precision value to a float
+static float halfToFloat(uint16_t value) {
+    uint32_t sign = (uint32_t) (value & 0x8000u) << 16,
+             exponent = (value >> 10) & 0x1Fu, mantissa = value & 0x3FFu, bits;
+    if (exponent == 0) {
+        float result = mantissa * (1.f / 16777216.f);
+        memcpy(&bits, &result, sizeof(float));
+    } else if (exponent == 31) {
+        bits = 0x7F800000u | (mantissa << 13);
+    } else {
+        bits = ((exponent + 112) << 23) | (mantissa << 13);
+    }
+    bits |= sign;
+    float result;
+    memcpy(&result, &bits, sizeof(float));
+    return result;
+}
+
 Mesh::Mesh() { }
 
+Mesh::Mesh(const PropertyList &propList) {
+    m_quantizeAttributes = propList.getBoolean("quantizeAttributes", false);
+    m_quantizePositions = propList.getBoolean("quantizePositions", false);
+}
+
 void Mesh::activate() {
     Shape::activate();
 
@@ -37,6 +174,248 @@ void Mesh::activate() {
     m_pdf.normalize();
 }
 
+Mesh *Mesh::load(const PropertyList &propList) {
+    filesystem::path path(propList.getString("filename"));
+    std::string extension = path.extension(), type = "obj";
+    if (extension == "nmesh" || extension == "ply")
+        type = extension;
+    return static_cast<Mesh *>(NoriObjectFactory::createInstance(type, propList));
+}
+
+void Mesh::setData(MatrixXf V, MatrixXu F, MatrixXf N, MatrixXf UV) {
+    std::shared_ptr<MeshStorage> storage = std::make_shared<MeshStorage>();
+    storage->V = std::move(V);
+    storage->N = std::move(N);
+    storage->UV = std::move(UV);
+    storage->F = std::move(F);
+    setData(storage, (uint32_t) storage->V.cols(), (uint32_t) storage->F.cols(),
+            storage->V.data(), storage->F.data(),
+            storage->N.size() > 0 ? storage->N.data() : nullptr,
+            storage->UV.size() > 0 ? storage->UV.data() : nullptr);
+}
+
+void Mesh::setData(std::shared_ptr<const void> storage, uint32_t vertexCount,
+                   uint32_t triangleCount, const float *V, const uint32_t *F,
+                   const float *N, const float *UV) {
+    /* Eigen maps are re-seated by constructing them again in place */
+    new (&m_V) MatrixXfView(V, 3, V ? vertexCount : 0);
+    new (&m_N) MatrixXfView(N, 3, N ? vertexCount : 0);
+    new (&m_UV) MatrixXfView(UV, 2, UV ? vertexCount : 0);
+    new (&m_F) MatrixXuView(F, 3, F ? triangleCount : 0);
+    m_storage = std::move(storage);
+    m_vertexCount = V ? vertexCount : 0;
+    m_quantizedV = nullptr;
+    m_quantizedN = m_quantizedUV = nullptr;
+
+    if (m_quantizeAttributes || m_quantizePositions)
+        quantize();
+}
+
+void Mesh::quantize() {
+    bool quantizeV = m_quantizePositions && m_V.size() > 0,
+         quantizeN = m_quantizeAttributes && m_N.size() > 0,
+         quantizeUV = m_quantizeAttributes && m_UV.size() > 0;
+    if (!quantizeV && !quantizeN && !quantizeUV)
+        return;
+
+    /* Copy whatever is not quantized, so that the original data can be released */
+    std::shared_ptr<MeshStorage> storage = std::make_shared<MeshStorage>();
+    storage->F = m_F;
+    if (!quantizeV)
+        storage->V = m_V;
+    if (!quantizeN)
+        storage->N = m_N;
+    if (!quantizeUV)
+        storage->UV = m_UV;
+
+    uint32_t vertexCount = m_vertexCount;
+    if (quantizeV) {
+        /* Map the bounding box of the positions onto the quantization grid */
+        BoundingBox3f bbox = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, vertexCount, 1u << 12), BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    result.expandBy(m_V.col(i));
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+        m_positionOffset = bbox.min;
+        m_positionScale = bbox.getExtents() / (float) QUANTIZED_POSITION_MASK;
+        storage->quantizedV.resize(vertexCount);
+    }
+    if (quantizeN)
+        storage->quantizedN.resize(2 * (size_t) vertexCount);
+    if (quantizeUV)
+        storage->quantizedUV.resize(2 * (size_t) vertexCount);
+
+    tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, vertexCount, 1u << 12),
+        [&](const tbb::blocked_range<uint32_t> &range) {
+            for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                if (quantizeV) {
+                    uint64_t q = 0;
+                    for (int k = 0; k < 3; ++k) {
+                        float value = m_positionScale[k] > 0.f
+                            ? std::round((m_V(k, i) - m_positionOffset[k]) / m_positionScale[k]) : 0.f;
+                        value = std::min(std::max(value, 0.f), (float) QUANTIZED_POSITION_MASK);
+                        q |= (uint64_t) value << (k * QUANTIZED_POSITION_BITS);
+                    }
+                    storage->quantizedV[i] = q;
+                }
+                if (quantizeN)
+                    encodeOctahedral(m_N.col(i), &storage->quantizedN[2 * (size_t) i]);
+                if (quantizeUV) {
+                    storage->quantizedUV[2 * (size_t) i] = floatToHalf(m_UV(0, i));
+                    storage->quantizedUV[2 * (size_t) i + 1] = floatToHalf(m_UV(1, i));
+                }
+            }
+        }
+    );
+
+    new (&m_V) MatrixXfView(storage->V.data(), 3, storage->V.cols());
+    new (&m_N) MatrixXfView(storage->N.data(), 3, storage->N.cols());
+    new (&m_UV) MatrixXfView(storage->UV.data(), 2, storage->UV.cols());
+    new (&m_F) MatrixXuView(storage->F.data(), 3, storage->F.cols());
+    m_quantizedV = quantizeV ? storage->quantizedV.data() : nullptr;
+    m_quantizedN = quantizeN ? storage->quantizedN.data() : nullptr;
+    m_quantizedUV = quantizeUV ? storage->quantizedUV.data() : nullptr;
+    m_storage = std::move(storage);
+
+    if (quantizeV) {
+        /* Bound the positions as they will be decoded */
+        m_bbox = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, vertexCount, 1u << 12), BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i)
+                    result.expandBy(getVertexPosition(i));
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+    }
+}
+
+bool Mesh::shareData(const filesystem::path &filename, const Transform &trafo) {
+    std::string key = sharedMeshKey(filename, trafo, m_quantizeAttributes, m_quantizePositions);
+    SharedMeshData data;
+    std::shared_ptr<const void> storage;
+    {
+        std::lock_guard<std::mutex> guard(sharedMeshDataMutex);
+        auto it = sharedMeshData.find(key);
+        if (it == sharedMeshData.end())
+            return false;
+        data = it->second;
+        storage = data.storage.lock();
+        if (!storage) {
+            sharedMeshData.erase(it);
+            return false;
+        }
+    }
+
+    new (&m_V) MatrixXfView(data.V, 3, data.V ? data.vertexCount : 0);
+    new (&m_N) MatrixXfView(data.N, 3, data.N ? data.vertexCount : 0);
+    new (&m_UV) MatrixXfView(data.UV, 2, data.UV ? data.vertexCount : 0);
+    new (&m_F) MatrixXuView(data.F, 3, data.triangleCount);
+    m_storage = std::move(storage);
+    m_vertexCount = data.vertexCount;
+    m_quantizedV = data.quantizedV;
+    m_quantizedN = data.quantizedN;
+    m_quantizedUV = data.quantizedUV;
+    m_positionOffset = data.positionOffset;
+    m_positionScale = data.positionScale;
+    m_bbox = data.bbox;
+    m_name = filename.str();
+
+    cout << "Loading \"" << filename << "\" .. done. (V=" << m_vertexCount << ", F="
+         << m_F.cols() << ", shared with an identical mesh)" << endl;
+    return true;
+}
+
+void Mesh::publishData(const filesystem::path &filename, const Transform &trafo) const {
+    SharedMeshData data;
+    data.storage = m_storage;
+    data.vertexCount = m_vertexCount;
+    data.triangleCount = (uint32_t) m_F.cols();
+    data.V = m_V.size() > 0 ? m_V.data() : nullptr;
+    data.N = m_N.size() > 0 ? m_N.data() : nullptr;
+    data.UV = m_UV.size() > 0 ? m_UV.data() : nullptr;
+    data.F = m_F.data();
+    data.quantizedV = m_quantizedV;
+    data.quantizedN = m_quantizedN;
+    data.quantizedUV = m_quantizedUV;
+    data.positionOffset = m_positionOffset;
+    data.positionScale = m_positionScale;
+    data.bbox = m_bbox;
+
+    std::string key = sharedMeshKey(filename, trafo, m_quantizeAttributes, m_quantizePositions);
+    std::lock_guard<std::mutex> guard(sharedMeshDataMutex);
+    sharedMeshData[key] = data;
+}
+
+Normal3f Mesh::getVertexNormal(uint32_t index) const {
+    if (m_quantizedN)
+        return decodeOctahedral(m_quantizedN + 2 * (size_t) index);
+    return m_N.col(index);
+}
+
+Point2f Mesh::getVertexTexCoord(uint32_t index) const {
+    if (m_quantizedUV)
+        return Point2f(halfToFloat(m_quantizedUV[2 * (size_t) index]),
+                       halfToFloat(m_quantizedUV[2 * (size_t) index + 1]));
+    return m_UV.col(index);
+}
+
+size_t Mesh::getDataSize() const {
+    size_t size = sizeof(uint32_t) * m_F.size() +
+                  sizeof(float) * (m_V.size() + m_N.size() + m_UV.size());
+    if (m_quantizedV)
+        size += sizeof(uint64_t) * m_vertexCount;
+    if (m_quantizedN)
+        size += 2 * sizeof(uint16_t) * m_vertexCount;
+    if (m_quantizedUV)
+        size += 2 * sizeof(uint16_t) * m_vertexCount;
+    return size;
+}
+
+void Mesh::setVertexPositions(const MatrixXf &V, const MatrixXf &N) {
+    uint32_t vertexCount = getVertexCount();
+    if (V.rows() != 3 || V.cols() != vertexCount)
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertex positions!", vertexCount);
+    if (N.size() > 0 && (N.rows() != 3 || N.cols() != vertexCount))
+        throw NoriException("Mesh::setVertexPositions(): expected %i vertex normals!", vertexCount);
+
+    /* The data may be shared with other meshes or mapped from a file,
+       hence it is copied (and decoded, if quantized) along with the new
+       positions */
+    MatrixXf normals = N, texcoords;
+    if (N.size() == 0 && hasVertexNormals()) {
+        normals.resize(3, vertexCount);
+        for (uint32_t i = 0; i < vertexCount; ++i)
+            normals.col(i) = getVertexNormal(i);
+    }
+    if (hasVertexTexCoords()) {
+        texcoords.resize(2, vertexCount);
+        for (uint32_t i = 0; i < vertexCount; ++i)
+            texcoords.col(i) = getVertexTexCoord(i);
+    }
+    setData(V, m_F, std::move(normals), std::move(texcoords));
+
+    m_bbox.reset();
+    for (uint32_t i = 0; i < vertexCount; ++i)
+        m_bbox.expandBy(getVertexPosition(i));
+
+    /* The triangle areas have changed as well */
+    m_pdf.clear();
+    m_pdf.reserve(getPrimitiveCount());
+    for (uint32_t i = 0; i < getPrimitiveCount(); ++i)
+        m_pdf.append(surfaceArea(i));
+    m_pdf.normalize();
+}
+
 void Mesh::sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const {
     Point2f s = sample;
     size_t idT = m_pdf.sampleReuse(s.x());
@@ -44,13 +423,13 @@ void Mesh::sampleSurface(ShapeQueryRecord & sRec, const Point2f & sample) const
     Vector3f bc = Warp::squareToUniformTriangle(s);
 
     sRec.p = getInterpolatedVertex(idT,bc);
-    if (m_N.size() > 0) {
+    if (hasVertexNormals()) {
         sRec.n = getInterpolatedNormal(idT, bc);
     }
     else {
-        Point3f p0 = m_V.col(m_F(0, idT));
-        Point3f p1 = m_V.col(m_F(1, idT));
-        Point3f p2 = m_V.col(m_F(2, idT));
+        Point3f p0 = getVertexPosition(m_F(0, idT));
+        Point3f p1 = getVertexPosition(m_F(1, idT));
+        Point3f p2 = getVertexPosition(m_F(2, idT));
         Normal3f n = (p1-p0).cross(p2-p0).normalized();
         sRec.n = n;
     }
@@ -61,62 +440,35 @@ float Mesh::pdfSurface(const ShapeQueryRecord & sRec) const {
 }
 
 Point3f Mesh::getInterpolatedVertex(uint32_t index, const Vector3f &bc) const {
-    return (bc.x() * m_V.col(m_F(0, index)) +
-            bc.y() * m_V.col(m_F(1, index)) +
-            bc.z() * m_V.col(m_F(2, index)));
+    return (bc.x() * getVertexPosition(m_F(0, index)) +
+            bc.y() * getVertexPosition(m_F(1, index)) +
+            bc.z() * getVertexPosition(m_F(2, index)));
 }
 
 Normal3f Mesh::getInterpolatedNormal(uint32_t index, const Vector3f &bc) const {
-    return (bc.x() * m_N.col(m_F(0, index)) +
-            bc.y() * m_N.col(m_F(1, index)) +
-            bc.z() * m_N.col(m_F(2, index))).normalized();
+    return (bc.x() * getVertexNormal(m_F(0, index)) +
+            bc.y() * getVertexNormal(m_F(1, index)) +
+            bc.z() * getVertexNormal(m_F(2, index))).normalized();
 }
 
 float Mesh::surfaceArea(uint32_t index) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
 
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const Point3f p0 = getVertexPosition(i0), p1 = getVertexPosition(i1),
+                  p2 = getVertexPosition(i2);
 
     return 0.5f * Vector3f((p1 - p0).cross(p2 - p0)).norm();
 }
 
 bool Mesh::rayIntersect(uint32_t index, const Ray3f &ray, float &u, float &v, float &t) const {
     uint32_t i0 = m_F(0, index), i1 = m_F(1, index), i2 = m_F(2, index);
-    const Point3f p0 = m_V.col(i0), p1 = m_V.col(i1), p2 = m_V.col(i2);
+    const Point3f p0 = getVertexPosition(i0), p1 = getVertexPosition(i1),
+                  p2 = getVertexPosition(i2);
 
     /* Find vectors for two edges sharing v[0] */
     Vector3f edge1 = p1 - p0, edge2 = p2 - p0;
 
-    /* Begin calculating determinant - also used to calculate U parameter */
-    Vector3f pvec = ray.d.cross(edge2);
-
-    /* If determinant is near zero, ray lies in plane of triangle */
-    float det = edge1.dot(pvec);
-
-    if (det > -1e-8f && det < 1e-8f)
-        return false;
-    float inv_det = 1.0f / det;
-
-    /* Calculate distance from v[0] to ray origin */
-    Vector3f tvec = ray.o - p0;
-
-    /* Calculate U parameter and test bounds */
-    u = tvec.dot(pvec) * inv_det;
-    if (u < 0.0 || u > 1.0)
-        return false;
-
-    /* Prepare to test V parameter */
-    Vector3f qvec = tvec.cross(edge1);
-
-    /* Calculate V parameter and test bounds */
-    v = ray.d.dot(qvec) * inv_det;
-    if (v < 0.0 || u + v > 1.0)
-        return false;
-
-    /* Ray intersects triangle -> compute t */
-    t = edge2.dot(qvec) * inv_det;
-
-    return t >= ray.mint && t <= ray.maxt;
+    return rayIntersectTriangle(p0, edge1, edge2, ray, u, v, t);
 }
 
 void Mesh::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & its) const {
@@ -127,22 +479,22 @@ void Mesh::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & it
     /* Vertex indices of the triangle */
     uint32_t idx0 = m_F(0, index), idx1 = m_F(1, index), idx2 = m_F(2, index);
 
-    Point3f p0 = m_V.col(idx0), p1 = m_V.col(idx1), p2 = m_V.col(idx2);
+    Point3f p0 = getVertexPosition(idx0), p1 = getVertexPosition(idx1), p2 = getVertexPosition(idx2);
 
     /* Compute the intersection positon accurately
        using barycentric coordinates */
     its.p = bary.x() * p0 + bary.y() * p1 + bary.z() * p2;
 
     /* Compute proper texture coordinates if provided by the mesh */
-    if (m_UV.size() > 0)
-        its.uv = bary.x() * m_UV.col(idx0) +
-                 bary.y() * m_UV.col(idx1) +
-                 bary.z() * m_UV.col(idx2);
+    if (hasVertexTexCoords())
+        its.uv = bary.x() * getVertexTexCoord(idx0) +
+                 bary.y() * getVertexTexCoord(idx1) +
+                 bary.z() * getVertexTexCoord(idx2);
 
     /* Compute the geometry frame */
     its.geoFrame = Frame((p1-p0).cross(p2-p0).normalized());
 
-    if (m_N.size() > 0) {
+    if (hasVertexNormals()) {
         /* Compute the shading frame. Note that for simplicity,
            the current implementation doesn't attempt to provide
            tangents that are continuous across the surface. That
@@ -150,26 +502,26 @@ void Mesh::setHitInformation(uint32_t index, const Ray3f &ray, Intersection & it
            use anisotropic BRDFs, which need tangent continuity */
 
         its.shFrame = Frame(
-                (bary.x() * m_N.col(idx0) +
-                 bary.y() * m_N.col(idx1) +
-                 bary.z() * m_N.col(idx2)).normalized());
+                (bary.x() * getVertexNormal(idx0) +
+                 bary.y() * getVertexNormal(idx1) +
+                 bary.z() * getVertexNormal(idx2)).normalized());
     } else {
         its.shFrame = its.geoFrame;
     }
 }
 
 BoundingBox3f Mesh::getBoundingBox(uint32_t index) const {
-    BoundingBox3f result(m_V.col(m_F(0, index)));
-    result.expandBy(m_V.col(m_F(1, index)));
-    result.expandBy(m_V.col(m_F(2, index)));
+    BoundingBox3f result(getVertexPosition(m_F(0, index)));
+    result.expandBy(getVertexPosition(m_F(1, index)));
+    result.expandBy(getVertexPosition(m_F(2, index)));
     return result;
 }
 
 Point3f Mesh::getCentroid(uint32_t index) const {
     return (1.0f / 3.0f) *
-        (m_V.col(m_F(0, index)) +
-         m_V.col(m_F(1, index)) +
-         m_V.col(m_F(2, index)));
+        (getVertexPosition(m_F(0, index)) +
+         getVertexPosition(m_F(1, index)) +
+         getVertexPosition(m_F(2, index)));
 }
 
 
@@ -183,7 +535,7 @@ std::string Mesh::toString() const {
         "  emitter = %s\n"
         "]",
         m_name,
-        m_V.cols(),
+        m_vertexCount,
         m_F.cols(),
         m_bsdf ? indent(m_bsdf->toString()) : std::string("null"),
         m_emitter ? indent(m_emitter->toString()) : std::string("null")
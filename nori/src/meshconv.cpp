@@ -0,0 +1,58 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/nmesh.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <memory>
+
+/**
+ * Mesh converter: loads a mesh with the plugin that matches its file
+ * extension (see \ref Mesh::load()) and stores it in Nori's binary mesh
+ * format, which the \c nmesh shape maps into memory without parsing.
+ */
+
+int main(int argc, char **argv) {
+    using namespace nori;
+
+    if (argc != 3) {
+        std::cerr << "Syntax: " << argv[0] << " <input mesh> <output.nmesh>" << std::endl
+                  << "Converts a mesh (e.g. a Wavefront OBJ file) into Nori's binary mesh format." << std::endl;
+        return 1;
+    }
+
+    try {
+        /* Resolve the input relative to its directory (which also works for absolute paths) */
+        std::string input(argv[1]);
+        getFileResolver()->prepend(filesystem::path(input).parent_path());
+        PropertyList propList;
+        propList.setString("filename", input.substr(input.find_last_of("/\\") + 1));
+        std::unique_ptr<Mesh> mesh(Mesh::load(propList));
+
+        cout << "Writing \"" << argv[2] << "\" .. ";
+        cout.flush();
+        Timer timer;
+        NMesh::write(*mesh, argv[2]);
+        cout << "done. (took " << timer.elapsedString() << ")" << endl;
+    } catch (const std::exception &e) {
+        cerr << "Fatal error: " << e.what() << endl;
+        return 2;
+    }
+
+    return 0;
+}
@@ -0,0 +1,192 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob, Romain Prévost
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/nmesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/tbb.h>
+#include <fstream>
+
+NORI_NAMESPACE_BEGIN
+
+const uint32_t NMesh::VERSION;
+
+/// Arrays of a \c .nmesh file start at multiples of this many bytes
+static const uint64_t NMESH_ALIGNMENT = 64;
+
+/// Round an offset up to the alignment of the arrays
+static uint64_t alignOffset(uint64_t offset) {
+    return (offset + NMESH_ALIGNMENT - 1) / NMESH_ALIGNMENT * NMESH_ALIGNMENT;
+}
+
+NMesh::NMesh(const PropertyList &propList) : Mesh(propList) {
+    filesystem::path filename =
+        getFileResolver()->resolve(propList.getString("filename"));
+    Transform trafo = propList.getTransform("toWorld", Transform());
+    if (shareData(filename, trafo))
+        return;
+
+    cout << "Loading \"" << filename << "\" .. ";
+    cout.flush();
+    Timer timer;
+
+    std::shared_ptr<MemoryMappedFile> file = std::make_shared<MemoryMappedFile>(filename.str());
+    Header header;
+    if (file->size() < sizeof(Header))
+        throw NoriException("\"%s\" is not a valid mesh file!", filename);
+    memcpy(&header, file->data(), sizeof(Header));
+    if (memcmp(header.magic, "NMSH", 4) != 0)
+        throw NoriException("\"%s\" is not a valid mesh file!", filename);
+    if (header.version != VERSION)
+        throw NoriException("\"%s\" uses the unsupported mesh file version %i (expected %i)!",
+                            filename, header.version, VERSION);
+
+    /* Validate the location of every array before pointing at it */
+    uint64_t vertexCount = header.vertexCount, triangleCount = header.triangleCount;
+    auto getArray = [&](uint64_t offset, uint64_t size, bool required) -> const uint8_t * {
+        if (offset == 0 && !required)
+            return nullptr;
+        if (offset < sizeof(Header) || offset % NMESH_ALIGNMENT != 0 ||
+            offset > file->size() || size > file->size() - offset)
+            throw NoriException("\"%s\" is truncated or corrupted!", filename);
+        return file->data() + offset;
+    };
+    const float *V = (const float *) getArray(header.positions, 3 * sizeof(float) * vertexCount, true);
+    const float *N = (const float *) getArray(header.normals, 3 * sizeof(float) * vertexCount, false);
+    const float *UV = (const float *) getArray(header.texcoords, 2 * sizeof(float) * vertexCount, false);
+    const uint32_t *F = (const uint32_t *) getArray(header.indices, 3 * sizeof(uint32_t) * triangleCount, true);
+
+    /* Out-of-range indices would make any access to the mesh unsafe */
+    bool valid = tbb::parallel_reduce(
+        tbb::blocked_range<uint64_t>(0u, 3 * triangleCount, 1u << 16), true,
+        [&](const tbb::blocked_range<uint64_t> &range, bool result) {
+            for (uint64_t i = range.begin(); i != range.end(); ++i)
+                result &= F[i] < vertexCount;
+            return result;
+        },
+        [](bool a, bool b) { return a && b; }
+    );
+    if (!valid)
+        throw NoriException("\"%s\" contains out-of-range vertex indices!", filename);
+
+    bool mapped = trafo.getMatrix().isIdentity(0.f);
+    if (mapped) {
+        /* Point the mesh directly at the file contents */
+        m_bbox = BoundingBox3f(Point3f(header.bbox[0], header.bbox[1], header.bbox[2]),
+                               Point3f(header.bbox[3], header.bbox[4], header.bbox[5]));
+        setData(file, header.vertexCount, header.triangleCount, V, F, N, UV);
+    } else {
+        MatrixXf positions(3, vertexCount), normals;
+        if (N)
+            normals.resize(3, vertexCount);
+        m_bbox = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, header.vertexCount, 1u << 12), BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    Point3f p = trafo * Point3f(V[3 * i], V[3 * i + 1], V[3 * i + 2]);
+                    positions.col(i) = p;
+                    result.expandBy(p);
+                    if (N)
+                        normals.col(i) = (trafo * Normal3f(N[3 * i], N[3 * i + 1], N[3 * i + 2])).normalized();
+                }
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+        setData(std::move(positions), MatrixXuView(F, 3, triangleCount), std::move(normals),
+                UV ? MatrixXf(MatrixXfView(UV, 2, vertexCount)) : MatrixXf());
+    }
+
+    m_name = filename.str();
+    publishData(filename, trafo);
+    cout << "done. (V=" << getVertexCount() << ", F=" << m_F.cols() << ", took "
+         << timer.elapsedString() << " and " << memString(getDataSize())
+         << (m_storage == file ? " memory-mapped" : "") << ")" << endl;
+}
+
+void NMesh::write(const Mesh &mesh, const std::string &filename) {
+    /* Quantized attributes are stored at full precision */
+    uint32_t vertexCount = mesh.getVertexCount();
+    MatrixXf V = mesh.getVertexPositions(), N = mesh.getVertexNormals(),
+             UV = mesh.getVertexTexCoords();
+    if (V.cols() != vertexCount) {
+        V.resize(3, vertexCount);
+        for (uint32_t i = 0; i < vertexCount; ++i)
+            V.col(i) = mesh.getVertexPosition(i);
+    }
+    if (mesh.hasVertexNormals() && N.cols() != vertexCount) {
+        N.resize(3, vertexCount);
+        for (uint32_t i = 0; i < vertexCount; ++i)
+            N.col(i) = mesh.getVertexNormal(i);
+    }
+    if (mesh.hasVertexTexCoords() && UV.cols() != vertexCount) {
+        UV.resize(2, vertexCount);
+        for (uint32_t i = 0; i < vertexCount; ++i)
+            UV.col(i) = mesh.getVertexTexCoord(i);
+    }
+    const MatrixXuView &F = mesh.getIndices();
+    const BoundingBox3f &bbox = static_cast<const Shape &>(mesh).getBoundingBox();
+
+    Header header;
+    memset(&header, 0, sizeof(Header));
+    memcpy(header.magic, "NMSH", 4);
+    header.version = VERSION;
+    header.vertexCount = vertexCount;
+    header.triangleCount = (uint32_t) F.cols();
+    for (int i = 0; i < 3; ++i) {
+        header.bbox[i] = bbox.min[i];
+        header.bbox[i + 3] = bbox.max[i];
+    }
+
+    /* Lay out the arrays, each starting at an aligned offset */
+    const void *arrays[4] = { V.data(), N.size() > 0 ? N.data() : nullptr,
+                              UV.size() > 0 ? UV.data() : nullptr, F.data() };
+    size_t sizes[4] = { sizeof(float) * V.size(), sizeof(float) * N.size(),
+                        sizeof(float) * UV.size(), sizeof(uint32_t) * F.size() };
+    uint64_t *offsets[4] = { &header.positions, &header.normals, &header.texcoords, &header.indices };
+    uint64_t offset = sizeof(Header);
+    for (int i = 0; i < 4; ++i) {
+        if (!arrays[i] && i != 0 && i != 3)
+            continue;
+        offset = alignOffset(offset);
+        *offsets[i] = offset;
+        offset += sizes[i];
+    }
+
+    std::ofstream os(filename, std::ios::binary);
+    if (os.fail())
+        throw NoriException("Unable to create the mesh file \"%s\"!", filename);
+    os.write((const char *) &header, sizeof(Header));
+    uint64_t position = sizeof(Header);
+    const char padding[NMESH_ALIGNMENT] = { };
+    for (int i = 0; i < 4; ++i) {
+        if (*offsets[i] == 0)
+            continue;
+        os.write(padding, (std::streamsize) (*offsets[i] - position));
+        os.write((const char *) arrays[i], (std::streamsize) sizes[i]);
+        position = *offsets[i] + sizes[i];
+    }
+    if (!os)
+        throw NoriException("Could not write the mesh file \"%s\"!", filename);
+}
+
+NORI_REGISTER_CLASS(NMesh, "nmesh");
+NORI_NAMESPACE_END
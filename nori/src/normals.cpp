@@ -12,12 +12,18 @@ public:
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const {
         /* Find the surface that is visible in the requested direction */
         Intersection its;
-        if (!scene->rayIntersect(ray, its))
+        bool hit = scene->rayIntersect(ray, its);
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+               const Intersection *its) const {
+        if (!its)
             return Color3f(0.0f);
 
         /* Return the component-wise absolute
            value of the shading normal as a color */
-        Normal3f n = its.shFrame.n.cwiseAbs();
+        Normal3f n = its->shFrame.n.cwiseAbs();
         return Color3f(n.x(), n.y(), n.z());
     }
 
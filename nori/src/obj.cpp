@@ -17,142 +17,305 @@
 */
 
 #include <nori/mesh.h>
+#include <nori/mmap.h>
 #include <nori/timer.h>
 #include <filesystem/resolver.h>
-#include <unordered_map>
-#include <fstream>
+#include <tbb/tbb.h>
+#include <cfloat>
 
 NORI_NAMESPACE_BEGIN
 
+/// Size of the pieces of an OBJ file that are parsed in parallel
+static const size_t OBJ_CHUNK_SIZE = 1 << 20;
+
+/// Exactly representable powers of ten
+static const double OBJ_POWERS_OF_TEN[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static inline bool isDigit(char c) { return c >= '0' && c <= '9'; }
+static inline bool isBlank(char c) { return c == ' ' || c == '\t'; }
+static inline bool isSeparator(char c) { return isBlank(c) || c == '\r' || c == '\n'; }
+
+/// Skip spaces and tabs
+static inline const char *skipBlanks(const char *ptr, const char *end) {
+    while (ptr != end && isBlank(*ptr))
+        ++ptr;
+    return ptr;
+}
+
+/**
+ * \brief Parse a decimal floating point number
+ *
+ * Numbers with up to 19 significant digits and a small exponent are
+ * converted with a single correctly rounded division or multiplication
+ * in double precision, which yields the same value as \c strtof() unless
+ * the result falls exactly halfway between two floats. Those (and all
+ * other) cases are left to \c strtof(), so the result always matches
+ * what <tt>std::istream</tt> would produce.
+ *
+ * \return A pointer past the number, or \c nullptr if the text at \c ptr
+ *         is not a number followed by whitespace
+ */
+static const char *parseFloat(const char *ptr, const char *end, float &result) {
+    const char *start = ptr;
+    bool negative = false;
+    if (ptr != end && (*ptr == '-' || *ptr == '+'))
+        negative = *ptr++ == '-';
+
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    bool valid = false;
+    for (; ptr != end && isDigit(*ptr); ++ptr, valid = true) {
+        mantissa = mantissa * 10 + (uint64_t) (*ptr - '0');
+        digits += mantissa != 0;
+    }
+    if (ptr != end && *ptr == '.') {
+        for (++ptr; ptr != end && isDigit(*ptr); ++ptr, valid = true) {
+            mantissa = mantissa * 10 + (uint64_t) (*ptr - '0');
+            digits += mantissa != 0;
+            exponent--;
+        }
+    }
+    if (!valid)
+        return nullptr;
+    if (ptr != end && (*ptr == 'e' || *ptr == 'E')) {
+        const char *exp = ptr + 1;
+        bool expNegative = false;
+        if (exp != end && (*exp == '-' || *exp == '+'))
+            expNegative = *exp++ == '-';
+        if (exp == end || !isDigit(*exp))
+            return nullptr;
+        int value = 0;
+        for (; exp != end && isDigit(*exp); ++exp)
+            value = std::min(value * 10 + (*exp - '0'), 1000);
+        exponent += expNegative ? -value : value;
+        ptr = exp;
+    }
+    if (ptr != end && !isSeparator(*ptr))
+        return nullptr;
+
+    if (digits <= 19 && mantissa < (1ull << 53) && exponent >= -22 && exponent <= 22) {
+        double value = (double) mantissa;
+        value = exponent < 0 ? value / OBJ_POWERS_OF_TEN[-exponent]
+                             : value * OBJ_POWERS_OF_TEN[exponent];
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(double));
+        /* Rounding to float a second time is only ambiguous at midpoints */
+        if (mantissa == 0 || (value >= FLT_MIN && value <= FLT_MAX &&
+                              (bits & 0x1FFFFFFFu) != 0x10000000u)) {
+            result = negative ? -(float) value : (float) value;
+            return ptr;
+        }
+    }
+
+    std::string str(start, ptr);
+    char *strEnd = nullptr;
+    result = strtof(str.c_str(), &strEnd);
+    return *strEnd == '\0' ? ptr : nullptr;
+}
+
+/// Parse an unsigned decimal integer (returns \c nullptr if there are no digits)
+static const char *parseUInt(const char *ptr, const char *end, uint32_t &result) {
+    if (ptr == end || !isDigit(*ptr))
+        return nullptr;
+    uint64_t value = 0;
+    for (; ptr != end && isDigit(*ptr); ++ptr)
+        value = std::min(value * 10 + (uint64_t) (*ptr - '0'), (uint64_t) 0xFFFFFFFFu);
+    result = (uint32_t) value;
+    return ptr;
+}
+
 /**
  * \brief Loader for Wavefront OBJ triangle meshes
+ *
+ * The file is mapped into memory and split into line-aligned chunks that
+ * are parsed in parallel. Afterwards, the corners of all faces are grouped
+ * by their position index (a counting sort), which makes it cheap to find
+ * the first occurrence of every distinct position/texcoord/normal triplet.
+ * Vertices are numbered in the order of these first occurrences, i.e. the
+ * resulting mesh is the same as that of a sequential parser that looks up
+ * every corner in a hash table.
  */
 class WavefrontOBJ : public Mesh {
 public:
-    WavefrontOBJ(const PropertyList &propList) {
-        typedef std::unordered_map<OBJVertex, uint32_t, OBJVertexHash> VertexMap;
-
+    WavefrontOBJ(const PropertyList &propList) : Mesh(propList) {
         filesystem::path filename =
             getFileResolver()->resolve(propList.getString("filename"));
-
-        std::ifstream is(filename.str());
-        if (is.fail())
-            throw NoriException("Unable to open OBJ file \"%s\"!", filename);
         Transform trafo = propList.getTransform("toWorld", Transform());
+        if (shareData(filename, trafo))
+            return;
 
         cout << "Loading \"" << filename << "\" .. ";
         cout.flush();
         Timer timer;
 
-        std::vector<Vector3f>   positions;
-        std::vector<Vector2f>   texcoords;
-        std::vector<Vector3f>   normals;
-        std::vector<uint32_t>   indices;
-        std::vector<OBJVertex>  vertices;
-        VertexMap vertexMap;
-
-        std::string line_str;
-        while (std::getline(is, line_str)) {
-            std::istringstream line(line_str);
-
-            std::string prefix;
-            line >> prefix;
-
-            if (prefix == "v") {
-                Point3f p;
-                line >> p.x() >> p.y() >> p.z();
-                p = trafo * p;
-                m_bbox.expandBy(p);
-                positions.push_back(p);
-            } else if (prefix == "vt") {
-                Point2f tc;
-                line >> tc.x() >> tc.y();
-                texcoords.push_back(tc);
-            } else if (prefix == "vn") {
-                Normal3f n;
-                line >> n.x() >> n.y() >> n.z();
-                normals.push_back((trafo * n).normalized());
-            } else if (prefix == "f") {
-                std::string v1, v2, v3, v4;
-                line >> v1 >> v2 >> v3 >> v4;
-                OBJVertex verts[6];
-                int nVertices = 3;
-
-                verts[0] = OBJVertex(v1);
-                verts[1] = OBJVertex(v2);
-                verts[2] = OBJVertex(v3);
-
-                if (!v4.empty()) {
-                    /* This is a quad, split into two triangles */
-                    verts[3] = OBJVertex(v4);
-                    verts[4] = verts[0];
-                    verts[5] = verts[2];
-                    nVertices = 6;
+        MemoryMappedFile file(filename.str());
+        const char *data = (const char *) file.data();
+        size_t size = file.size();
+
+        /* Chunk i starts after the first line break at or past offset
+           i * OBJ_CHUNK_SIZE - 1, so that no line is split */
+        std::vector<Chunk> chunks((size + OBJ_CHUNK_SIZE - 1) / OBJ_CHUNK_SIZE);
+        auto chunkStart = [&](size_t i) -> const char * {
+            if (i == 0)
+                return data;
+            if (i >= chunks.size())
+                return data + size;
+            const char *ptr = data + i * OBJ_CHUNK_SIZE - 1;
+            ptr = (const char *) memchr(ptr, '\n', (size_t) (data + size - ptr));
+            return ptr ? ptr + 1 : data + size;
+        };
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            const char *start = chunkStart(i);
+            chunks[i].parse(start, std::max(start, chunkStart(i + 1)), trafo);
+        });
+
+        /* Concatenate the per-chunk arrays */
+        size_t positionCount = 0, texcoordCount = 0, normalCount = 0, cornerCount = 0;
+        for (Chunk &chunk : chunks) {
+            if (!chunk.error.empty())
+                throw NoriException("Could not parse the line \"%s\" of OBJ file \"%s\"!",
+                                    chunk.error, filename);
+            chunk.positionOffset = positionCount;
+            chunk.texcoordOffset = texcoordCount;
+            chunk.normalOffset = normalCount;
+            chunk.cornerOffset = cornerCount;
+            positionCount += chunk.positions.size();
+            texcoordCount += chunk.texcoords.size();
+            normalCount += chunk.normals.size();
+            cornerCount += chunk.corners.size();
+            m_bbox.expandBy(chunk.bbox);
+        }
+        if (cornerCount > (size_t) std::numeric_limits<uint32_t>::max())
+            throw NoriException("OBJ file \"%s\" has too many faces!", filename);
+
+        std::vector<Vector3f> positions(positionCount);
+        std::vector<Vector2f> texcoords(texcoordCount);
+        std::vector<Vector3f> normals(normalCount);
+        std::vector<OBJVertex> corners(cornerCount);
+        tbb::parallel_for(size_t(0), chunks.size(), [&](size_t i) {
+            Chunk &chunk = chunks[i];
+            std::copy(chunk.positions.begin(), chunk.positions.end(),
+                      positions.begin() + chunk.positionOffset);
+            std::copy(chunk.texcoords.begin(), chunk.texcoords.end(),
+                      texcoords.begin() + chunk.texcoordOffset);
+            std::copy(chunk.normals.begin(), chunk.normals.end(),
+                      normals.begin() + chunk.normalOffset);
+            std::copy(chunk.corners.begin(), chunk.corners.end(),
+                      corners.begin() + chunk.cornerOffset);
+            chunk = Chunk();
+        });
+        chunks.clear();
+
+        uint32_t count = (uint32_t) cornerCount;
+        bool valid = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, count, 1u << 16), true,
+            [&](const tbb::blocked_range<uint32_t> &range, bool result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    const OBJVertex &v = corners[i];
+                    result &= (size_t) (v.p - 1) < positionCount &&
+                        (texcoords.empty() || (size_t) (v.uv - 1) < texcoordCount) &&
+                        (normals.empty() || (size_t) (v.n - 1) < normalCount);
                 }
-                /* Convert to an indexed vertex list */
-                for (int i=0; i<nVertices; ++i) {
-                    const OBJVertex &v = verts[i];
-                    VertexMap::const_iterator it = vertexMap.find(v);
-                    if (it == vertexMap.end()) {
-                        vertexMap[v] = (uint32_t) vertices.size();
-                        indices.push_back((uint32_t) vertices.size());
-                        vertices.push_back(v);
-                    } else {
-                        indices.push_back(it->second);
+                return result;
+            },
+            [](bool a, bool b) { return a && b; }
+        );
+        if (!valid)
+            throw NoriException("OBJ file \"%s\" contains out-of-range vertex indices!", filename);
+
+        /* Sort the corners by position index. 'bucketEnd[i]' ends up
+           pointing past the corners that reference position i + 1 */
+        std::vector<uint32_t> bucketEnd(positionCount + 1, 0), order(count);
+        for (const OBJVertex &v : corners)
+            bucketEnd[v.p]++;
+        for (size_t i = 1; i <= positionCount; ++i)
+            bucketEnd[i] += bucketEnd[i - 1];
+        for (uint32_t i = 0; i < count; ++i)
+            order[bucketEnd[corners[i].p - 1]++] = i;
+
+        /* Within each bucket, the corners are in file order. Link every
+           corner to the first one with the same indices */
+        std::vector<uint32_t> first(count);
+        tbb::parallel_for(tbb::blocked_range<size_t>(0, positionCount, 1u << 12),
+            [&](const tbb::blocked_range<size_t> &range) {
+                for (size_t bucket = range.begin(); bucket != range.end(); ++bucket) {
+                    uint32_t begin = bucket == 0 ? 0 : bucketEnd[bucket - 1], end = bucketEnd[bucket];
+                    for (uint32_t i = begin; i != end; ++i) {
+                        uint32_t corner = order[i];
+                        first[corner] = corner;
+                        for (uint32_t j = begin; j != i; ++j) {
+                            uint32_t other = order[j];
+                            if (first[other] == other && corners[other] == corners[corner]) {
+                                first[corner] = other;
+                                break;
+                            }
+                        }
                     }
                 }
             }
-        }
-
-        m_F.resize(3, indices.size()/3);
-        memcpy(m_F.data(), indices.data(), sizeof(uint32_t)*indices.size());
+        );
+        bucketEnd = std::vector<uint32_t>();
 
-        m_V.resize(3, vertices.size());
-        for (uint32_t i=0; i<vertices.size(); ++i)
-            m_V.col(i) = positions.at(vertices[i].p-1);
-
-        if (!normals.empty()) {
-            m_N.resize(3, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_N.col(i) = normals.at(vertices[i].n-1);
+        /* Number the vertices in the order of their first occurrence */
+        std::vector<uint32_t> vertexIndex = std::move(order);
+        uint32_t vertexCount = 0;
+        for (uint32_t i = 0; i < count; ++i) {
+            if (first[i] == i)
+                vertexIndex[i] = vertexCount++;
         }
 
-        if (!texcoords.empty()) {
-            m_UV.resize(2, vertices.size());
-            for (uint32_t i=0; i<vertices.size(); ++i)
-                m_UV.col(i) = texcoords.at(vertices[i].uv-1);
-        }
+        MatrixXu F(3, count / 3);
+        MatrixXf V(3, vertexCount), N, UV;
+        if (!normals.empty())
+            N.resize(3, vertexCount);
+        if (!texcoords.empty())
+            UV.resize(2, vertexCount);
+        tbb::parallel_for(tbb::blocked_range<uint32_t>(0u, count, 1u << 16),
+            [&](const tbb::blocked_range<uint32_t> &range) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    F.data()[i] = vertexIndex[first[i]];
+                    if (first[i] != i)
+                        continue;
+                    const OBJVertex &v = corners[i];
+                    uint32_t index = vertexIndex[i];
+                    V.col(index) = positions[v.p - 1];
+                    if (N.size() > 0)
+                        N.col(index) = normals[v.n - 1];
+                    if (UV.size() > 0)
+                        UV.col(index) = texcoords[v.uv - 1];
+                }
+            }
+        );
+
+        setData(std::move(V), std::move(F), std::move(N), std::move(UV));
 
         m_name = filename.str();
-        cout << "done. (V=" << m_V.cols() << ", F=" << m_F.cols() << ", took "
-             << timer.elapsedString() << " and "
-             << memString(m_F.size() * sizeof(uint32_t) +
-                          sizeof(float) * (m_V.size() + m_N.size() + m_UV.size()))
-             << ")" << endl;
+        publishData(filename, trafo);
+        cout << "done. (V=" << getVertexCount() << ", F=" << m_F.cols() << ", took "
+             << timer.elapsedString() << " and " << memString(getDataSize()) << ")" << endl;
     }
 
 protected:
-    /// Vertex indices used by the OBJ format
+    /// Vertex indices used by the OBJ format (1-based)
     struct OBJVertex {
         uint32_t p = (uint32_t) -1;
         uint32_t n = (uint32_t) -1;
         uint32_t uv = (uint32_t) -1;
 
-        inline OBJVertex() { }
-
-        inline OBJVertex(const std::string &string) {
-            std::vector<std::string> tokens = tokenize(string, "/", true);
-
-            if (tokens.size() < 1 || tokens.size() > 3)
-                throw NoriException("Invalid vertex data: \"%s\"", string);
-
-            p = toUInt(tokens[0]);
-
-            if (tokens.size() >= 2 && !tokens[1].empty())
-                uv = toUInt(tokens[1]);
-
-            if (tokens.size() >= 3 && !tokens[2].empty())
-                n = toUInt(tokens[2]);
+        /// Parse a face vertex of the form p, p/uv, p//n or p/uv/n
+        const char *parse(const char *ptr, const char *end) {
+            if (!(ptr = parseUInt(ptr, end, p)))
+                return nullptr;
+            if (ptr != end && *ptr == '/') {
+                if (++ptr != end && isDigit(*ptr))
+                    ptr = parseUInt(ptr, end, uv);
+                if (ptr != end && *ptr == '/' && ++ptr != end && isDigit(*ptr))
+                    ptr = parseUInt(ptr, end, n);
+            }
+            return ptr == end || isSeparator(*ptr) ? ptr : nullptr;
         }
 
         inline bool operator==(const OBJVertex &v) const {
@@ -160,13 +323,82 @@ protected:
         }
     };
 
-    /// Hash function for OBJVertex
-    struct OBJVertexHash : std::unary_function<OBJVertex, size_t> {
-        std::size_t operator()(const OBJVertex &v) const {
-            size_t hash = std::hash<uint32_t>()(v.p);
-            hash = hash * 37 + std::hash<uint32_t>()(v.uv);
-            hash = hash * 37 + std::hash<uint32_t>()(v.n);
-            return hash;
+    /// Contents of a line-aligned piece of an OBJ file
+    struct Chunk {
+        std::vector<Vector3f> positions;
+        std::vector<Vector2f> texcoords;
+        std::vector<Vector3f> normals;
+        std::vector<OBJVertex> corners; ///< Three per triangle
+        BoundingBox3f bbox;
+        size_t positionOffset = 0, texcoordOffset = 0, normalOffset = 0, cornerOffset = 0;
+        std::string error;              ///< The first line that could not be parsed
+
+        /// Parse the lines in [ptr, end), which must end with a line break or at the end of the file
+        void parse(const char *ptr, const char *end, const Transform &trafo) {
+            while (ptr != end) {
+                const char *line = ptr;
+                const char *lineEnd = (const char *) memchr(ptr, '\n', (size_t) (end - ptr));
+                if (!lineEnd)
+                    lineEnd = end;
+                ptr = lineEnd == end ? end : lineEnd + 1;
+
+                const char *cur = skipBlanks(line, lineEnd), *prefix = cur;
+                while (cur != lineEnd && !isSeparator(*cur))
+                    ++cur;
+                char type[3] = { };
+                if (cur - prefix <= 2)
+                    memcpy(type, prefix, (size_t) (cur - prefix));
+
+                bool valid = true;
+                if (!strcmp(type, "v")) {
+                    Point3f p;
+                    for (int i = 0; i < 3 && valid; ++i)
+                        valid = (cur = parseFloat(skipBlanks(cur, lineEnd), lineEnd, p[i])) != nullptr;
+                    if (valid) {
+                        p = trafo * p;
+                        bbox.expandBy(p);
+                        positions.push_back(p);
+                    }
+                } else if (!strcmp(type, "vt")) {
+                    Point2f tc;
+                    for (int i = 0; i < 2 && valid; ++i)
+                        valid = (cur = parseFloat(skipBlanks(cur, lineEnd), lineEnd, tc[i])) != nullptr;
+                    if (valid)
+                        texcoords.push_back(tc);
+                } else if (!strcmp(type, "vn")) {
+                    Normal3f n;
+                    for (int i = 0; i < 3 && valid; ++i)
+                        valid = (cur = parseFloat(skipBlanks(cur, lineEnd), lineEnd, n[i])) != nullptr;
+                    if (valid)
+                        normals.push_back((trafo * n).normalized());
+                } else if (!strcmp(type, "f")) {
+                    /* Further vertices of polygons with more than four are ignored */
+                    OBJVertex verts[6];
+                    int nVertices = 0;
+                    while (nVertices < 4 && valid) {
+                        cur = skipBlanks(cur, lineEnd);
+                        if (cur == lineEnd || *cur == '\r')
+                            break;
+                        valid = (cur = verts[nVertices++].parse(cur, lineEnd)) != nullptr;
+                    }
+                    valid &= nVertices >= 3;
+                    if (valid && nVertices == 4) {
+                        /* This is a quad, split into two triangles */
+                        verts[4] = verts[0];
+                        verts[5] = verts[2];
+                        nVertices = 6;
+                    }
+                    if (valid)
+                        corners.insert(corners.end(), verts, verts + nVertices);
+                }
+
+                if (!valid) {
+                    while (lineEnd != line && isSeparator(lineEnd[-1]))
+                        --lineEnd;
+                    error = std::string(line, lineEnd);
+                    return;
+                }
+            }
         }
     };
 };
@@ -11,17 +11,26 @@ public:
     PathMatsIntegrator(const PropertyList) {}
 
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override {
+        Intersection its;
+        bool hit = scene->rayIntersect(ray, its);
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+               const Intersection *primary) const override {
         // Initial radiance and throughput
         Color3f Li(0);
         Color3f t(1);
         
+        // The first intersection was already computed by the caller
         Intersection x_o;
+        bool is_intersectsScene = primary != nullptr;
+        if (is_intersectsScene)
+            x_o = *primary;
         Ray3f pathRay = ray;
 
         while(true) {
 
-            bool is_intersectsScene = scene->rayIntersect(pathRay, x_o);
-
             // Surface has intersection
             if (is_intersectsScene) {
                 if (x_o.mesh->isEmitter()) {
@@ -50,6 +59,8 @@ public:
                 break;
             } 
             t = t / p;    
+
+            is_intersectsScene = scene->rayIntersect(pathRay, x_o);
         }
         return Li;
     }
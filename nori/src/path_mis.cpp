@@ -11,18 +11,29 @@ public:
     PathMisIntegrator(const PropertyList &props) {}
 
     Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override {
+        Intersection its;
+        bool hit = scene->rayIntersect(ray, its);
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray,
+               const Intersection *primary) const override {
         // Initial radiance and throughput
         Color3f Li(0);
         Color3f t(1);
 
+        // The first intersection was already computed by the caller
         Intersection x_o;
+        bool hit = primary != nullptr;
+        if (hit)
+            x_o = *primary;
         Ray3f pathRay = ray;
 
         auto w_em = 1.f;
         auto w_mat = 1.f;
 
         while (true) {
-            if (scene->rayIntersect(pathRay, x_o)) {
+            if (hit) {
                 // Contribution from mats
                 if (x_o.mesh->isEmitter()) {
                     EmitterQueryRecord lRec(ray.o, x_o.p, x_o.shFrame.n);
@@ -41,7 +52,7 @@ public:
                 EmitterQueryRecord lRec(x_o.p);
                 Color3f LeOverPdf = light->sample(lRec, sampler->next2D()) * scene->getLights().size();
                 // Visibility test uses shadowRay
-                if (!scene->rayIntersect(lRec.shadowRay)) {
+                if (!scene->occluded(lRec.shadowRay)) {
                     auto wi = x_o.shFrame.toLocal(-pathRay.d);
                     auto wo = x_o.shFrame.toLocal(lRec.wi);
                     auto cosTheta = Frame::cosTheta(wo);
@@ -85,6 +96,8 @@ public:
                         }
                     }
                 }
+
+                hit = scene->rayIntersect(pathRay, x_o);
             } else { 
                 break;
             }     
@@ -110,7 +110,14 @@ public:
         m_photonMap->build();
     }
 
-    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &_ray) const override {
+    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &ray) const override {
+        Intersection its;
+        bool hit = scene->rayIntersect(ray, its);
+        return Li(scene, sampler, ray, hit ? &its : nullptr);
+    }
+
+    virtual Color3f Li(const Scene *scene, Sampler *sampler, const Ray3f &_ray,
+                       const Intersection *primary) const override {
     	
 		/* How to find photons?
 		 * std::vector<uint32_t> results;
@@ -130,14 +137,18 @@ public:
 		// put your code for path tracing with photon gathering here
 
 		Ray3f pathRay = _ray;
+        // The first intersection was already computed by the caller
         Intersection xo;
+        bool hit = primary != nullptr;
+        if (hit)
+            xo = *primary;
 
         Color3f t(1);
         Color3f Li(0);
 
         while (true) {
 
-            if (!scene->rayIntersect(pathRay, xo)) {
+            if (!hit) {
                 break;
             }
 
@@ -178,6 +189,7 @@ public:
             t *= bsdfCosThetaOverPdf;
 
             pathRay = Ray3f(xo.p, xo.shFrame.toWorld(bRec.wo));
+            hit = scene->rayIntersect(pathRay, xo);
         }
 		return Li;
     }
@@ -0,0 +1,350 @@
+/*
+    This file is part of Nori, a simple educational ray tracer
+
+    Copyright (c) 2015 by Wenzel Jakob
+
+    Nori is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License Version 3
+    as published by the Free Software Foundation.
+
+    Nori is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <nori/mesh.h>
+#include <nori/mmap.h>
+#include <nori/timer.h>
+#include <filesystem/resolver.h>
+#include <tbb/tbb.h>
+#include <sstream>
+
+NORI_NAMESPACE_BEGIN
+
+/**
+ * \brief Loader for binary little-endian PLY triangle meshes
+ *
+ * Reads the \c x, \c y, \c z, \c nx, \c ny, \c nz and \c u, \c v (or \c s,
+ * \c t) properties of the \c vertex element, and the \c vertex_indices
+ * list of the \c face element. Polygons are split into triangle fans;
+ * all other elements and properties are ignored.
+ *
+ * The file is mapped into memory, and the vertices are decoded and
+ * transformed by \c toWorld in parallel directly into the matrices of
+ * the mesh.
+ */
+class PLYMesh : public Mesh {
+public:
+    PLYMesh(const PropertyList &propList) : Mesh(propList) {
+        filesystem::path filename =
+            getFileResolver()->resolve(propList.getString("filename"));
+        Transform trafo = propList.getTransform("toWorld", Transform());
+        if (shareData(filename, trafo))
+            return;
+
+        cout << "Loading \"" << filename << "\" .. ";
+        cout.flush();
+        Timer timer;
+
+        MemoryMappedFile file(filename.str());
+        const uint8_t *ptr = file.data(), *end = ptr + file.size();
+        std::vector<Element> elements = parseHeader(ptr, end, filename.str());
+
+        /* Locate the data of every element */
+        const Element *vertices = nullptr, *faces = nullptr;
+        for (Element &element : elements) {
+            element.data = ptr;
+            if (!(ptr = element.skip(ptr, end)))
+                throw NoriException("PLY file \"%s\" is truncated!", filename);
+            if (element.name == "vertex")
+                vertices = &element;
+            else if (element.name == "face")
+                faces = &element;
+        }
+        if (!vertices || !faces)
+            throw NoriException("PLY file \"%s\" lacks vertex or face data!", filename);
+        if (vertices->stride == 0)
+            throw NoriException("PLY file \"%s\" has list properties in its vertex element!", filename);
+
+        const Property *x = vertices->find("x"), *y = vertices->find("y"), *z = vertices->find("z"),
+                       *nx = vertices->find("nx"), *ny = vertices->find("ny"), *nz = vertices->find("nz"),
+                       *u = vertices->find("u", "s"), *v = vertices->find("v", "t");
+        if (!x || !y || !z)
+            throw NoriException("PLY file \"%s\" lacks vertex positions!", filename);
+        bool hasNormals = nx && ny && nz, hasTexCoords = u && v;
+
+        /* Decode and transform the vertices */
+        uint32_t vertexCount = vertices->count;
+        MatrixXf V(3, vertexCount), N, UV;
+        if (hasNormals)
+            N.resize(3, vertexCount);
+        if (hasTexCoords)
+            UV.resize(2, vertexCount);
+        m_bbox = tbb::parallel_reduce(
+            tbb::blocked_range<uint32_t>(0u, vertexCount, 1u << 12), BoundingBox3f(),
+            [&](const tbb::blocked_range<uint32_t> &range, BoundingBox3f result) {
+                for (uint32_t i = range.begin(); i != range.end(); ++i) {
+                    const uint8_t *vertex = vertices->data + (size_t) i * vertices->stride;
+                    Point3f p = trafo * Point3f(x->read(vertex), y->read(vertex), z->read(vertex));
+                    V.col(i) = p;
+                    result.expandBy(p);
+                    if (hasNormals)
+                        N.col(i) = (trafo * Normal3f(nx->read(vertex), ny->read(vertex),
+                                                     nz->read(vertex))).normalized();
+                    if (hasTexCoords)
+                        UV.col(i) = Point2f(u->read(vertex), v->read(vertex));
+                }
+                return result;
+            },
+            [](const BoundingBox3f &b1, const BoundingBox3f &b2) {
+                return BoundingBox3f::merge(b1, b2);
+            }
+        );
+
+        /* Count the triangles, then triangulate the faces */
+        const Property *indices = faces->find("vertex_indices", "vertex_index");
+        if (!indices || indices->countType == EInvalid)
+            throw NoriException("PLY file \"%s\" lacks a list of vertex indices!", filename);
+        size_t triangleCount = 0;
+        faces->forEach(indices, [&](const uint8_t *, uint32_t size) {
+            triangleCount += size >= 3 ? size - 2 : 0;
+        });
+        if (triangleCount > (size_t) std::numeric_limits<uint32_t>::max())
+            throw NoriException("PLY file \"%s\" has too many faces!", filename);
+
+        MatrixXu F(3, triangleCount);
+        uint32_t *triangle = F.data();
+        bool valid = true;
+        faces->forEach(indices, [&](const uint8_t *list, uint32_t size) {
+            size_t stride = typeSize(indices->type);
+            for (uint32_t i = 2; i < size; ++i) {
+                double i0 = readValue(list, indices->type),
+                       i1 = readValue(list + (i - 1) * stride, indices->type),
+                       i2 = readValue(list + i * stride, indices->type);
+                valid &= i0 >= 0 && i0 < vertexCount && i1 >= 0 && i1 < vertexCount &&
+                         i2 >= 0 && i2 < vertexCount;
+                *triangle++ = (uint32_t) i0;
+                *triangle++ = (uint32_t) i1;
+                *triangle++ = (uint32_t) i2;
+            }
+        });
+        if (!valid)
+            throw NoriException("PLY file \"%s\" contains out-of-range vertex indices!", filename);
+
+        setData(std::move(V), std::move(F), std::move(N), std::move(UV));
+
+        m_name = filename.str();
+        publishData(filename, trafo);
+        cout << "done. (V=" << getVertexCount() << ", F=" << m_F.cols() << ", took "
+             << timer.elapsedString() << " and " << memString(getDataSize()) << ")" << endl;
+    }
+
+protected:
+    /// Scalar types of PLY properties
+    enum EType {
+        EInvalid = 0, EInt8, EUInt8, EInt16, EUInt16, EInt32, EUInt32, EFloat32, EFloat64
+    };
+
+    /// Property of an element (a scalar, or a list if \c countType is valid)
+    struct Property {
+        std::string name;
+        EType type = EInvalid;
+        EType countType = EInvalid;
+        size_t offset = 0; ///< Offset within the element (only for elements without lists)
+
+        /// Read the value of this scalar property from an element
+        float read(const uint8_t *element) const {
+            return (float) readValue(element + offset, type);
+        }
+    };
+
+    /// Element of a PLY file, such as \c vertex or \c face
+    struct Element {
+        std::string name;
+        uint32_t count = 0;
+        std::vector<Property> properties;
+        size_t stride = 0;              ///< Size of one element (0 if it contains lists)
+        const uint8_t *data = nullptr;
+
+        /// Look up a property by name (or by an alternative name)
+        const Property *find(const std::string &name, const std::string &alt = "") const {
+            for (const Property &property : properties) {
+                if (property.name == name || (!alt.empty() && property.name == alt))
+                    return &property;
+            }
+            return nullptr;
+        }
+
+        /// Return the end of the data of this element, or \c nullptr if the file is truncated
+        const uint8_t *skip(const uint8_t *ptr, const uint8_t *end) const {
+            if (stride != 0)
+                return (size_t) (end - ptr) / stride >= count ? ptr + (size_t) count * stride : nullptr;
+            for (uint32_t i = 0; i < count; ++i) {
+                for (const Property &property : properties) {
+                    size_t size = typeSize(property.countType == EInvalid ? property.type
+                                                                           : property.countType);
+                    if ((size_t) (end - ptr) < size)
+                        return nullptr;
+                    if (property.countType != EInvalid) {
+                        double length = readValue(ptr, property.countType);
+                        ptr += size;
+                        size = length > 0 ? (size_t) length * typeSize(property.type) : 0;
+                        if ((size_t) (end - ptr) < size)
+                            return nullptr;
+                    }
+                    ptr += size;
+                }
+            }
+            return ptr;
+        }
+
+        /// Invoke \c f with the entries and size of a list property of every element (in order)
+        template <typename Functor> void forEach(const Property *list, const Functor &f) const {
+            const uint8_t *ptr = data;
+            for (uint32_t i = 0; i < count; ++i) {
+                for (const Property &property : properties) {
+                    if (property.countType == EInvalid) {
+                        ptr += typeSize(property.type);
+                        continue;
+                    }
+                    double length = readValue(ptr, property.countType);
+                    uint32_t size = length > 0 ? (uint32_t) length : 0;
+                    ptr += typeSize(property.countType);
+                    if (&property == list)
+                        f(ptr, size);
+                    ptr += (size_t) size * typeSize(property.type);
+                }
+            }
+        }
+    };
+
+    /// Parse the header and advance \c ptr to the start of the data
+    static std::vector<Element> parseHeader(const uint8_t *&ptr, const uint8_t *end,
+                                            const std::string &filename) {
+        std::vector<Element> elements;
+        bool first = true;
+        while (true) {
+            const uint8_t *lineEnd = (const uint8_t *) memchr(ptr, '\n', (size_t) (end - ptr));
+            if (!lineEnd)
+                throw NoriException("PLY file \"%s\" has an incomplete header!", filename);
+            std::istringstream line(std::string((const char *) ptr, (const char *) lineEnd));
+            ptr = lineEnd + 1;
+
+            std::string keyword;
+            line >> keyword;
+            if (first) {
+                if (keyword != "ply")
+                    throw NoriException("\"%s\" is not a PLY file!", filename);
+                first = false;
+            } else if (keyword == "format") {
+                std::string format;
+                line >> format;
+                if (format != "binary_little_endian")
+                    throw NoriException("PLY file \"%s\" uses the unsupported format \"%s\" "
+                                        "(only binary_little_endian is supported)!", filename, format);
+            } else if (keyword == "element") {
+                Element element;
+                int64_t count = -1;
+                line >> element.name >> count;
+                if (line.fail() || count < 0 || count > (int64_t) std::numeric_limits<uint32_t>::max())
+                    throw NoriException("PLY file \"%s\" has an invalid element declaration!", filename);
+                element.count = (uint32_t) count;
+                elements.push_back(element);
+            } else if (keyword == "property") {
+                if (elements.empty())
+                    throw NoriException("PLY file \"%s\" declares a property outside of an element!", filename);
+                Property property;
+                std::string type;
+                line >> type;
+                if (type == "list") {
+                    std::string countType;
+                    line >> countType >> type;
+                    property.countType = parseType(countType);
+                    if (property.countType == EInvalid || property.countType == EFloat32 ||
+                        property.countType == EFloat64)
+                        throw NoriException("PLY file \"%s\" has an invalid list size type \"%s\"!",
+                                            filename, countType);
+                }
+                line >> property.name;
+                if ((property.type = parseType(type)) == EInvalid)
+                    throw NoriException("PLY file \"%s\" has an invalid property type \"%s\"!",
+                                        filename, type);
+                elements.back().properties.push_back(property);
+            } else if (keyword == "end_header") {
+                break;
+            } else if (keyword != "comment" && keyword != "obj_info" && !keyword.empty()) {
+                throw NoriException("PLY file \"%s\" has an invalid header line \"%s\"!",
+                                    filename, line.str());
+            }
+        }
+
+        /* Compute the property offsets of elements without lists */
+        for (Element &element : elements) {
+            size_t offset = 0;
+            for (Property &property : element.properties) {
+                if (property.countType != EInvalid) {
+                    offset = 0;
+                    break;
+                }
+                property.offset = offset;
+                offset += typeSize(property.type);
+            }
+            element.stride = offset;
+        }
+        return elements;
+    }
+
+    /// Map a type name of the PLY format to the corresponding \ref EType
+    static EType parseType(const std::string &name) {
+        if (name == "char" || name == "int8")
+            return EInt8;
+        else if (name == "uchar" || name == "uint8")
+            return EUInt8;
+        else if (name == "short" || name == "int16")
+            return EInt16;
+        else if (name == "ushort" || name == "uint16")
+            return EUInt16;
+        else if (name == "int" || name == "int32")
+            return EInt32;
+        else if (name == "uint" || name == "uint32")
+            return EUInt32;
+        else if (name == "float" || name == "float32")
+            return EFloat32;
+        else if (name == "double" || name == "float64")
+            return EFloat64;
+        return EInvalid;
+    }
+
+    /// Return the size of a value of the given type in bytes
+    static size_t typeSize(EType type) {
+        switch (type) {
+            case EInt8: case EUInt8: return 1;
+            case EInt16: case EUInt16: return 2;
+            case EInt32: case EUInt32: case EFloat32: return 4;
+            case EFloat64: return 8;
+            default: return 0;
+        }
+    }
+
+    /// Read a (possibly unaligned) little-endian value of the given type
+    static double readValue(const uint8_t *ptr, EType type) {
+        switch (type) {
+            case EInt8: return (double) *(const int8_t *) ptr;
+            case EUInt8: return (double) *ptr;
+            case EInt16: { int16_t value; memcpy(&value, ptr, sizeof(value)); return value; }
+            case EUInt16: { uint16_t value; memcpy(&value, ptr, sizeof(value)); return value; }
+            case EInt32: { int32_t value; memcpy(&value, ptr, sizeof(value)); return value; }
+            case EUInt32: { uint32_t value; memcpy(&value, ptr, sizeof(value)); return value; }
+            case EFloat32: { float value; memcpy(&value, ptr, sizeof(value)); return value; }
+            case EFloat64: { double value; memcpy(&value, ptr, sizeof(value)); return value; }
+            default: return 0;
+        }
+    }
+};
+
+NORI_REGISTER_CLASS(PLYMesh, "ply");
+NORI_NAMESPACE_END
@@ -25,7 +25,6 @@
 #include <nori/bitmap.h>
 #include <nori/sampler.h>
 #include <nori/integrator.h>
-#include <nori/gui.h>
 #include <tbb/parallel_for.h>
 #include <tbb/blocked_range.h>
 #include <filesystem/resolver.h>
@@ -79,25 +78,97 @@ static void renderBlock(const Scene *scene, Sampler *sampler, ImageBlock &block)
     /* Clear the block contents */
     block.clear();
 
+    /* Camera rays of neighboring pixels are traced together as a packet */
+    const int packetSize = 8;
+    Point2f pixelSamples[packetSize];
+    Color3f values[packetSize];
+    Ray3f rays[packetSize];
+    Intersection its[packetSize];
+    bool hit[packetSize];
+
     /* For each pixel and pixel sample sample */
     for (int y=0; y<size.y(); ++y) {
-        for (int x=0; x<size.x(); ++x) {
-            Point2f pixelSample = Point2f((float) (x + offset.x()), (float) (y + offset.y())) + sampler->next2D();
-            Point2f apertureSample = sampler->next2D();
+        for (int x=0; x<size.x(); x += packetSize) {
+            int count = std::min(packetSize, size.x() - x);
+
+            for (int i=0; i<count; ++i) {
+                pixelSamples[i] = Point2f((float) (x + i + offset.x()), (float) (y + offset.y())) + sampler->next2D();
+                Point2f apertureSample = sampler->next2D();
 
-            /* Sample a ray from the camera */
-            Ray3f ray;
-            Color3f value = camera->sampleRay(ray, pixelSample, apertureSample);
+                /* Sample a ray from the camera */
+                values[i] = camera->sampleRay(rays[i], pixelSamples[i], apertureSample);
+            }
 
-            /* Compute the incident radiance */
-            value *= integrator->Li(scene, sampler, ray);
+            /* Find the first intersection of all rays at once */
+            scene->rayIntersectPacket(rays, its, hit, count);
 
-            /* Store in the image block */
-            block.put(pixelSample, value);
+            for (int i=0; i<count; ++i) {
+                /* Compute the incident radiance */
+                values[i] *= integrator->Li(scene, sampler, rays[i], hit[i] ? &its[i] : nullptr);
+
+                /* Store in the image block */
+                block.put(pixelSamples[i], values[i]);
+            }
         }
     }
 }
 
+bool renderImage(const Scene *scene, ImageBlock &result, uint32_t sampleCount,
+                 const std::function<bool(float)> &callback) {
+    const Camera *camera = scene->getCamera();
+    Vector2i outputSize = camera->getOutputSize();
+
+    /* Create a block generator (i.e. a work scheduler) */
+    BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
+
+    auto numBlocks = blockGenerator.getBlockCount();
+
+    tbb::concurrent_vector< std::unique_ptr<Sampler> > samplers;
+    samplers.resize(numBlocks);
+
+    for (uint32_t k = 0; k < sampleCount ; ++k) {
+        if (callback && !callback(k/float(sampleCount)))
+            return false;
+
+        tbb::blocked_range<int> range(0, numBlocks);
+
+        auto map = [&](const tbb::blocked_range<int> &range) {
+            // Allocate memory for a small image block to be rendered by the current thread
+            ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
+                             camera->getReconstructionFilter());
+
+            for (int i = range.begin(); i < range.end(); ++i) {
+                // Request an image block from the block generator
+                blockGenerator.next(block);
+
+                // Get block id to continue using the same sampler
+                auto blockId = block.getBlockId();
+                if(k == 0) { // Initialize the sampler for the first sample
+                    std::unique_ptr<Sampler> sampler(scene->getSampler()->clone());
+                    sampler->prepare(block);
+                    samplers.at(blockId) = std::move(sampler);
+                }
+
+                // Render all contained pixels
+                renderBlock(scene, samplers.at(blockId).get(), block);
+
+                // The image block has been processed. Now add it to the "big" block that represents the entire image
+                result.put(block);
+            }
+        };
+
+        /// Uncomment the following line for single threaded rendering
+        //map(range);
+
+        /// Default: parallel rendering
+        tbb::parallel_for(range, map);
+
+        blockGenerator.reset();
+    }
+
+    return true;
+}
+
 void RenderThread::renderScene(const std::string & filename) {
 
     filesystem::path path(filename);
@@ -130,62 +201,16 @@ void RenderThread::renderScene(const std::string & filename) {
         /* Do the following in parallel and asynchronously */
         m_render_status = 1;
         m_render_thread = std::thread([this,outputName] {
-            const Camera *camera = m_scene->getCamera();
-            Vector2i outputSize = camera->getOutputSize();
-
-            /* Create a block generator (i.e. a work scheduler) */
-            BlockGenerator blockGenerator(outputSize, NORI_BLOCK_SIZE);
-
             cout << "Rendering .. ";
             cout.flush();
             Timer timer;
 
-            auto numSamples = m_scene->getSampler()->getSampleCount();
-            auto numBlocks = blockGenerator.getBlockCount();
-
-            tbb::concurrent_vector< std::unique_ptr<Sampler> > samplers;
-            samplers.resize(numBlocks);
-
-            for (uint32_t k = 0; k < numSamples ; ++k) {
-                m_progress = k/float(numSamples);
-                if(m_render_status == 2)
-                    break;
-
-                tbb::blocked_range<int> range(0, numBlocks);
-
-                auto map = [&](const tbb::blocked_range<int> &range) {
-                    // Allocate memory for a small image block to be rendered by the current thread
-                    ImageBlock block(Vector2i(NORI_BLOCK_SIZE),
-                                     camera->getReconstructionFilter());
-
-                    for (int i = range.begin(); i < range.end(); ++i) {
-                        // Request an image block from the block generator
-                        blockGenerator.next(block);
-
-                        // Get block id to continue using the same sampler
-                        auto blockId = block.getBlockId();
-                        if(k == 0) { // Initialize the sampler for the first sample
-                            std::unique_ptr<Sampler> sampler(m_scene->getSampler()->clone());
-                            sampler->prepare(block);
-                            samplers.at(blockId) = std::move(sampler);
-                        }
-
-                        // Render all contained pixels
-                        renderBlock(m_scene, samplers.at(blockId).get(), block);
-
-                        // The image block has been processed. Now add it to the "big" block that represents the entire image
-                        m_block.put(block);
-                    }
-                };
-
-                /// Uncomment the following line for single threaded rendering
-                //map(range);
-
-                /// Default: parallel rendering
-                tbb::parallel_for(range, map);
-
-                blockGenerator.reset();
-            }
+            renderImage(m_scene, m_block, (uint32_t) m_scene->getSampler()->getSampleCount(),
+                [this](float progress) {
+                    m_progress = progress;
+                    return m_render_status != 2;
+                }
+            );
 
             cout << "done. (took " << timer.elapsedString() << ")" << endl;
 
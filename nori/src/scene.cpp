@@ -25,8 +25,8 @@
 
 NORI_NAMESPACE_BEGIN
 
-Scene::Scene(const PropertyList &) {
-    m_bvh = new BVH();
+Scene::Scene(const PropertyList &propList) {
+    m_bvh = new BVH(propList);
 }
 
 Scene::~Scene() {